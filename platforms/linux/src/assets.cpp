@@ -6,12 +6,14 @@
 #include <lua.h>
 #include <subhook.h>
 
-#include <fstream>
 #include <map>
 #include <string>
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <dsl/Archive.hh>
 #include <dsl/DB.hh>
@@ -229,45 +231,106 @@ namespace blt
 		// recode them
 		if (type != asset_t::PLAIN)
 		{
-			// Create a datastore. This is what you might call a backing object, which the archive will refer to.
-			// Note that the archive will delete the datastore when it's done, so this isn't a memory leak.
-			auto* datastore = new StringDataStore("");
+			// Map the file rather than reading it, since the parsers only ever need to look at it once and
+			// the recoded result is built directly into the datastore
+			int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd == -1)
+			{
+				string err = "Cannot open registered asset " + filename;
+				log::log(err, log::LOG_ERROR);
+				throw err;
+			}
+
+			size_t length = buffer.st_size;
+			const uint8_t* mapped = nullptr;
+			void* mapping = MAP_FAILED;
+			if (length > 0)
+			{
+				mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapping == MAP_FAILED)
+				{
+					close(fd);
+					string err = "Cannot map registered asset " + filename;
+					log::log(err, log::LOG_ERROR);
+					throw err;
+				}
+				mapped = (const uint8_t*)mapping;
+			}
+			close(fd);
+
+			// Assets that have already been converted (eg, by sblt-recode) can be loaded like any other file
+			bool native = false;
+			try
+			{
+				if (type == asset_t::SCRIPTDATA)
+					native = !pd2hook::scriptdata::determine_is_32bit(length, mapped);
+				else if (type == asset_t::FONT)
+					native = !pd2hook::scriptdata::font::FontData::is32bit(length, mapped);
+			}
+			catch (const std::runtime_error&)
+			{
+				// Too short to tell, let the parser below report it
+			}
 
-			// Read the file in question
-			std::ifstream in(filename, std::ios::in | std::ios::binary);
-			if (!in)
+			if (native)
 			{
-				// TODO error message
-				abort();
+				munmap(mapping, length);
+				dsl_fss_open(target, &db->stack, &cxxstr);
+				return;
 			}
 
+			// Create a datastore. This is what you might call a backing object, which the archive will refer to.
+			// Note that the archive will delete the datastore when it's done, so this isn't a memory leak.
+			auto* datastore = new StringDataStore("");
 			std::string& contents = datastore->contents;
-			in.seekg(0, std::ios::end);
-			contents.resize(in.tellg());
-			in.seekg(0, std::ios::beg);
-			in.read(&contents[0], contents.size());
-			in.close();
 
+			bool recoded = false;
 			switch (type)
 			{
 			case asset_t::SCRIPTDATA:
 			{
-				pd2hook::scriptdata::ScriptData sd(contents.size(), (const uint8_t*)contents.c_str());
-				contents = sd.GetRoot()->Serialise(false);
+				try
+				{
+					pd2hook::scriptdata::ScriptData sd(length, mapped);
+					contents = sd.GetRoot()->Serialise(false);
+					recoded = true;
+				}
+				catch (const pd2hook::scriptdata::ScriptDataError& ex)
+				{
+					// Pass the file through untouched rather than taking the game down with a bad mod asset
+					log::log("Cannot recode scriptdata asset " + filename + ": " + ex.what(), log::LOG_ERROR);
+				}
 				break;
 			}
 			case asset_t::FONT:
 			{
-				pd2hook::scriptdata::font::FontData fd(contents);
-				contents = fd.Export(false);
+				try
+				{
+					pd2hook::scriptdata::font::FontData fd(length, mapped);
+					contents = fd.Export(false);
+					recoded = true;
+				}
+				catch (const std::runtime_error& ex)
+				{
+					log::log("Cannot recode font asset " + filename + ": " + ex.what(), log::LOG_ERROR);
+				}
 				break;
 			}
 			default:
 				string msg = "Unknown asset typecode " + to_string(type) +
 				             " - this is probably a bug in SuperBLT, please report it";
+				if (mapping != MAP_FAILED)
+					munmap(mapping, length);
+				delete datastore;
 				throw msg;
 			}
 
+			if (!recoded && length > 0)
+				contents.assign((const char*)mapped, length);
+
+			if (mapping != MAP_FAILED)
+				munmap(mapping, length);
+
 			// Create an archive using our datastore, in the memory location passed in (this is how
 			// an object is returned in C++ - memory is allocated by the caller, and the pointer is passed
 			// in the first argument, even before "this").
@@ -141,8 +141,9 @@ namespace blt
 		hook_remove(nodeFromXMLDetour);
 
 		// TODO move into the standard interface API
-		char *newstr = (char*) pd2hook::tweaker::tweak_pd2_xml((char*) string, length);
-		node_from_xml(this_, newstr, length, something);
+		int newlength = (int) length;
+		char *newstr = (char*) pd2hook::tweaker::tweak_pd2_xml((char*) string, length, &newlength);
+		node_from_xml(this_, newstr, newlength, something);
 		pd2hook::tweaker::free_tweaked_pd2_xml(newstr);
 	}
 
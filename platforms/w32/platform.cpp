@@ -97,12 +97,8 @@ static void __fastcall edit_node_from_xml_hook(int arg);
 
 static void __cdecl node_from_xml_new(void* node, char* data, int* len)
 {
-	char *modded = pd2hook::tweaker::tweak_pd2_xml(data, *len);
 	int modLen = *len;
-
-	if (modded != data) {
-		modLen = strlen(modded);
-	}
+	char *modded = pd2hook::tweaker::tweak_pd2_xml(data, *len, &modLen);
 
 	edit_node_from_xml_hook(false);
 	node_from_xml(node, modded, &modLen);
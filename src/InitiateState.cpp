@@ -12,9 +12,13 @@
 #include "debug/blt_debug.h"
 #include "xaudio/XAudio.h"
 #include "tweaker/xmltweaker.h"
+#include "tweaker/tweak_cache.h"
+#include "tweaker/wren_heap.h"
+#include "tweaker/wrenloader.h"
 #include "tweaker/wren_lua_interface.h"
 #include "plugins/plugins.h"
 #include "scriptdata/ScriptData.h"
+#include "scriptdata/ScriptDataPatch.h"
 #include "luautil/luautil.h"
 #include "luautil/LuaAssetDb.h"
 #include "luautil/LuaAsyncIO.h"
@@ -603,7 +607,7 @@ namespace pd2hook
 		}
 	}
 
-	static const char* mxml_last_error = NULL;
+	static thread_local const char* mxml_last_error = NULL;
 	static void handle_mxml_error(const char* error)
 	{
 		mxml_last_error = error;
@@ -613,7 +617,7 @@ namespace pd2hook
 	{
 		const char *xml = lua_tostring(L, 1);
 
-		mxmlSetErrorCallback(handle_mxml_error);
+		tweaker::wrenxml::set_mxml_error_handler(handle_mxml_error);
 
 		mxml_node_t *tree = mxmlLoadString(NULL, xml, MXML_IGNORE_CALLBACK);
 
@@ -709,6 +713,114 @@ namespace pd2hook
 		return 0;
 	}
 
+	// Counters for the XML tweaker since the current Lua state was created
+	int luaF_tweakstats(lua_State* L)
+	{
+		tweaker::tweak_stats stats = tweaker::get_tweak_stats(false);
+
+		lua_newtable(L);
+
+		lua_pushnumber(L, (lua_Number) stats.parsed);
+		lua_setfield(L, -2, "parsed");
+
+		lua_pushnumber(L, (lua_Number) stats.unregistered);
+		lua_setfield(L, -2, "skipped");
+
+		lua_pushnumber(L, (lua_Number) stats.transformed);
+		lua_setfield(L, -2, "transformed");
+
+		lua_pushnumber(L, (lua_Number) stats.streamed);
+		lua_setfield(L, -2, "streamed");
+
+		tweaker::tweak_cache::cache_stats cache = tweaker::tweak_cache::get_stats(false);
+
+		lua_pushnumber(L, (lua_Number) cache.hits);
+		lua_setfield(L, -2, "cached");
+
+		lua_pushnumber(L, (lua_Number) cache.disk_hits);
+		lua_setfield(L, -2, "cached_from_disk");
+
+		lua_pushnumber(L, (lua_Number) cache.uncacheable);
+		lua_setfield(L, -2, "uncacheable");
+
+		lua_pushnumber(L, (lua_Number) cache.memory_used);
+		lua_setfield(L, -2, "cache_memory");
+
+		return 1;
+	}
+
+	int luaF_wrenstats(lua_State* L)
+	{
+		tweaker::wren_heap::heap_stats stats = tweaker::wren_heap::get_stats(false);
+
+		lua_newtable(L);
+
+		lua_pushnumber(L, (lua_Number) stats.live_bytes);
+		lua_setfield(L, -2, "live_bytes");
+
+		lua_pushnumber(L, (lua_Number) stats.peak_bytes);
+		lua_setfield(L, -2, "peak_bytes");
+
+		lua_pushnumber(L, (lua_Number) stats.allocations);
+		lua_setfield(L, -2, "allocations");
+
+		lua_pushnumber(L, (lua_Number) stats.frees);
+		lua_setfield(L, -2, "frees");
+
+		lua_pushnumber(L, (lua_Number) stats.collections);
+		lua_setfield(L, -2, "collections");
+
+		// In seconds, like os.clock
+		lua_pushnumber(L, (lua_Number) stats.gc_time_us / 1000000.0);
+		lua_setfield(L, -2, "gc_time");
+
+		lua_pushnumber(L, (lua_Number) stats.max_gc_pause_us / 1000000.0);
+		lua_setfield(L, -2, "max_gc_pause");
+
+		return 1;
+	}
+
+	// Counters for the events (async IO, HTTP and hash callbacks) run since the current Lua state was created
+	int luaF_eventstats(lua_State* L)
+	{
+		EventQueueMaster& master = EventQueueMaster::GetSingleton();
+		EventQueueStats stats = master.GetStats(false);
+
+		lua_newtable(L);
+
+		lua_pushnumber(L, (lua_Number) stats.frames);
+		lua_setfield(L, -2, "frames");
+
+		lua_pushnumber(L, (lua_Number) stats.events);
+		lua_setfield(L, -2, "events");
+
+		lua_pushnumber(L, (lua_Number) stats.deferredEvents);
+		lua_setfield(L, -2, "deferred_events");
+
+		lua_pushnumber(L, (lua_Number) stats.deferredFrames);
+		lua_setfield(L, -2, "deferred_frames");
+
+		// In seconds, like os.clock
+		lua_pushnumber(L, (lua_Number) stats.worstFrameUs / 1000000.0);
+		lua_setfield(L, -2, "worst_frame");
+
+		lua_pushnumber(L, (lua_Number) master.GetFrameBudget().count() / 1000000.0);
+		lua_setfield(L, -2, "budget");
+
+		return 1;
+	}
+
+	// Arguments: number(seconds) or nil to remove the limit
+	int luaF_set_event_budget(lua_State* L)
+	{
+		double seconds = lua_isnoneornil(L, 1) ? 0 : luaL_checknumber(L, 1);
+		if (seconds < 0)
+			seconds = 0;
+
+		EventQueueMaster::GetSingleton().SetFrameBudget(std::chrono::microseconds((long long) (seconds * 1000000)));
+		return 0;
+	}
+
 	int luaF_load_native(lua_State* L)
 	{
 		std::string file(lua_tostring(L, 1));
@@ -794,8 +906,313 @@ namespace pd2hook
 		bool is32bit = lua_toboolean(L, -1);
 		lua_pop(L, 1);
 
-		pd2hook::scriptdata::ScriptData sd(len, (const uint8_t*) data);
-		std::string out = sd.GetRoot()->Serialise(is32bit);
+		// Write each distinct value only once, see SItem::Serialise
+		lua_getfield(L, 2, "intern");
+		bool intern = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		std::string out;
+		std::string error;
+		try
+		{
+			pd2hook::scriptdata::ScriptData sd(len, (const uint8_t*) data);
+			out = sd.GetRoot()->Serialise(is32bit, intern);
+		}
+		catch (const pd2hook::scriptdata::ScriptDataError& ex)
+		{
+			// Don't call luaL_error in here, it'd longjmp past the exception's destructor
+			error = ex.what();
+		}
+
+		if (!error.empty())
+		{
+			luaL_error(L, "blt.scriptdata.recode: %s", error.c_str());
+		}
+
+		lua_pushlstring(L, out.c_str(), out.length());
+		return 1;
+	}
+
+	// Convert a Lua value to something that can be written into a scriptdata document. Most Lua values map directly,
+	// plain tables are treated as arrays and other types are written as tagged tables - see blt.scriptdata.patch.
+	// This can't use luaL_error since patch_value has a destructor, so it returns false and sets error instead.
+	static bool sd_read_patch_value(lua_State *L, int index, pd2hook::scriptdata::patch_value &out, std::string &error,
+		int depth = 0)
+	{
+		using pd2hook::scriptdata::patch_value;
+
+		if (index < 0)
+			index = lua_gettop(L) + index + 1;
+
+		if (depth > 64)
+		{
+			error = "value nested too deeply (does a table contain itself?)";
+			return false;
+		}
+
+		switch (lua_type(L, index))
+		{
+		case LUA_TNIL:
+			out.type = patch_value::NIL;
+			return true;
+		case LUA_TBOOLEAN:
+			out.type = patch_value::BOOL;
+			out.boolean = lua_toboolean(L, index);
+			return true;
+		case LUA_TNUMBER:
+			out.type = patch_value::NUMBER;
+			out.numbers[0] = (float) lua_tonumber(L, index);
+			return true;
+		case LUA_TSTRING:
+		{
+			size_t len;
+			const char *str = lua_tolstring(L, index, &len);
+			out.type = patch_value::STRING;
+			out.string.assign(str, len);
+			return true;
+		}
+		case LUA_TTABLE:
+			break;
+		default:
+			error = std::string("cannot store a ") + lua_typename(L, lua_type(L, index)) + " in scriptdata";
+			return false;
+		}
+
+		lua_getfield(L, index, "_type");
+		std::string type = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+		lua_pop(L, 1);
+
+		if (type == "vector" || type == "quaternion")
+		{
+			out.type = type == "vector" ? patch_value::VECTOR : patch_value::QUATERNION;
+			int count = type == "vector" ? 3 : 4;
+			for (int i = 0; i < count; i++)
+			{
+				lua_rawgeti(L, index, i + 1);
+				out.numbers[i] = (float) lua_tonumber(L, -1);
+				lua_pop(L, 1);
+			}
+			return true;
+		}
+		else if (type == "idstring")
+		{
+			// Either a string to hash, or an @-prefixed hex hash like everywhere else
+			lua_rawgeti(L, index, 1);
+			std::string value = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+			lua_pop(L, 1);
+
+			out.type = patch_value::IDSTRING;
+			if (value.size() == 17 && value[0] == '@')
+			{
+				char *end = nullptr;
+				out.idstring = strtoull(value.c_str() + 1, &end, 16);
+				if (*end)
+				{
+					error = "invalid idstring '" + value + "'";
+					return false;
+				}
+			}
+			else
+			{
+				out.idstring = blt::idstring_hash(value);
+			}
+			return true;
+		}
+		else if (type == "table")
+		{
+			// Tables with string keys are given as a list of {key, value} pairs, since we can't iterate through
+			// an arbitrary table here.
+			out.type = patch_value::TABLE;
+
+			lua_getfield(L, index, "meta");
+			if (lua_type(L, -1) == LUA_TSTRING)
+			{
+				out.has_meta = true;
+				out.meta = lua_tostring(L, -1);
+			}
+			lua_pop(L, 1);
+
+			int count = lua_objlen(L, index);
+			out.items.resize(count);
+			for (int i = 0; i < count; i++)
+			{
+				lua_rawgeti(L, index, i + 1);
+				int pair = lua_gettop(L);
+				if (lua_type(L, pair) != LUA_TTABLE)
+				{
+					lua_pop(L, 1);
+					error = "table entries must be {key, value} pairs";
+					return false;
+				}
+
+				lua_rawgeti(L, pair, 1);
+				bool ok = sd_read_patch_value(L, -1, out.items[i].first, error, depth + 1);
+				lua_pop(L, 1);
+
+				lua_rawgeti(L, pair, 2);
+				ok = ok && sd_read_patch_value(L, -1, out.items[i].second, error, depth + 1);
+				lua_pop(L, 2);
+
+				if (!ok)
+					return false;
+			}
+			return true;
+		}
+		else if (!type.empty())
+		{
+			error = "unknown value type '" + type + "'";
+			return false;
+		}
+
+		// A plain table, which is an array
+		out.type = patch_value::TABLE;
+		int count = lua_objlen(L, index);
+		out.items.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			out.items[i].first.type = patch_value::NUMBER;
+			out.items[i].first.numbers[0] = (float) (i + 1);
+
+			lua_rawgeti(L, index, i + 1);
+			bool ok = sd_read_patch_value(L, -1, out.items[i].second, error, depth + 1);
+			lua_pop(L, 1);
+
+			if (!ok)
+				return false;
+		}
+		return true;
+	}
+
+	static bool sd_read_patch(lua_State *L, int index, std::vector<pd2hook::scriptdata::patch_op> &ops, std::string &error)
+	{
+		using pd2hook::scriptdata::patch_op;
+		using pd2hook::scriptdata::patch_value;
+
+		int count = lua_objlen(L, index);
+		ops.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			patch_op &op = ops[i];
+			std::string prefix = "operation " + std::to_string(i + 1) + ": ";
+
+			lua_rawgeti(L, index, i + 1);
+			int op_idx = lua_gettop(L);
+			if (lua_type(L, op_idx) != LUA_TTABLE)
+			{
+				lua_pop(L, 1);
+				error = prefix + "not a table";
+				return false;
+			}
+
+			lua_rawgeti(L, op_idx, 1);
+			std::string name = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+			lua_pop(L, 1);
+
+			if (name == "set")
+				op.op = patch_op::SET;
+			else if (name == "remove")
+				op.op = patch_op::REMOVE;
+			else if (name == "insert")
+				op.op = patch_op::INSERT;
+			else
+			{
+				lua_pop(L, 1);
+				error = prefix + "unknown operation '" + name + "'";
+				return false;
+			}
+
+			// The path may be a single key, or a list of them
+			lua_rawgeti(L, op_idx, 2);
+			int path_idx = lua_gettop(L);
+			bool ok = true;
+			if (lua_type(L, path_idx) == LUA_TTABLE)
+			{
+				int path_len = lua_objlen(L, path_idx);
+				op.path.resize(path_len);
+				for (int j = 0; j < path_len && ok; j++)
+				{
+					lua_rawgeti(L, path_idx, j + 1);
+					ok = sd_read_patch_value(L, -1, op.path[j], error);
+					lua_pop(L, 1);
+				}
+			}
+			else if (!lua_isnil(L, path_idx))
+			{
+				op.path.resize(1);
+				ok = sd_read_patch_value(L, path_idx, op.path[0], error);
+			}
+			lua_pop(L, 1);
+
+			if (ok)
+			{
+				lua_rawgeti(L, op_idx, 3);
+				ok = sd_read_patch_value(L, -1, op.value, error);
+				lua_pop(L, 1);
+			}
+
+			lua_rawgeti(L, op_idx, 4);
+			op.position = lua_type(L, -1) == LUA_TNUMBER ? (size_t) lua_tointeger(L, -1) : 0;
+			lua_pop(L, 2); // Position and the operation table
+
+			if (!ok)
+			{
+				error = prefix + error;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	int luaF_sd_patch(lua_State *L)
+	{
+		size_t len;
+		const char *data = luaL_checklstring(L, 1, &len);
+
+		if (lua_type(L, 2) != LUA_TTABLE)
+		{
+			luaL_error(L, "Second argument to blt.scriptdata.patch must be a table");
+		}
+
+		// By default, write the patched file out in the same format it came in
+		bool is32bit = pd2hook::scriptdata::determine_is_32bit(len, (const uint8_t*) data);
+		bool intern = false;
+		if (lua_type(L, 3) == LUA_TTABLE)
+		{
+			lua_getfield(L, 3, "is32bit");
+			if (!lua_isnil(L, -1))
+				is32bit = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+
+			lua_getfield(L, 3, "intern");
+			intern = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+
+		std::string out;
+		std::string error;
+		{
+			std::vector<pd2hook::scriptdata::patch_op> ops;
+			if (sd_read_patch(L, 2, ops, error))
+			{
+				try
+				{
+					pd2hook::scriptdata::ScriptData sd(len, (const uint8_t*) data);
+					pd2hook::scriptdata::apply_patch(sd, ops);
+					out = sd.GetRoot()->Serialise(is32bit, intern);
+				}
+				catch (const std::runtime_error& ex)
+				{
+					// Covers both ScriptDataError and PatchError
+					error = ex.what();
+				}
+			}
+		}
+
+		if (!error.empty())
+		{
+			luaL_error(L, "blt.scriptdata.patch: %s", error.c_str());
+		}
 
 		lua_pushlstring(L, out.c_str(), out.length());
 		return 1;
@@ -807,6 +1224,7 @@ namespace pd2hook
 		{
 			{ "identify", luaF_sd_identify },
 			{ "recode", luaF_sd_recode },
+			{ "patch", luaF_sd_patch },
 			{ NULL, NULL }
 		};
 		lua_newtable(L); // create the scriptdata table
@@ -819,7 +1237,40 @@ namespace pd2hook
 	void luaF_close(lua_State* L)
 	{
 		remove_active_state(L);
+		close_lua_async_io(L);
 		lua_close(L);
+
+		// Each load (a heist, or going back to the menu) gets a new state, so this gives per-load numbers
+		tweaker::tweak_stats stats = tweaker::get_tweak_stats(true);
+		tweaker::tweak_cache::cache_stats cache = tweaker::tweak_cache::get_stats(true);
+		if (stats.parsed)
+		{
+			PD2HOOK_LOG_LOG("XML tweaker: " + std::to_string(stats.parsed) + " files parsed, " +
+				std::to_string(stats.streamed) + " changed by declarative tweaks, " +
+				std::to_string(stats.transformed) + " sent to Wren, " + std::to_string(stats.unregistered) +
+				" skipped as no mod tweaks them, " + std::to_string(cache.hits) + " from the cache (" +
+				std::to_string(cache.disk_hits) + " from disk)");
+		}
+
+		// Like the tweaker stats, these are reset each time, so the peak and counts only cover this load. The VMs
+		// outlive the Lua state though, so the live size is everything Wren is holding on to.
+		tweaker::wren_heap::heap_stats heap = tweaker::wren_heap::get_stats(true);
+		if (heap.allocations)
+		{
+			PD2HOOK_LOG_LOG("Wren heap this load: " + std::to_string(heap.live_bytes / 1024) + "KB live, " +
+				std::to_string(heap.peak_bytes / 1024) + "KB peak, " + std::to_string(heap.allocations) +
+				" allocations, " + std::to_string(heap.collections) + " collections taking " +
+				std::to_string(heap.gc_time_us / 1000) + "ms (longest " + std::to_string(heap.max_gc_pause_us / 1000) +
+				"ms)");
+		}
+
+		EventQueueStats events = EventQueueMaster::GetSingleton().GetStats(true);
+		if (events.deferredFrames)
+		{
+			PD2HOOK_LOG_LOG("Events: " + std::to_string(events.events) + " run, " +
+				std::to_string(events.deferredEvents) + " deferred over " + std::to_string(events.deferredFrames) +
+				" frames, the slowest frame took " + std::to_string(events.worstFrameUs / 1000) + "ms");
+		}
 	}
 
 	void InitiateStates()
@@ -838,6 +1289,7 @@ namespace pd2hook
 
 	void DestroyStates()
 	{
+		pd2hook::wren::close_wren_vm();
 		blt::platform::ClosePlatform();
 	}
 
@@ -967,6 +1419,10 @@ namespace blt
 				{ "parsexml", luaF_parsexml },
 				{ "structid", luaF_structid },
 				{ "ignoretweak", luaF_ignoretweak },
+				{ "tweakstats", luaF_tweakstats },
+				{ "wrenstats", luaF_wrenstats },
+				{ "eventstats", luaF_eventstats },
+				{ "set_event_budget", luaF_set_event_budget },
 				{ "load_native", luaF_load_native },
 				{ "blt_info", luaF_blt_info },
 
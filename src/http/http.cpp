@@ -5,6 +5,9 @@
 #include "util/util.h"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <thread>
 
 namespace pd2hook
@@ -29,9 +32,39 @@ namespace pd2hook
 
 	using HTTPProgressNotificationPtr = std::unique_ptr<HTTPProgressNotification>;
 	using HTTPItemPtr = std::unique_ptr<HTTPItem>;
-	PD2HOOK_REGISTER_EVENTQUEUE(HTTPProgressNotificationPtr, HTTPProgressNotification)
+	// Progress notifications point to the item, so they must all run before the request's completion event, which
+	// then frees it
+	PD2HOOK_REGISTER_EVENTQUEUE_PRIORITY(HTTPProgressNotificationPtr, HTTPProgressNotification, EventPriority::Immediate)
 	PD2HOOK_REGISTER_EVENTQUEUE(HTTPItemPtr, HTTPItem)
 
+	// Requests that have been submitted but haven't finished yet
+	static std::atomic<int> running_requests{0};
+
+	// Requests spend nearly all their time waiting on the network, and a download can take minutes, so they get their
+	// own threads rather than using the worker pool. The limit isn't tied to the number of cores, so a couple of slow
+	// downloads can't hold up every update check behind them. Like the pool's workers, these are started as they're
+	// needed and never exit.
+	static const int max_http_threads = 16;
+
+	namespace
+	{
+		struct HTTPThreads
+		{
+			std::mutex mutex;
+			std::condition_variable wake;
+			std::deque<HTTPItem*> queue;
+			int threads = 0;
+			int idle = 0;
+		};
+	}
+
+	static HTTPThreads& GetHTTPThreads()
+	{
+		// This is never deleted, since the threads might still be waiting on it when the game exits
+		static HTTPThreads* instance = new HTTPThreads();
+		return *instance;
+	}
+
 	HTTPManager::HTTPManager()
 	{
 		// Curl Init
@@ -41,13 +74,15 @@ namespace pd2hook
 
 	HTTPManager::~HTTPManager()
 	{
+		// The workers aren't joined when the game closes, so leave curl alone if any of them might still be using it
+		if (running_requests > 0)
+		{
+			PD2HOOK_LOG_LOG("Not closing CURL, " + std::to_string(running_requests) + " requests are still running");
+			return;
+		}
+
 		PD2HOOK_LOG_LOG("CURL CLOSED");
 		curl_global_cleanup();
-
-		std::for_each(threadList.begin(), threadList.end(), [](const std::unique_ptr<std::thread>& t)
-		{
-			t->join();
-		});
 	}
 
 	HTTPManager* HTTPManager::GetSingleton()
@@ -152,17 +187,49 @@ namespace pd2hook
 		curl_easy_cleanup(curl);
 
 		GetHTTPItemQueue().AddToQueue(run_http_event, std::move(item));
+		running_requests--;
+	}
+
+	void run_http_thread()
+	{
+		HTTPThreads& pool = GetHTTPThreads();
+		std::unique_lock<std::mutex> lock(pool.mutex);
+		while (true)
+		{
+			if (pool.queue.empty())
+			{
+				pool.idle++;
+				pool.wake.wait(lock, [&pool]() { return !pool.queue.empty(); });
+				pool.idle--;
+			}
+
+			HTTPItem* item = pool.queue.front();
+			pool.queue.pop_front();
+
+			lock.unlock();
+			launch_thread_http(item);
+			lock.lock();
+		}
 	}
 
 	void HTTPManager::LaunchHTTPRequest(std::unique_ptr<HTTPItem> callback)
 	{
 		PD2HOOK_TRACE_FUNC;
-		// This shit's gonna end eventually, how many threads are people going to launch?
-		// Probably a lot.
-		// I'll manage them I guess, but I've no idea when to tell them to join which I believe is part of the constructor.
+		running_requests++;
+
+		HTTPThreads& pool = GetHTTPThreads();
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.queue.push_back(callback.release());
+
+		// Start another thread if there aren't enough idle ones to pick up everything that's waiting. Once the limit
+		// is reached, requests wait for one of the running ones to finish.
+		if ((size_t)pool.idle < pool.queue.size() && pool.threads < max_http_threads)
+		{
+			pool.threads++;
+			std::thread thread(run_http_thread);
+			thread.detach();
+		}
 
-		// VC++ 2013 bug, can't pass a unique_ptr through a thread
-		// should be: threadList.push_back(std::unique_ptr<std::thread>(new std::thread(launch_thread_http, std::move(callback)));
-		threadList.push_back(std::unique_ptr<std::thread>(new std::thread(launch_thread_http, callback.release())));
+		pool.wake.notify_one();
 	}
 }
@@ -3,7 +3,6 @@
 
 #include <string>
 #include <mutex>
-#include <thread>
 #include <list>
 #include <memory>
 #include <map>
@@ -45,7 +44,6 @@ namespace pd2hook
 		void LaunchHTTPRequest(std::unique_ptr<HTTPItem> callback);
 	private:
 		std::unique_ptr<std::mutex[]> openssl_locks;
-		std::list<std::unique_ptr<std::thread>> threadList;
 	};
 }
 
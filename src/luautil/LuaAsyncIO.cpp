@@ -4,41 +4,44 @@
 
 #include "LuaAsyncIO.h"
 
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
-#include <fstream>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <queue>
-#include <thread>
+#include <new>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include <InitState.h>
 #include <threading/queue.h>
+#include <threading/scheduler.h>
 #include <util/util.h>
 
-static const int MAX_THREADS = 4;
-
-struct IOTask
-{
-	std::function<void()> func;
-};
-
 struct IOCompletion
 {
 	lua_State* L;
 	std::function<void()> func;
 };
 
-static std::mutex task_mutex;
-static std::queue<IOTask> task_list;
-static std::condition_variable condition_var;
-static int thread_count;
-
-PD2HOOK_REGISTER_EVENTQUEUE(IOCompletion, Completions);
+// Mods are usually waiting on these, so they go before HTTP requests and hashes
+PD2HOOK_REGISTER_EVENTQUEUE_PRIORITY(IOCompletion, Completions, pd2hook::EventPriority::High);
 
 // TODO deduplicate with that in InitiateState
 static void handled_pcall(lua_State* L, int nargs, int nresults)
@@ -78,122 +81,718 @@ static void invoke_on_update(lua_State* L, std::function<void()> func)
 		completion);
 }
 
-// MUST BE CALLED UNDER task_mutex
-static void start_task_thread()
+enum class RequestStatus
 {
-	thread_count++;
+	queued,
+	running,
+	done,
+	cancelled,
+};
 
-	PD2HOOK_LOG_LOG("Starting async IO thread");
+static const char* request_metatable = "AsyncIO.request";
 
-	std::thread thread([]() {
-		while (true)
-		{
-			// Try and get a task, or timeout
-			// The timeout ensures that we don't hold a bunch of threads if we're not using them
-			IOTask task;
-			const auto timeout = std::chrono::milliseconds(500);
-			{
-				std::unique_lock lock(task_mutex);
-				bool has_item = condition_var.wait_for(lock, timeout, []() { return !task_list.empty(); });
-				if (!has_item)
-					break;
-				task = std::move(task_list.front());
-				task_list.pop();
-			}
+static const int priority_count = 3;
+static const char* priority_names[priority_count] = {"low", "normal", "high"};
+static const int default_priority = 1;
 
-			// Execute this task
-			task.func();
-		}
+// A read or write a mod has asked for, which the handle returned to Lua points to
+struct IORequest
+{
+	lua_State* L;
+	int func_ref;
+	bool is_read; // Reads are dropped if the Lua state closes before they start, but writes are still made
+	int priority; // Only changed with queue_mutex held
+	std::atomic<RequestStatus> status{RequestStatus::queued};
+};
+typedef std::shared_ptr<IORequest> IORequestPtr;
+
+// Work waiting for a worker. Each request has one of these, except for read_many which has one for each task it's
+// split into.
+struct QueuedWork
+{
+	IORequestPtr request;
+	std::function<void()> work;
+};
+
+// Sorted by the negated priority then the order it was added in, so the most important work comes first
+typedef std::pair<int, uint64_t> QueueKey;
+
+static std::mutex queue_mutex;
+static std::map<QueueKey, QueuedWork> work_queue;
+static uint64_t next_order = 0;
+
+static void run_next_work()
+{
+	QueuedWork item;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+
+		// This happens if whatever this was submitted for was cancelled
+		if (work_queue.empty())
+			return;
+
+		auto iter = work_queue.begin();
+		item = std::move(iter->second);
+		work_queue.erase(iter);
+
+		RequestStatus queued = RequestStatus::queued;
+		item.request->status.compare_exchange_strong(queued, RequestStatus::running);
+	}
+
+	item.work();
+}
+
+// The pool runs the most important work in the queue rather than what was submitted first, so interactive requests
+// can go ahead of bulk ones
+static void dispatch_task(const IORequestPtr& request, std::function<void()> func)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		work_queue.emplace(QueueKey(-request->priority, next_order++), QueuedWork{request, std::move(func)});
+	}
+
+	pd2hook::threading::submit(pd2hook::threading::priority::io, run_next_work);
+}
+
+// Must be called with queue_mutex held
+static void remove_queued_work(const IORequest* request)
+{
+	for (auto iter = work_queue.begin(); iter != work_queue.end();)
+	{
+		if (iter->second.request.get() == request)
+			iter = work_queue.erase(iter);
+		else
+			++iter;
+	}
+}
+
+// Returns false if the request has already started
+static bool cancel_request(const IORequestPtr& request)
+{
+	std::lock_guard<std::mutex> lock(queue_mutex);
+
+	RequestStatus queued = RequestStatus::queued;
+	if (!request->status.compare_exchange_strong(queued, RequestStatus::cancelled))
+		return false;
+
+	remove_queued_work(request.get());
+	return true;
+}
+
+static void set_request_priority(const IORequestPtr& request, int priority)
+{
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	request->priority = priority;
 
-		PD2HOOK_LOG_LOG("Exiting async IO thread");
+	// Re-insert any of it's work that's still waiting, keeping it's place relative to work of the same priority
+	std::vector<decltype(work_queue)::node_type> moved;
+	for (auto iter = work_queue.begin(); iter != work_queue.end();)
+	{
+		auto current = iter++;
+		if (current->second.request == request)
+			moved.push_back(work_queue.extract(current));
+	}
+
+	for (auto& node : moved)
+	{
+		node.key().first = -priority;
+		work_queue.insert(std::move(node));
+	}
+}
+
+// Called by a completion before it runs the callback. Returns false if the request was cancelled, in which case the
+// callback has already been released.
+static bool complete_request(IORequest& request)
+{
+	if (request.status == RequestStatus::cancelled)
+		return false;
+
+	request.status = RequestStatus::done;
+	return true;
+}
+
+static IORequestPtr new_request(lua_State* L, int callback_index, bool is_read, int priority)
+{
+	IORequestPtr request = std::make_shared<IORequest>();
+	request->L = L;
+	request->is_read = is_read;
+	request->priority = priority;
 
+	lua_pushvalue(L, callback_index);
+	request->func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return request;
+}
+
+static void push_request_handle(lua_State* L, const IORequestPtr& request)
+{
+	void* data = lua_newuserdata(L, sizeof(IORequestPtr));
+	new (data) IORequestPtr(request);
+
+	luaL_getmetatable(L, request_metatable);
+	lua_setmetatable(L, -2);
+}
+
+static int check_priority(lua_State* L, int index)
+{
+	if (lua_type(L, index) == LUA_TSTRING)
+	{
+		const char* name = lua_tostring(L, index);
+		for (int i = 0; i < priority_count; i++)
 		{
-			std::lock_guard guard(task_mutex);
-			thread_count--;
+			if (strcmp(name, priority_names[i]) == 0)
+				return i;
 		}
-	});
-	thread.detach();
+	}
+
+	luaL_error(L, "async_io: the priority must be 'low', 'normal' or 'high'");
+	return default_priority;
 }
 
-static void dispatch_task(IOTask&& task)
+static int get_priority_option(lua_State* L, int table)
 {
+	if (!lua_istable(L, table))
+		return default_priority;
+
+	lua_getfield(L, table, "priority");
+	int priority = lua_isnil(L, -1) ? default_priority : check_priority(L, -1);
+	lua_pop(L, 1);
+	return priority;
+}
+
+// A file (or part of one) read by a worker, which is kept by the completion until it's been passed to Lua
+struct ReadBuffer
+{
+	std::unique_ptr<char[]> data;
+	size_t length = 0;
+};
+
+#ifdef _WIN32
+static int win32_error_to_errno(DWORD error)
+{
+	switch (error)
+	{
+	case ERROR_FILE_NOT_FOUND:
+	case ERROR_PATH_NOT_FOUND:
+		return ENOENT;
+	case ERROR_ACCESS_DENIED:
+	case ERROR_SHARING_VIOLATION:
+		return EACCES;
+	default:
+		return EIO;
+	}
+}
+#endif
+
+// Read length bytes (or up to the end of the file, if has_length isn't set) starting at offset, into a buffer that's
+// allocated once at the size that'll be read. Reading past the end of the file gives an empty buffer. Returns an errno
+// value, or zero if it succeeded.
+static int read_file_range(const std::string& filename, uint64_t offset, bool has_length, uint64_t length,
+                           ReadBuffer& buffer)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+	                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return win32_error_to_errno(GetLastError());
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size))
+	{
+		int err = win32_error_to_errno(GetLastError());
+		CloseHandle(file);
+		return err;
+	}
+	uint64_t size = (uint64_t)file_size.QuadPart;
+#else
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		int err = errno;
+		close(fd);
+		return err;
+	}
+	if (S_ISDIR(info.st_mode))
+	{
+		close(fd);
+		return EISDIR;
+	}
+	uint64_t size = (uint64_t)info.st_size;
+#endif
+
+	uint64_t start = std::min(offset, size);
+	uint64_t count = size - start;
+	if (has_length)
+		count = std::min(count, length);
+
+	int err = 0;
+	if (count > (uint64_t)SIZE_MAX)
+		err = EFBIG;
+	else
+		buffer.data.reset(new char[count ? count : 1]);
+
+	// The file might get shorter while we're reading it, in which case we'll just return what's there
+	size_t done = 0;
+	while (!err && done < count)
 	{
-		std::lock_guard guard(task_mutex);
-		task_list.push(std::move(task));
+		uint64_t position = start + done;
+#ifdef _WIN32
+		DWORD chunk = (DWORD)std::min<uint64_t>(count - done, 0x40000000);
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)position;
+		overlapped.OffsetHigh = (DWORD)(position >> 32);
 
-		// Check if we need to start a new thread
-		// Do this under the mutex, since it should not occur very often and we wouldn't want many
-		// threads being started concurrently.
-		if (thread_count == 0 || (thread_count < MAX_THREADS && task_list.size() > 5))
-			start_task_thread();
+		DWORD got = 0;
+		if (!ReadFile(file, buffer.data.get() + done, chunk, &got, &overlapped))
+		{
+			DWORD error = GetLastError();
+			if (error != ERROR_HANDLE_EOF)
+				err = win32_error_to_errno(error);
+			break;
+		}
+#else
+		ssize_t got = pread(fd, buffer.data.get() + done, count - done, (off_t)position);
+		if (got < 0)
+		{
+			if (errno != EINTR)
+				err = errno;
+			continue;
+		}
+#endif
+		if (got == 0)
+			break;
+		done += got;
 	}
-	condition_var.notify_one();
+
+#ifdef _WIN32
+	CloseHandle(file);
+#else
+	close(fd);
+#endif
+
+	if (err)
+		buffer.data.reset();
+	else
+		buffer.length = done;
+
+	return err;
 }
 
-static void dispatch_task(std::function<void()> func)
+// Get a whole number from an options table, raising an error if it's not one. Returns false if it's not set.
+static bool get_size_option(lua_State* L, int table, const char* name, uint64_t& value)
 {
-	IOTask task{};
-	task.func = std::move(func);
-	dispatch_task(std::move(task));
+	lua_getfield(L, table, name);
+	bool set = !lua_isnil(L, -1);
+	if (set)
+	{
+		lua_Number number = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : -1;
+		if (number < 0)
+			luaL_error(L, "async_io: options.%s must be a non-negative number", name);
+		value = (uint64_t)number;
+	}
+	lua_pop(L, 1);
+	return set;
 }
 
 // Arguments: string(filename) function(callback) optional table(options)
+// Options: offset (where to start reading, default 0), length (how much to read, default the rest of the file),
+// priority ('low', 'normal' or 'high')
+// Returns: the request's handle
 static int aio_read(lua_State* L)
 {
 	std::string filename = luaL_checkstring(L, 1);
 
 	luaL_checktype(L, 2, LUA_TFUNCTION);
-	lua_pushvalue(L, 2);
-	int completion_func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	dispatch_task([filename, completion_func_ref, L]() {
-		std::vector<char> data;
-		bool success = true;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	bool has_length = false;
+	if (lua_istable(L, 3))
+	{
+		get_size_option(L, 3, "offset", offset);
+		has_length = get_size_option(L, 3, "length", length);
+	}
+
+	IORequestPtr request = new_request(L, 2, true, get_priority_option(L, 3));
 
-		// Since there's more steps involved with seeking around to find the length, just use
-		// exceptions for this rather than checking goodbit.
-		errno = 0; // Make sure pre-existing errors can't leak in
-		try
+	dispatch_task(request, [filename, offset, has_length, length, request, L]() {
+		// Owned by the completion, since it runs after this function has returned
+		std::shared_ptr<ReadBuffer> buffer = std::make_shared<ReadBuffer>();
+		int err = read_file_range(filename, offset, has_length, length, *buffer);
+
+		invoke_on_update(L, [L, request, buffer, err]() {
+			if (!complete_request(*request))
+				return;
+
+			int func_ref = request->func_ref;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, func_ref);
+			if (!err)
+			{
+				lua_pushlstring(L, buffer->data.get(), buffer->length);
+				buffer->data.reset();
+				handled_pcall(L, 1, 0);
+			}
+			else
+			{
+				lua_pushnil(L);
+				lua_pushstring(L, strerror(err));
+				handled_pcall(L, 2, 0);
+			}
+			luaL_unref(L, LUA_REGISTRYINDEX, func_ref);
+		});
+	});
+
+	push_request_handle(L, request);
+	return 1;
+}
+
+// All the files from a read_many call, which is shared by each of the tasks reading them
+struct ReadManyJob
+{
+	IORequestPtr request;
+
+	std::vector<std::string> filenames; // Sorted by directory, so each task reads files that are near each other
+	std::vector<ReadBuffer> buffers;
+	std::vector<int> errors;
+
+	std::atomic<int> tasks_left{0};
+};
+
+static std::string get_directory(const std::string& filename)
+{
+	size_t slash = filename.find_last_of("/\\");
+	return slash == std::string::npos ? std::string() : filename.substr(0, slash);
+}
+
+static void finish_read_many(const std::shared_ptr<ReadManyJob>& job)
+{
+	invoke_on_update(job->request->L, [job]() {
+		if (!complete_request(*job->request))
+			return;
+
+		lua_State* L = job->request->L;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, job->request->func_ref);
+
+		lua_createtable(L, 0, (int)job->filenames.size());
+		bool any_errors = false;
+		for (size_t i = 0; i < job->filenames.size(); i++)
 		{
-			std::ifstream stream;
-			stream.exceptions(std::ios::eofbit | std::ios::failbit);
-			stream.open(filename, std::ios::binary);
+			if (job->errors[i])
+			{
+				any_errors = true;
+				continue;
+			}
 
-			stream.seekg(0, std::ios::end);
-			size_t length = stream.tellg();
-			stream.seekg(0, std::ios::beg);
+			ReadBuffer& buffer = job->buffers[i];
+			lua_pushlstring(L, buffer.data.get(), buffer.length);
+			lua_setfield(L, -2, job->filenames[i].c_str());
+			buffer.data.reset();
+		}
+
+		if (any_errors)
+		{
+			lua_newtable(L);
+			for (size_t i = 0; i < job->filenames.size(); i++)
+			{
+				if (!job->errors[i])
+					continue;
 
-			data.resize(length);
-			stream.read(data.data(), data.size());
+				lua_pushstring(L, strerror(job->errors[i]));
+				lua_setfield(L, -2, job->filenames[i].c_str());
+			}
 		}
-		catch (const std::ios::failure& ex)
+		else
 		{
-			data.clear();
-			success = false;
+			lua_pushnil(L);
 		}
 
-		invoke_on_update(L, [L, func_ref{completion_func_ref}, &data, success, err{errno}]() {
+		handled_pcall(L, 2, 0);
+		luaL_unref(L, LUA_REGISTRYINDEX, job->request->func_ref);
+	});
+}
+
+// Arguments: table(list of filenames) function(callback) optional table(options)
+// The callback is run once every file has been read, with a table of each file's contents keyed by it's name, and
+// either nil or a table of error messages for the files that couldn't be read, also keyed by name.
+// Options: priority ('low', 'normal' or 'high')
+// Returns: the request's handle, which can only be cancelled before any of the files have started being read
+static int aio_read_many(lua_State* L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	int priority = get_priority_option(L, 3);
+
+	std::shared_ptr<ReadManyJob> job = std::make_shared<ReadManyJob>();
+
+	int count = (int)lua_objlen(L, 1);
+	for (int i = 1; i <= count; i++)
+	{
+		lua_rawgeti(L, 1, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "async_io.read_many: filename %d is not a string", i);
+		job->filenames.emplace_back(lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+
+	// Sort the files by directory, so reading files from the same directory happens together on the same thread
+	std::vector<std::pair<std::string, std::string>> sorted;
+	sorted.reserve(job->filenames.size());
+	for (std::string& filename : job->filenames)
+		sorted.emplace_back(get_directory(filename), std::move(filename));
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+	job->filenames.clear();
+	for (auto& pair : sorted)
+		job->filenames.push_back(std::move(pair.second));
+
+	size_t files = job->filenames.size();
+	job->buffers.resize(files);
+	job->errors.resize(files);
+
+	job->request = new_request(L, 2, true, priority);
+
+	if (files == 0)
+	{
+		finish_read_many(job);
+		push_request_handle(L, job->request);
+		return 1;
+	}
+
+	// Split the files into one contiguous run per worker, rather than a task for each of them
+	size_t tasks = std::min(files, (size_t)pd2hook::threading::worker_count());
+	job->tasks_left = (int)tasks;
+	for (size_t task = 0; task < tasks; task++)
+	{
+		size_t start = files * task / tasks;
+		size_t end = files * (task + 1) / tasks;
+
+		dispatch_task(job->request, [job, start, end]() {
+			for (size_t i = start; i < end; i++)
+				job->errors[i] = read_file_range(job->filenames[i], 0, false, 0, job->buffers[i]);
+
+			if (--job->tasks_left == 0)
+				finish_read_many(job);
+		});
+	}
+
+	push_request_handle(L, job->request);
+	return 1;
+}
+
+struct WriteOptions
+{
+	bool atomic = false; // Write to a temporary file, then rename it over the target
+	bool append = false;
+	bool sync = false; // Flush the data to the disk before calling back
+	double coalesce = 0; // Seconds to wait for further writes to the same file, which replace this one
+};
+
+// Write a file, returning an errno value or zero if it succeeded
+static int write_file(const std::string& filename, const std::string& contents, const WriteOptions& options)
+{
+	// Each atomic write gets it's own temporary file, in case two writes to the same file are running at once
+	static std::atomic<unsigned int> temp_counter{0};
+	std::string path = filename;
+	if (options.atomic)
+		path += "." + std::to_string(temp_counter++) + ".tmp";
+
+	int err = 0;
+	size_t done = 0;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), options.append ? FILE_APPEND_DATA : GENERIC_WRITE, FILE_SHARE_READ,
+	                          nullptr, options.append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return win32_error_to_errno(GetLastError());
+
+	while (!err && done < contents.size())
+	{
+		DWORD chunk = (DWORD)std::min<size_t>(contents.size() - done, 0x40000000);
+		DWORD written = 0;
+		if (!WriteFile(file, contents.data() + done, chunk, &written, nullptr))
+			err = win32_error_to_errno(GetLastError());
+		done += written;
+	}
+
+	if (!err && options.sync && !FlushFileBuffers(file))
+		err = win32_error_to_errno(GetLastError());
+
+	CloseHandle(file);
+
+	if (!err && options.atomic &&
+	    !MoveFileExA(path.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | (options.sync ? MOVEFILE_WRITE_THROUGH : 0)))
+	{
+		err = win32_error_to_errno(GetLastError());
+	}
+
+	if (err && options.atomic)
+		DeleteFileA(path.c_str());
+#else
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (options.append ? O_APPEND : O_TRUNC);
+	int fd = open(path.c_str(), flags, 0666);
+	if (fd == -1)
+		return errno;
+
+	while (!err && done < contents.size())
+	{
+		ssize_t written = write(fd, contents.data() + done, contents.size() - done);
+		if (written < 0)
+		{
+			if (errno != EINTR)
+				err = errno;
+			continue;
+		}
+		done += written;
+	}
+
+	if (!err && options.sync && fdatasync(fd) != 0)
+		err = errno;
+
+	if (close(fd) != 0 && !err)
+		err = errno;
+
+	if (!err && options.atomic && rename(path.c_str(), filename.c_str()) != 0)
+		err = errno;
+
+	if (err && options.atomic)
+		unlink(path.c_str());
+
+	// Make sure the rename itself is on the disk, too
+	if (!err && options.atomic && options.sync)
+	{
+		std::string directory = get_directory(filename);
+		int dir_fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_CLOEXEC);
+		if (dir_fd != -1)
+		{
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+#endif
+
+	return err;
+}
+
+static void call_write_callbacks(lua_State* L, std::vector<IORequestPtr> requests, int err)
+{
+	invoke_on_update(L, [L, requests{std::move(requests)}, err]() {
+		for (const IORequestPtr& request : requests)
+		{
+			if (!complete_request(*request))
+				continue;
+
+			int func_ref = request->func_ref;
 			lua_rawgeti(L, LUA_REGISTRYINDEX, func_ref);
-			if (success)
+			lua_pushboolean(L, !err);
+			if (!err)
 			{
-				lua_pushlstring(L, data.data(), data.size());
-				data.clear();
 				handled_pcall(L, 1, 0);
 			}
 			else
 			{
-				lua_pushnil(L);
 				lua_pushstring(L, strerror(err));
 				handled_pcall(L, 2, 0);
 			}
 			luaL_unref(L, LUA_REGISTRYINDEX, func_ref);
-		});
+		}
 	});
+}
 
-	return 0;
+// One of the writes that's been merged into a PendingWrite
+struct MergedWrite
+{
+	IORequestPtr request;
+	std::shared_ptr<const std::string> contents;
+	WriteOptions options;
+};
+
+// A coalesced write that's waiting to be made. Any other writes to the same file in the meantime are added to it, and
+// once the delay is up the newest of them that wasn't cancelled is written, followed by any appends made after it, then
+// all their callbacks are run. Each write keeps it's own contents, so cancelling the newest one writes the one before
+// it instead. If every one of them is cancelled, nothing is written.
+struct PendingWrite
+{
+	lua_State* L = nullptr;
+	std::vector<MergedWrite> writes;
+};
+
+static std::mutex pending_writes_mutex;
+static std::unordered_map<std::string, PendingWrite> pending_writes;
+
+static void write_pending(const std::string& filename)
+{
+	PendingWrite write;
+	{
+		std::lock_guard<std::mutex> lock(pending_writes_mutex);
+		auto iter = pending_writes.find(filename);
+		if (iter == pending_writes.end())
+			return;
+		write = std::move(iter->second);
+		pending_writes.erase(iter);
+	}
+
+	// Start each request, which stops them from being cancelled. Anything appended before the newest write would be
+	// replaced by it, so only the appends after that need making.
+	std::vector<IORequestPtr> started;
+	const MergedWrite* newest = nullptr;
+	std::vector<const MergedWrite*> appends;
+	for (const MergedWrite& merged : write.writes)
+	{
+		RequestStatus queued = RequestStatus::queued;
+		if (!merged.request->status.compare_exchange_strong(queued, RequestStatus::running))
+			continue;
+
+		started.push_back(merged.request);
+		if (merged.options.append)
+		{
+			appends.push_back(&merged);
+		}
+		else
+		{
+			newest = &merged;
+			appends.clear();
+		}
+	}
+
+	if (started.empty())
+		return;
+
+	int err = 0;
+	if (newest)
+		err = write_file(filename, *newest->contents, newest->options);
+
+	for (const MergedWrite* append : appends)
+	{
+		if (err == 0)
+			err = write_file(filename, *append->contents, append->options);
+	}
+
+	call_write_callbacks(write.L, std::move(started), err);
+}
+
+static bool get_bool_option(lua_State* L, int table, const char* name)
+{
+	lua_getfield(L, table, name);
+	bool value = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return value;
 }
 
 // Arguments: string(filename) string(contents) function(callback) optional table(options)
+// Options:
+//   atomic: write to a temporary file and rename it over the target, so a crash can't leave it half-written
+//   append: add to the end of the file, rather than replacing it
+//   sync: flush the file to the disk before the callback is run
+//   coalesce: a number of seconds to wait before writing. Any writes to the same file in that time replace this one
+//     (including those without this option), and every callback is run once the newest of them that wasn't
+//     cancelled is written. Appends in that time are made after it, in order.
+//   priority: 'low', 'normal' or 'high'
+// Returns: the request's handle
 static int aio_write(lua_State* L)
 {
 	std::string filename = luaL_checkstring(L, 1);
@@ -202,45 +801,435 @@ static int aio_write(lua_State* L)
 
 	size_t contents_len = 0;
 	const char* contents_ptr = luaL_checklstring(L, 2, &contents_len);
-	std::vector<char> contents(contents_len);
-	memcpy(contents.data(), contents_ptr, contents_len);
 
-	lua_pushvalue(L, 3);
-	int completion_func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	WriteOptions options;
+	if (lua_istable(L, 4))
+	{
+		options.atomic = get_bool_option(L, 4, "atomic");
+		options.append = get_bool_option(L, 4, "append");
+		options.sync = get_bool_option(L, 4, "sync");
+
+		lua_getfield(L, 4, "coalesce");
+		if (!lua_isnil(L, -1))
+		{
+			options.coalesce = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : -1;
+			if (options.coalesce < 0)
+				luaL_error(L, "async_io.write: options.coalesce must be a non-negative number");
+		}
+		lua_pop(L, 1);
+
+		if (options.append && (options.atomic || options.coalesce > 0))
+			luaL_error(L, "async_io.write: options.append can't be used with atomic or coalesce");
+	}
 
-	dispatch_task([filename, contents{std::move(contents)}, completion_func_ref, L]() {
-		errno = 0; // Make sure pre-existing errors can't leak in
+	std::shared_ptr<const std::string> contents = std::make_shared<const std::string>(contents_ptr, contents_len);
 
-		std::ofstream stream;
-		if (stream.good())
-			stream.open(filename, std::ios::binary);
-		if (stream.good())
-			stream.write(contents.data(), contents.size());
+	IORequestPtr request = new_request(L, 3, false, get_priority_option(L, 4));
 
-		invoke_on_update(L, [L, func_ref{completion_func_ref}, status{stream.good()}, err{errno}]() {
-			lua_rawgeti(L, LUA_REGISTRYINDEX, func_ref);
-			lua_pushboolean(L, status);
-			if (status)
+	// Anything written to a file with a coalesced write pending is added to it, including appends, which would
+	// otherwise be replaced when the pending write is made
+	bool coalesced = false;
+	{
+		std::lock_guard<std::mutex> lock(pending_writes_mutex);
+		auto iter = pending_writes.find(filename);
+		if (iter != pending_writes.end())
+		{
+			PendingWrite& pending = iter->second;
+
+			// If the Lua state has changed, the requests belong to one that's been closed
+			if (pending.L != L)
 			{
-				handled_pcall(L, 1, 0);
+				pending.L = L;
+				pending.writes.clear();
+			}
+
+			// This is written once the original delay is up, so a file that's constantly written to still gets
+			// written eventually
+			pending.writes.push_back(MergedWrite{request, contents, options});
+			coalesced = true;
+		}
+		else if (options.coalesce > 0)
+		{
+			PendingWrite& pending = pending_writes[filename];
+			pending.L = L;
+			pending.writes.push_back(MergedWrite{request, contents, options});
+
+			std::chrono::milliseconds delay((long long)(options.coalesce * 1000));
+			pd2hook::threading::submit_after(pd2hook::threading::priority::io, delay,
+			                                 [filename]() { write_pending(filename); });
+			coalesced = true;
+		}
+	}
+
+	if (!coalesced)
+	{
+		dispatch_task(request, [filename, contents, options, request, L]() {
+			int err = write_file(filename, *contents, options);
+			call_write_callbacks(L, {request}, err);
+		});
+	}
+
+	push_request_handle(L, request);
+	return 1;
+}
+
+enum class EntryType
+{
+	file,
+	directory,
+	other,
+};
+
+struct DirEntry
+{
+	std::string name; // Relative to the directory being listed
+	EntryType type;
+	uint64_t size = 0;
+	double mtime = 0; // Seconds since the Unix epoch, like os.time
+};
+
+// Both of these return an errno if a directory couldn't be read all the way through, so a partial listing isn't
+// passed off as a complete one. Subdirectories that can't be opened at all are skipped.
+#ifdef _WIN32
+static int list_directory(const std::string& path, const std::string& prefix, bool recursive,
+                          std::vector<DirEntry>& entries)
+{
+	// FindFirstFileEx gives us the size and modification time with each name, so stat is free here
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileExA((path + "\\*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr,
+	                               FIND_FIRST_EX_LARGE_FETCH);
+	if (find == INVALID_HANDLE_VALUE)
+		return prefix.empty() ? win32_error_to_errno(GetLastError()) : 0;
+
+	do
+	{
+		if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0)
+			continue;
+
+		DirEntry entry;
+		entry.name = prefix + data.cFileName;
+		entry.type = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? EntryType::directory : EntryType::file;
+		entry.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+
+		// FILETIMEs are in 100ns intervals since 1601
+		uint64_t time = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+		entry.mtime = ((double)time - 116444736000000000.0) / 10000000.0;
+
+		// Don't follow junctions and symlinks, since they could loop back on themselves
+		bool recurse = recursive && entry.type == EntryType::directory &&
+		               !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
+		std::string subdirectory = entry.name;
+		entries.push_back(std::move(entry));
+
+		if (recurse)
+		{
+			int err = list_directory(path + "\\" + data.cFileName, subdirectory + "/", true, entries);
+			if (err)
+			{
+				FindClose(find);
+				return err;
+			}
+		}
+	} while (FindNextFileA(find, &data));
+
+	DWORD last_error = GetLastError();
+	FindClose(find);
+	return last_error == ERROR_NO_MORE_FILES ? 0 : win32_error_to_errno(last_error);
+}
+#else
+// The layout getdents64 fills the buffer with, which glibc doesn't declare
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static int list_directory(int dir_fd, const std::string& prefix, bool recursive, bool with_stat,
+                          std::vector<DirEntry>& entries)
+{
+	// Read the directory a buffer at a time rather than an entry at a time
+	alignas(linux_dirent64) char buffer[32768];
+	while (true)
+	{
+		long length = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+		if (length == 0)
+			return 0;
+		if (length < 0)
+			return errno;
+
+		for (long pos = 0; pos < length;)
+		{
+			linux_dirent64* dirent = (linux_dirent64*)(buffer + pos);
+			pos += dirent->d_reclen;
+
+			const char* name = dirent->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+				continue;
+
+			DirEntry entry;
+			entry.name = prefix + name;
+
+			// Only stat if we need to. Links are followed, like getdir and getfiles do.
+			bool is_real_dir = dirent->d_type == DT_DIR;
+			struct stat info;
+			bool need_stat = with_stat || dirent->d_type == DT_LNK || dirent->d_type == DT_UNKNOWN;
+			if (need_stat && fstatat(dir_fd, name, &info, 0) == 0)
+			{
+				entry.type = S_ISDIR(info.st_mode) ? EntryType::directory
+				             : S_ISREG(info.st_mode) ? EntryType::file
+				                                     : EntryType::other;
+				entry.size = (uint64_t)info.st_size;
+				entry.mtime = (double)info.st_mtim.tv_sec + info.st_mtim.tv_nsec / 1000000000.0;
+
+				if (dirent->d_type == DT_UNKNOWN)
+				{
+					struct stat link_info;
+					is_real_dir = fstatat(dir_fd, name, &link_info, AT_SYMLINK_NOFOLLOW) == 0 &&
+					              S_ISDIR(link_info.st_mode);
+				}
 			}
 			else
 			{
+				entry.type = dirent->d_type == DT_DIR ? EntryType::directory
+				             : dirent->d_type == DT_REG ? EntryType::file
+				                                        : EntryType::other;
+			}
+
+			std::string subdirectory = entry.name;
+			entries.push_back(std::move(entry));
+
+			// Don't follow symlinks, since they could loop back on themselves
+			if (recursive && is_real_dir)
+			{
+				int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (sub_fd != -1)
+				{
+					int err = list_directory(sub_fd, subdirectory + "/", true, with_stat, entries);
+					close(sub_fd);
+					if (err)
+						return err;
+				}
+			}
+		}
+	}
+}
+#endif
+
+// Arguments: string(path) optional table(options) function(callback)
+// Options: recursive (include everything in the subdirectories too), stat (include the size and modification time),
+// priority ('low', 'normal' or 'high')
+// The callback is given a list of entries, each a table with name (relative to the path), type ('file', 'dir' or
+// 'other') and if stat was set, size and mtime. If the path (or with recursive, anything under it) can't be read
+// through, it's given nil and an error message rather than a partial list.
+// Returns: the request's handle
+static int aio_list(lua_State* L)
+{
+	std::string path = luaL_checkstring(L, 1);
+
+	int options_index = 2;
+	int callback_index = 3;
+	if (lua_isfunction(L, 2))
+	{
+		options_index = 0;
+		callback_index = 2;
+	}
+	luaL_checktype(L, callback_index, LUA_TFUNCTION);
+
+	bool recursive = false;
+	bool with_stat = false;
+	int priority = default_priority;
+	if (options_index && lua_istable(L, options_index))
+	{
+		recursive = get_bool_option(L, options_index, "recursive");
+		with_stat = get_bool_option(L, options_index, "stat");
+		priority = get_priority_option(L, options_index);
+	}
+
+	IORequestPtr request = new_request(L, callback_index, true, priority);
+
+	dispatch_task(request, [path, recursive, with_stat, request, L]() {
+		std::shared_ptr<std::vector<DirEntry>> entries = std::make_shared<std::vector<DirEntry>>();
+		int err = 0;
+
+#ifdef _WIN32
+		err = list_directory(path, "", recursive, *entries);
+#else
+		int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd == -1)
+		{
+			err = errno;
+		}
+		else
+		{
+			err = list_directory(dir_fd, "", recursive, with_stat, *entries);
+			close(dir_fd);
+		}
+#endif
+
+		invoke_on_update(L, [L, request, entries, with_stat, err]() {
+			if (!complete_request(*request))
+				return;
+
+			int func_ref = request->func_ref;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, func_ref);
+
+			if (err)
+			{
+				lua_pushnil(L);
 				lua_pushstring(L, strerror(err));
 				handled_pcall(L, 2, 0);
+				luaL_unref(L, LUA_REGISTRYINDEX, func_ref);
+				return;
 			}
+
+			static const char* type_names[] = {"file", "dir", "other"};
+
+			lua_createtable(L, (int)entries->size(), 0);
+			for (size_t i = 0; i < entries->size(); i++)
+			{
+				const DirEntry& entry = (*entries)[i];
+
+				lua_createtable(L, 0, with_stat ? 4 : 2);
+
+				lua_pushlstring(L, entry.name.c_str(), entry.name.size());
+				lua_setfield(L, -2, "name");
+
+				lua_pushstring(L, type_names[(int)entry.type]);
+				lua_setfield(L, -2, "type");
+
+				if (with_stat)
+				{
+					lua_pushnumber(L, (lua_Number)entry.size);
+					lua_setfield(L, -2, "size");
+
+					lua_pushnumber(L, (lua_Number)entry.mtime);
+					lua_setfield(L, -2, "mtime");
+				}
+
+				lua_rawseti(L, -2, (int)i + 1);
+			}
+			entries->clear();
+
+			handled_pcall(L, 1, 0);
 			luaL_unref(L, LUA_REGISTRYINDEX, func_ref);
 		});
 	});
 
+	push_request_handle(L, request);
+	return 1;
+}
+
+static IORequestPtr& check_request(lua_State* L)
+{
+	return *(IORequestPtr*)luaL_checkudata(L, 1, request_metatable);
+}
+
+// Returns true if the request was cancelled before it started, in which case the callback won't be run
+static int request_cancel(lua_State* L)
+{
+	IORequestPtr& request = check_request(L);
+
+	bool cancelled = cancel_request(request);
+	if (cancelled)
+		luaL_unref(L, LUA_REGISTRYINDEX, request->func_ref);
+
+	lua_pushboolean(L, cancelled);
+	return 1;
+}
+
+static int request_set_priority(lua_State* L)
+{
+	IORequestPtr& request = check_request(L);
+	set_request_priority(request, check_priority(L, 2));
+	return 0;
+}
+
+static int request_get_priority(lua_State* L)
+{
+	IORequestPtr& request = check_request(L);
+	lua_pushstring(L, priority_names[request->priority]);
+	return 1;
+}
+
+// Returns 'queued', 'running', 'done' (once the callback has been run) or 'cancelled'
+static int request_get_status(lua_State* L)
+{
+	IORequestPtr& request = check_request(L);
+
+	switch (request->status.load())
+	{
+	case RequestStatus::queued:
+		lua_pushstring(L, "queued");
+		break;
+	case RequestStatus::running:
+		lua_pushstring(L, "running");
+		break;
+	case RequestStatus::done:
+		lua_pushstring(L, "done");
+		break;
+	case RequestStatus::cancelled:
+		lua_pushstring(L, "cancelled");
+		break;
+	}
+	return 1;
+}
+
+// Dropping the handle doesn't cancel the request, so mods can ignore it if they don't need it
+static int request_gc(lua_State* L)
+{
+	IORequestPtr& request = check_request(L);
+	request.~IORequestPtr();
 	return 0;
 }
 
+void close_lua_async_io(lua_State* L)
+{
+	// Nothing's going to see the result of a read, so don't bother making it. Writes are still made, since they're
+	// probably a mod saving something as the game is closing.
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	for (auto iter = work_queue.begin(); iter != work_queue.end();)
+	{
+		IORequest& request = *iter->second.request;
+		if (request.L == L && request.is_read)
+		{
+			request.status = RequestStatus::cancelled;
+			iter = work_queue.erase(iter);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+}
+
 void load_lua_async_io(lua_State* L)
 {
+	luaL_Reg requestLib[] = {
+		{"cancel", request_cancel},
+		{"set_priority", request_set_priority},
+		{"priority", request_get_priority},
+		{"status", request_get_status},
+		{"__gc", request_gc},
+
+		{nullptr, nullptr},
+	};
+
+	luaL_newmetatable(L, request_metatable);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	luaL_openlib(L, nullptr, requestLib, 0);
+	lua_pop(L, 1);
+
 	luaL_Reg vmLib[] = {
 		{"read", aio_read},
+		{"read_many", aio_read_many},
 		{"write", aio_write},
+		{"list", aio_list},
 
 		{nullptr, nullptr},
 	};
@@ -7,3 +7,6 @@
 #include <lua.h>
 
 void load_lua_async_io(lua_State* L);
+
+// Drop any reads that haven't started yet for a Lua state that's about to be closed
+void close_lua_async_io(lua_State* L);
@@ -1,12 +1,12 @@
 #include "FontData.h"
 
 #include <assert.h>
-#include <sstream>
+#include <string.h>
+#include <stdexcept>
 
 using namespace pd2hook::scriptdata::font;
-using namespace pd2hook::scriptdata::tools;
 
-typedef uint32_t ptr_t;
+typedef uint64_t ptr_t;
 
 struct data_t
 {
@@ -22,12 +22,29 @@ static_assert(sizeof(glyph) == 10, "Glyph is of the incorrect size");
 static_assert(sizeof(kerning) == 12, "kerning is of the incorrect size");
 static_assert(sizeof(char_def) == 8, "char_def is of the incorrect size");
 
+// The size of the main block at the start of the file
+static size_t header_size(bool is32bit)
+{
+	return is32bit ? 96 : 144;
+}
+
+static void check_bounds(const data_t &data, size_t offset, size_t count, size_t item_size, const char *what)
+{
+	// Written this way round so a huge count can't overflow
+	if(offset > data.length || count > (data.length - offset) / item_size)
+	{
+		throw std::runtime_error(std::string("Invalid font: ") + what + " at " + std::to_string(offset)
+			+ " extends past the end of the file");
+	}
+}
+
 template<typename T>
 static T read(data_t &data)
 {
 	assert(data.offset + sizeof(T) <= data.length);
 
-	T val = *(T*) (data.data+data.offset);
+	T val;
+	memcpy(&val, data.data + data.offset, sizeof(T));
 	data.offset += sizeof(T);
 	return val;
 }
@@ -41,49 +58,53 @@ static ptr_t readPtr(data_t &data)
 }
 
 template<typename T>
-static void readVec(data_t &data, std::vector<T> &out)
+static void readVec(data_t &data, std::vector<T> &out, const char *what)
 {
-	int size = read<uint32_t>(data);
+	uint32_t size = read<uint32_t>(data);
 	/* int capacity = */ read<uint32_t>(data);
 
 	ptr_t contents_offset = readPtr(data);
 	/* ptr_t allocator = */ readPtr(data);
 
-	out.resize(size);
+	check_bounds(data, contents_offset, size, sizeof(T), what);
 
-	const T* contents = (const T*) &data.data[contents_offset];
-	std::copy(contents, contents + size, out.begin());
+	// These are all plain structures with the same layout in both pointer widths, so copy them in one go
+	out.resize(size);
+	if(size)
+		memcpy(out.data(), data.data + contents_offset, size * sizeof(T));
 }
 
-bool FontData::is32bit(const std::string &data)
+bool FontData::is32bit(size_t length, const uint8_t *data)
 {
-	if(data.length() < 50)
+	if(length < header_size(true))
 	{
-		// TODO throw error properly
-		abort();
+		throw std::runtime_error("Invalid font: file too short (" + std::to_string(length) + " bytes)");
 	}
 
-	const uint32_t *ints = (const uint32_t*) data.c_str();
+	uint32_t ints[7];
+	memcpy(ints, data, sizeof(ints));
 
 	// If the glyphs and codepoints match up in the correct locations, this is a 32-bit file
 	return ints[0] == ints[5] && ints[1] == ints[6];
 }
 
-FontData::FontData(const std::string &data)
+FontData::FontData(size_t length, const uint8_t *data)
 {
 	data_t d = {};
-	d.data = (const uint8_t*) data.c_str();
-	d.length = data.length();
+	d.data = data;
+	d.length = length;
 	d.offset = 0;
 
-	d.is32bit = is32bit(data);
+	d.is32bit = is32bit(length, data);
 
-	readVec<glyph>(d, glyphs);
+	check_bounds(d, 0, 1, header_size(d.is32bit), "header");
+
+	readVec<glyph>(d, glyphs, "glyphs");
 	readPtr(d); // TODO what is this for?
-	readVec<char_def>(d, codepoints);
+	readVec<char_def>(d, codepoints, "codepoints");
 	readPtr(d); // TODO what is this for?
 	readPtr(d); // TODO what is this for?
-	readVec<kerning>(d, kernings);
+	readVec<kerning>(d, kernings, "kernings");
 
 	ukn_bool = read<uint8_t>(d);
 
@@ -91,8 +112,14 @@ FontData::FontData(const std::string &data)
 	d.offset += d.is32bit ? 3 : 7;
 
 	readPtr(d); // An allocator, probably for the string
-	name = (const char*) (d.data + readPtr(d)); // The name of the font
-	// printf("%s\n", name.c_str());
+
+	// The name of the font
+	ptr_t name_offset = readPtr(d);
+	check_bounds(d, name_offset, 1, 1, "name");
+	const void *name_end = memchr(data + name_offset, 0, length - name_offset);
+	if(!name_end)
+		throw std::runtime_error("Invalid font: name is not terminated within the file");
+	name.assign((const char*) data + name_offset, (const char*) name_end);
 
 	size = read<uint32_t>(d);
 	texture_width = read<uint32_t>(d);
@@ -106,106 +133,100 @@ FontData::FontData(const std::string &data)
 	// 	printf("Char %c maps to %3d\n", c.codepoint, c.id);
 	// }
 
-	assert(d.offset == (d.is32bit ? 96 : 144));
+	assert(d.offset == header_size(d.is32bit));
 }
 
-template<typename T>
-static void write_to_block(write_block &blk, const T &item)
+// Writes into a buffer that has already been sized to fit the whole file
+struct out_t
 {
-	blk.stream().write((const char*) &item, sizeof(item));
-}
-
-static uint32_t write_vec(write_block &blk, bool is32bit, uint32_t size)
-{
-	write_to_block<uint32_t>(blk, size); // size
-	write_to_block<uint32_t>(blk, size); // capacity
-
-	uint32_t addr = blk.tellp();
-	writePtr(blk, is32bit, 0xDEC0EDFE); // to be replaced with glyphs_b
-
-	writePtr(blk, is32bit, 0xEFBEADDE); // unused
-
-	return addr;
-}
+	uint8_t *data;
+	size_t offset;
 
-std::string FontData::Export(bool is32bit)
-{
-	std::stringstream out;
+	bool is32bit;
 
-	write_block glyphs_b;
-	for(const glyph &g : glyphs)
+	template<typename T>
+	void write(const T &item)
 	{
-		write_to_block(glyphs_b, g);
+		memcpy(data + offset, &item, sizeof(T));
+		offset += sizeof(T);
 	}
 
-	write_block codepoints_b;
-	for(const char_def &c : codepoints)
+	void writePtr(uint32_t val)
 	{
-		write_to_block(codepoints_b, c);
+		if(is32bit)
+			write<uint32_t>(val);
+		else
+			write<uint64_t>(val);
 	}
 
-	write_block kernings_b;
-	for(const kerning &k : kernings)
+	void writeVec(uint32_t size, uint32_t contents)
 	{
-		write_to_block(kernings_b, k);
+		write<uint32_t>(size); // size
+		write<uint32_t>(size); // capacity
+		writePtr(contents);
+		writePtr(0xEFBEADDE); // unused
 	}
 
-	write_block name_b;
-	name_b.stream() << name << ((char)0);
-
-	// Write the main block
-	write_block main_b;
+	template<typename T>
+	void writeArray(const std::vector<T> &items)
+	{
+		if(items.empty())
+			return;
 
-	uint32_t glyphs_p = write_vec(main_b, is32bit, glyphs.size());
-	writePtr(main_b, is32bit, 0xEFBEADDE); // unused
-	uint32_t codepoints_p = write_vec(main_b, is32bit, codepoints.size());
-	writePtr(main_b, is32bit, 0xEFBEADDE); // unused
-	writePtr(main_b, is32bit, 0xEFBEADDE); // unused
-	uint32_t kernings_p  = write_vec(main_b, is32bit, kernings.size());
+		memcpy(data + offset, items.data(), items.size() * sizeof(T));
+		offset += items.size() * sizeof(T);
+	}
+};
 
-	write_to_block<uint8_t>(main_b, ukn_bool);
+std::string FontData::Export(bool is32bit)
+{
+	// Lay out the file up-front: the main block, then each of the arrays and finally the name
+	uint32_t glyphs_p = header_size(is32bit);
+	uint32_t codepoints_p = glyphs_p + glyphs.size() * sizeof(glyph);
+	uint32_t kernings_p = codepoints_p + codepoints.size() * sizeof(char_def);
+	uint32_t name_p = kernings_p + kernings.size() * sizeof(kerning);
+	size_t total = name_p + name.length() + 1; // +1 for the null
 
-	// Pad out to align the allocator
-	{
-		uint64_t tmp_zero = 0;
-		main_b.stream().write((const char*) &tmp_zero, is32bit ? 3 : 7);
-	}
+	std::string result(total, '\0');
 
-	writePtr(main_b, is32bit, 0xEFBEADDE); // An allocator, probably for the string
+	out_t out = {};
+	out.data = (uint8_t*) &result[0];
+	out.offset = 0;
+	out.is32bit = is32bit;
 
-	uint32_t name_p = main_b.tellp();
-	writePtr(main_b, is32bit, 0xDEC0EDFE); // to be replaced by the name string - DEADBEEF
+	// Write the main block
+	out.writeVec(glyphs.size(), glyphs_p);
+	out.writePtr(0xEFBEADDE); // unused
+	out.writeVec(codepoints.size(), codepoints_p);
+	out.writePtr(0xEFBEADDE); // unused
+	out.writePtr(0xEFBEADDE); // unused
+	out.writeVec(kernings.size(), kernings_p);
 
-	write_to_block<uint32_t>(main_b, size);
-	write_to_block<uint32_t>(main_b, texture_width);
-	write_to_block<uint32_t>(main_b, texture_height);
-	write_to_block<uint32_t>(main_b, ukn5);
-	write_to_block<uint32_t>(main_b, line_height);
+	out.write<uint8_t>(ukn_bool);
 
-	write_to_block<uint32_t>(main_b, 0xEFBEADDE); // unused
+	// Pad out to align the allocator - the buffer is already zeroed
+	out.offset += is32bit ? 3 : 7;
 
-	// Check it's the correct length
-	assert(main_b.tellp() == (is32bit ? 96 : 144));
+	out.writePtr(0xEFBEADDE); // An allocator, probably for the string
+	out.writePtr(name_p);
 
-	// Put everything into the stream
-	main_b.write_to(out);
-	glyphs_b.write_to(out);
-	codepoints_b.write_to(out);
-	kernings_b.write_to(out);
-	name_b.write_to(out);
+	out.write<uint32_t>(size);
+	out.write<uint32_t>(texture_width);
+	out.write<uint32_t>(texture_height);
+	out.write<uint32_t>(ukn5);
+	out.write<uint32_t>(line_height);
 
-	// write out the actual offsets
-	main_b.seek(glyphs_p);
-	writePtr(main_b, is32bit, glyphs_b.offset);
+	out.write<uint32_t>(0xEFBEADDE); // unused
 
-	main_b.seek(codepoints_p);
-	writePtr(main_b, is32bit, codepoints_b.offset);
+	// Check it's the correct length
+	assert(out.offset == glyphs_p);
 
-	main_b.seek(kernings_p);
-	writePtr(main_b, is32bit, kernings_b.offset);
+	out.writeArray(glyphs);
+	out.writeArray(codepoints);
+	out.writeArray(kernings);
 
-	main_b.seek(name_p);
-	writePtr(main_b, is32bit, name_b.offset);
+	// Null terminator is already present
+	memcpy(out.data + name_p, name.c_str(), name.length());
 
-	return out.str();
+	return result;
 }
@@ -39,9 +39,16 @@ namespace pd2hook::scriptdata::font
 	class FontData
 	{
 	public:
-		static bool is32bit(const std::string &data);
+		static bool is32bit(size_t length, const uint8_t *data);
+		static bool is32bit(const std::string &data)
+		{
+			return is32bit(data.length(), (const uint8_t*) data.c_str());
+		}
 
-		explicit FontData(const std::string &data);
+		// Reads the font directly out of the given memory, which only has to stay valid for the
+		// duration of the constructor. Throws std::runtime_error if the font is malformed.
+		FontData(size_t length, const uint8_t *data);
+		explicit FontData(const std::string &data) : FontData(data.length(), (const uint8_t*) data.c_str()) {}
 
 		std::string Export(bool is32bit);
 
@@ -2,18 +2,19 @@
 
 #include <functional>
 #include <cassert>
+#include <cstring>
 
 // For the writer
 #include <sstream>
 #include <algorithm>
 #include <functional>
 #include <memory>
+#include <set>
+#include <unordered_map>
 
 // Testing
 #include <chrono>
 
-#include "util/util.h"
-
 namespace pd2hook::scriptdata
 {
 	using namespace tools;
@@ -180,8 +181,209 @@ namespace pd2hook::scriptdata
 		return false;
 	}
 
+	// Reads a vector's count and contents offset without caring about the pointer width
+	static void readVecHeader(bool is32bit, const uint8_t *data, size_t offset, size_t &count, uint64_t &contents)
+	{
+		if(is32bit)
+		{
+			RawVec32 vec;
+			memcpy(&vec, &data[offset], sizeof(vec));
+			count = vec.count;
+			contents = vec.offset;
+		}
+		else
+		{
+			RawVec64 vec;
+			memcpy(&vec, &data[offset], sizeof(vec));
+			count = vec.count;
+			contents = vec.offset;
+		}
+	}
+
+	// Check each of a list of references points to an item that exists. This is kept branch-free in the loop
+	// so the compiler can vectorise it, since tables make up the bulk of most files - only if something is
+	// wrong do we go back and find out which reference it was.
+	static bool checkRefs(const uint32_t *refs, size_t count, const uint32_t (&limits)[256], size_t &bad_index)
+	{
+		uint32_t bad = 0;
+		for(size_t i=0; i<count; i++)
+		{
+			bad |= (refs[i] & 0xFFFFFF) >= limits[refs[i] >> 24];
+		}
+
+		if(!bad)
+			return true;
+
+		for(bad_index=0; bad_index<count; bad_index++)
+		{
+			if((refs[bad_index] & 0xFFFFFF) >= limits[refs[bad_index] >> 24])
+				break;
+		}
+
+		return false;
+	}
+
+	validation_result validate_scriptdata(size_t length, const uint8_t *data)
+	{
+		validation_result result;
+
+		auto fail = [&result](validation_result::error_t error, size_t offset, const std::string &message)
+		{
+			result.error = error;
+			result.offset = offset;
+			result.message = "Invalid ScriptData at offset " + std::to_string(offset) + ": " + message;
+			return result;
+		};
+
+		bool is32bit = determine_is_32bit(length, data);
+
+		size_t ptr_size = is32bit ? 4 : 8;
+		size_t vec_size = is32bit ? sizeof(RawVec32) : sizeof(RawVec64);
+
+		// Allocator, the six item vectors and the root reference
+		if(length < ptr_size + 6 * vec_size + sizeof(uint32_t))
+			return fail(validation_result::TRUNCATED_HEADER, 0, "file too short (" + std::to_string(length) + " bytes)");
+
+		// Same order as they're read in by ScriptData
+		enum { NUMBERS, STRINGS, VECTORS, QUATS, IDSTRINGS, TABLES, VEC_COUNT };
+		static const char *names[VEC_COUNT] = {"number", "string", "vector", "quaternion", "idstring", "table"};
+		const size_t item_sizes[VEC_COUNT] = {
+			sizeof(float),
+			is32bit ? sizeof(RawStr32) : sizeof(RawStr64),
+			sizeof(float) * 3,
+			sizeof(float) * 4,
+			sizeof(uint64_t),
+			is32bit ? sizeof(RawTable32) : sizeof(RawTable64),
+		};
+
+		size_t counts[VEC_COUNT];
+		uint64_t contents[VEC_COUNT];
+
+		size_t offset = ptr_size;
+		for(int i=0; i<VEC_COUNT; i++)
+		{
+			readVecHeader(is32bit, data, offset, counts[i], contents[i]);
+
+			// Written this way round so a huge count can't overflow
+			if(contents[i] > length || counts[i] > (length - contents[i]) / item_sizes[i])
+			{
+				return fail(validation_result::VECTOR_OUT_OF_BOUNDS, offset,
+					std::string(names[i]) + " vector of " + std::to_string(counts[i]) + " items at "
+					+ std::to_string(contents[i]) + " extends past the end of the file");
+			}
+
+			offset += vec_size;
+		}
+
+		// Strings are read with strlen, so each one has to start before the last null in the file. Finding
+		// that null once means each string is an O(1) check, rather than scanning over them all.
+		size_t terminated_before = 0;
+		for(size_t i=length; i>0; i--)
+		{
+			if(data[i - 1] == 0)
+			{
+				terminated_before = i;
+				break;
+			}
+		}
+
+		for(size_t i=0; i<counts[STRINGS]; i++)
+		{
+			size_t pos = contents[STRINGS] + i * item_sizes[STRINGS];
+			uint64_t str;
+			if(is32bit)
+			{
+				RawStr32 raw;
+				memcpy(&raw, &data[pos], sizeof(raw));
+				str = raw.str;
+			}
+			else
+			{
+				RawStr64 raw;
+				memcpy(&raw, &data[pos], sizeof(raw));
+				str = raw.str;
+			}
+
+			if(str >= terminated_before)
+			{
+				return fail(validation_result::STRING_OUT_OF_BOUNDS, pos,
+					"string " + std::to_string(i) + " at " + std::to_string(str) + " is not terminated within the file");
+			}
+		}
+
+		// The largest valid index for each type of reference. Nil and booleans don't use their index, and any
+		// type ID not listed here is invalid, so anything will be out of range for it.
+		uint32_t limits[256] = {};
+		limits[SNil::ID] = 0x1000000;
+		limits[SBool::ID_T] = 0x1000000;
+		limits[SBool::ID_F] = 0x1000000;
+		limits[SNum::ID] = counts[NUMBERS];
+		limits[SString::ID] = counts[STRINGS];
+		limits[SVector::ID] = counts[VECTORS];
+		limits[SQuaternion::ID] = counts[QUATS];
+		limits[SIdstring::ID] = counts[IDSTRINGS];
+		limits[STable::ID] = counts[TABLES];
+
+		for(size_t i=0; i<counts[TABLES]; i++)
+		{
+			size_t pos = contents[TABLES] + i * item_sizes[TABLES];
+			uint32_t meta;
+			size_t item_count;
+			uint64_t items;
+
+			if(is32bit)
+			{
+				RawTable32 raw;
+				memcpy(&raw, &data[pos], sizeof(raw));
+				meta = raw.meta;
+				item_count = raw.contents.count;
+				items = raw.contents.offset;
+			}
+			else
+			{
+				RawTable64 raw;
+				memcpy(&raw, &data[pos], sizeof(raw));
+				meta = (uint32_t) raw.meta; // Only the low half is used, see ReadTable
+				item_count = raw.contents.count;
+				items = raw.contents.offset;
+			}
+
+			if(meta != ~0u && meta >= counts[STRINGS])
+			{
+				return fail(validation_result::BAD_META, pos,
+					"table " + std::to_string(i) + " has invalid metatable string " + std::to_string(meta));
+			}
+
+			// Each item is a key and value reference
+			const size_t pair_size = sizeof(uint32_t) * 2;
+			if(items > length || item_count > (length - items) / pair_size)
+			{
+				return fail(validation_result::VECTOR_OUT_OF_BOUNDS, pos,
+					"table " + std::to_string(i) + " contents of " + std::to_string(item_count) + " items at "
+					+ std::to_string(items) + " extends past the end of the file");
+			}
+
+			size_t bad_index;
+			if(!checkRefs((const uint32_t*) &data[items], item_count * 2, limits, bad_index))
+			{
+				return fail(validation_result::BAD_REFERENCE, items + bad_index * sizeof(uint32_t),
+					"table " + std::to_string(i) + " contains an invalid reference");
+			}
+		}
+
+		size_t bad_index;
+		if(!checkRefs((const uint32_t*) &data[offset], 1, limits, bad_index))
+			return fail(validation_result::BAD_REFERENCE, offset, "invalid root reference");
+
+		return result;
+	}
+
 	ScriptData::ScriptData(size_t length, const uint8_t *data)
 	{
+		validation_result valid = validate_scriptdata(length, data);
+		if(!valid)
+			throw ScriptDataError(std::move(valid));
+
 		bool is32bit = determine_is_32bit(length, data);
 
 		size_t offset = 0;
@@ -294,6 +496,9 @@ namespace pd2hook::scriptdata
 		{
 			if(added) *added = false;
 
+			if(intern_values)
+				item = Canonical(item);
+
 			std::map<const SItem*, int> &oftype_indexes = item_positions[item->GetId()];
 
 			auto existing_idx = oftype_indexes.find(item);
@@ -332,7 +537,90 @@ namespace pd2hook::scriptdata
 			return use32bit;
 		}
 
-		explicit write_info(bool use32bit) : use32bit(use32bit) {}
+		// Find the item that will be written in place of the given one. When interning this is the first item
+		// seen with the same value - for tables, the same metatable and the same (interned) keys and values.
+		const SItem* Canonical(const SItem *item)
+		{
+			auto existing = canonical.find(item);
+			if (existing != canonical.end())
+				return existing->second;
+
+			std::string key;
+			key.push_back((char) item->GetId());
+
+			auto append = [&key](const void *data, size_t len)
+			{
+				key.append((const char*) data, len);
+			};
+
+			switch(item->GetId())
+			{
+			case SNil::ID:
+			case SBool::ID_T:
+			case SBool::ID_F:
+				// Never indexed, so nothing to do
+				return item;
+			case SNum::ID:
+				append(&((const SNum*) item)->val, sizeof(float));
+				break;
+			case SString::ID:
+				key += ((const SString*) item)->val;
+				break;
+			case SVector::ID:
+			{
+				const SVector *vec = (const SVector*) item;
+				float vals[3] = {vec->x, vec->y, vec->z};
+				append(vals, sizeof(vals));
+				break;
+			}
+			case SQuaternion::ID:
+			{
+				const SQuaternion *quat = (const SQuaternion*) item;
+				float vals[4] = {quat->x, quat->y, quat->z, quat->w};
+				append(vals, sizeof(vals));
+				break;
+			}
+			case SIdstring::ID:
+				append(&((const SIdstring*) item)->val, sizeof(uint64_t));
+				break;
+			case STable::ID:
+			{
+				// If we're already working out what this table is, it must (indirectly) contain itself. Use it
+				// as-is for now, which just means whatever contains it only gets merged with tables that refer to
+				// this exact object.
+				if (!tables_in_progress.insert(item).second)
+					return item;
+
+				const STable *table = (const STable*) item;
+				const SItem *meta = table->meta ? Canonical(table->meta) : nullptr;
+				append(&meta, sizeof(meta));
+
+				// Sort the entries so the key doesn't depend on the addresses of the original key objects
+				std::vector<std::pair<const SItem*, const SItem*>> entries;
+				entries.reserve(table->items.size());
+				for(const std::pair<const SItem* const, const SItem*> &pair : table->items)
+				{
+					entries.emplace_back(Canonical(pair.first), Canonical(pair.second));
+				}
+				std::sort(entries.begin(), entries.end());
+				append(entries.data(), entries.size() * sizeof(entries[0]));
+
+				tables_in_progress.erase(item);
+				break;
+			}
+			default:
+				throw std::exception();
+			}
+
+			const SItem *&found = by_value[key];
+			if (!found)
+				found = item;
+
+			canonical[item] = found;
+			return found;
+		}
+
+		explicit write_info(bool use32bit, bool intern_values) : use32bit(use32bit), intern_values(intern_values) {}
 		write_info(write_info&) = delete;
 
 		write_block& create_block()
@@ -382,9 +670,15 @@ namespace pd2hook::scriptdata
 		std::vector<std::unique_ptr<write_block>> blocks;
 		std::vector<linkage> linkages;
 
+		// Interning state, see Canonical
+		std::unordered_map<const SItem*, const SItem*> canonical;
+		std::unordered_map<std::string, const SItem*> by_value;
+		std::set<const SItem*> tables_in_progress;
+
 		bool frozen = false;
 		bool blocks_applied = false;
 		bool use32bit = false;
+		bool intern_values = false;
 	};
 
 	static void writeRef(write_block &out, SItem::write_info *info, const SItem *item)
@@ -403,7 +697,7 @@ namespace pd2hook::scriptdata
 		writeVal<uint32_t>(out, val);
 	}
 
-	std::string SItem::Serialise(bool use32bit) const
+	std::string SItem::Serialise(bool use32bit, bool intern_values) const
 	{
 		auto serialise_vector = [] (write_block &out, SItem::write_info &data, int id)
 		{
@@ -445,7 +739,7 @@ namespace pd2hook::scriptdata
 			timer = now;
 		};
 
-		write_info data(use32bit);
+		write_info data(use32bit, intern_values);
 
 		printtime("S:1");
 
@@ -3,15 +3,55 @@
 #include "FormatTools.h"
 
 #include <functional>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 
 namespace pd2hook::scriptdata
 {
 
 	bool determine_is_32bit(size_t length, const uint8_t *data);
 
+	// The outcome of checking a ScriptData file against it's own length, see validate_scriptdata
+	struct validation_result
+	{
+		enum error_t
+		{
+			OK = 0,
+			TRUNCATED_HEADER, // The file is too short to contain the header
+			VECTOR_OUT_OF_BOUNDS, // One of the item vectors (or a table's contents) extends past the end of the file
+			STRING_OUT_OF_BOUNDS, // A string starts past the end of the file, or is not null-terminated
+			BAD_REFERENCE, // A table entry or the root refers to an unknown type or a missing item
+			BAD_META, // A table's metatable name is not a valid string index
+		};
+
+		error_t error = OK;
+
+		// The position in the file of the value that failed validation
+		size_t offset = 0;
+
+		std::string message;
+
+		explicit operator bool() const
+		{
+			return error == OK;
+		}
+	};
+
+	// Check every offset, count, string and reference in a ScriptData file lies within the buffer, without
+	// decoding anything. If this passes, ScriptData can safely read the file.
+	validation_result validate_scriptdata(size_t length, const uint8_t *data);
+
+	class ScriptDataError : public std::runtime_error
+	{
+	public:
+		explicit ScriptDataError(validation_result result) : std::runtime_error(result.message), result(std::move(result)) {}
+
+		validation_result result;
+	};
+
 	class SItem
 	{
 	public:
@@ -21,7 +61,9 @@ namespace pd2hook::scriptdata
 		// Index in the respective vector
 		int index = -1;
 
-		virtual std::string Serialise(bool use32bit) const;
+		// If intern_values is set, items with equal values (including tables with the same contents) are
+		// written out only once, rather than once per distinct object.
+		virtual std::string Serialise(bool use32bit, bool intern_values = false) const;
 
 		// For internal use, don't actually use this
 		class write_info;
@@ -193,6 +235,7 @@ namespace pd2hook::scriptdata
 	class ScriptData
 	{
 	public:
+		// Throws ScriptDataError if the data is malformed
 		ScriptData(size_t length, const uint8_t *data);
 
 		inline const SItem* GetRoot()
@@ -200,6 +243,30 @@ namespace pd2hook::scriptdata
 			return root;
 		}
 
+		inline void SetRoot(const SItem *item)
+		{
+			root = item;
+		}
+
+		// Create a new item that belongs to this document, for use by patches
+		template<typename T, typename... Args>
+		T* AddItem(Args&&... args)
+		{
+			std::unique_ptr<T> item = std::make_unique<T>(std::forward<Args>(args)...);
+			T *ptr = item.get();
+			added.push_back(std::move(item));
+			return ptr;
+		}
+
+		// Every table reachable from the root belongs to this document, so it's fine for the document to
+		// hand out mutable versions of them. Returns null if the item isn't a table.
+		STable* EditTable(const SItem *item)
+		{
+			if(item->GetId() != STable::ID)
+				return nullptr;
+			return const_cast<STable*>(static_cast<const STable*>(item));
+		}
+
 	private:
 		std::vector<SNum> numbers;
 		std::vector<SString> strings;
@@ -210,6 +277,9 @@ namespace pd2hook::scriptdata
 
 		const SItem *root;
 
+		// Items created after the document was read
+		std::vector<std::unique_ptr<SItem>> added;
+
 		const SItem* Read(uint32_t);
 		void ReadTable(STable &out, std::pair<uint32_t, uint32_t> *data, size_t count, uint32_t meta);
 	};
@@ -0,0 +1,236 @@
+#include "ScriptDataPatch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <set>
+
+#include <stdio.h>
+
+namespace pd2hook::scriptdata
+{
+	typedef std::map<const SItem*, const SItem*>::iterator item_iter;
+
+	static std::string describe_key(const patch_value &key)
+	{
+		if(key.type == patch_value::STRING)
+			return "'" + key.string + "'";
+		if(key.type == patch_value::NUMBER)
+		{
+			char buff[32];
+			snprintf(buff, sizeof(buff), "%g", key.numbers[0]);
+			return buff;
+		}
+		return "<invalid key>";
+	}
+
+	static void check_key(const patch_value &key)
+	{
+		if(key.type != patch_value::STRING && key.type != patch_value::NUMBER)
+			throw PatchError("Patch keys must be strings or numbers");
+	}
+
+	static bool key_matches(const SItem *item, const patch_value &key)
+	{
+		if(key.type == patch_value::STRING)
+			return item->GetId() == SString::ID && ((const SString*) item)->val == key.string;
+		if(key.type == patch_value::NUMBER)
+			return item->GetId() == SNum::ID && ((const SNum*) item)->val == key.numbers[0];
+		return false;
+	}
+
+	// Tables are keyed by item pointers rather than values, so this has to look through every key. That's only
+	// the width of one table per path element though, rather than anything proportional to the document.
+	static item_iter find_key(STable &table, const patch_value &key)
+	{
+		return std::find_if(table.items.begin(), table.items.end(), [&key](const std::pair<const SItem* const, const SItem*> &pair)
+		{
+			return key_matches(pair.first, key);
+		});
+	}
+
+	static const SItem* create(ScriptData &doc, const patch_value &value);
+
+	static void set_key(ScriptData &doc, STable &table, const patch_value &key, const patch_value &value)
+	{
+		check_key(key);
+
+		item_iter existing = find_key(table, key);
+
+		// Setting something to nil removes it, same as in Lua
+		if(value.type == patch_value::NIL)
+		{
+			if(existing != table.items.end())
+				table.items.erase(existing);
+			return;
+		}
+
+		if(existing != table.items.end())
+		{
+			existing->second = create(doc, value);
+			return;
+		}
+
+		table.items[create(doc, key)] = create(doc, value);
+	}
+
+	static const SItem* create(ScriptData &doc, const patch_value &value)
+	{
+		switch(value.type)
+		{
+		case patch_value::NIL:
+			return &SNil::INSTANCE;
+		case patch_value::BOOL:
+			return value.boolean ? &SBool::STRUE : &SBool::SFALSE;
+		case patch_value::NUMBER:
+			return doc.AddItem<SNum>(value.numbers[0]);
+		case patch_value::STRING:
+			return doc.AddItem<SString>(value.string);
+		case patch_value::VECTOR:
+			return doc.AddItem<SVector>(value.numbers[0], value.numbers[1], value.numbers[2]);
+		case patch_value::QUATERNION:
+			return doc.AddItem<SQuaternion>(value.numbers[0], value.numbers[1], value.numbers[2], value.numbers[3]);
+		case patch_value::IDSTRING:
+			return doc.AddItem<SIdstring>(value.idstring);
+		case patch_value::TABLE:
+		{
+			STable *table = doc.AddItem<STable>();
+			table->meta = value.has_meta ? doc.AddItem<SString>(value.meta) : nullptr;
+
+			for(const std::pair<patch_value, patch_value> &pair : value.items)
+			{
+				set_key(doc, *table, pair.first, pair.second);
+			}
+
+			return table;
+		}
+		default:
+			throw PatchError("Invalid patch value type " + std::to_string(value.type));
+		}
+	}
+
+	// Follow the path from the root, returning the table the last key refers to.
+	// A table can be referenced from more than one place (particularly in interned documents) so each table along
+	// the path is copied the first time it's visited, and the copy put in it's place. That way patching one path
+	// can't change what's at another. The copies are recorded in private_tables so they're only made once.
+	static STable& resolve(ScriptData &doc, const std::vector<patch_value> &path, size_t length,
+		std::set<const STable*> &private_tables)
+	{
+		STable *table = doc.EditTable(doc.GetRoot());
+		if(!table)
+			throw PatchError("The document root is not a table");
+
+		for(size_t i = 0; i < length; i++)
+		{
+			check_key(path[i]);
+
+			item_iter found = find_key(*table, path[i]);
+			if(found == table->items.end())
+				throw PatchError("Patch path element " + describe_key(path[i]) + " does not exist");
+
+			STable *child = doc.EditTable(found->second);
+			if(!child)
+				throw PatchError("Patch path element " + describe_key(path[i]) + " is not a table");
+
+			if(!private_tables.count(child))
+			{
+				child = doc.AddItem<STable>(*child);
+				found->second = child;
+				private_tables.insert(child);
+			}
+
+			table = child;
+		}
+
+		return *table;
+	}
+
+	static bool is_integer_key(const SItem *item, float *out)
+	{
+		if(item->GetId() != SNum::ID)
+			return false;
+
+		float val = ((const SNum*) item)->val;
+		if(val < 1 || std::floor(val) != val)
+			return false;
+
+		*out = val;
+		return true;
+	}
+
+	static void insert(ScriptData &doc, STable &table, size_t position, const patch_value &value)
+	{
+		if(value.type == patch_value::NIL)
+			throw PatchError("Cannot insert nil into an array");
+
+		// Find all the entries that need moving up, and how long the array is
+		std::vector<std::pair<float, const SItem*>> moved;
+		size_t length = 0;
+		for(const std::pair<const SItem* const, const SItem*> &pair : table.items)
+		{
+			float key;
+			if(!is_integer_key(pair.first, &key))
+				continue;
+
+			length = std::max(length, (size_t) key);
+			if(position && key >= position)
+				moved.emplace_back(key, pair.second);
+		}
+
+		if(!position)
+			position = length + 1;
+
+		if(position > length + 1)
+		{
+			throw PatchError("Cannot insert at position " + std::to_string(position) + " in an array of length " +
+				std::to_string(length));
+		}
+
+		// The key items might be shared with other tables, so replace them rather than changing their values
+		for(auto it = table.items.begin(); it != table.items.end();)
+		{
+			float key;
+			if(is_integer_key(it->first, &key) && key >= position)
+				it = table.items.erase(it);
+			else
+				++it;
+		}
+
+		for(const std::pair<float, const SItem*> &entry : moved)
+		{
+			table.items[doc.AddItem<SNum>(entry.first + 1)] = entry.second;
+		}
+
+		table.items[doc.AddItem<SNum>((float) position)] = create(doc, value);
+	}
+
+	void apply_patch(ScriptData &doc, const std::vector<patch_op> &ops)
+	{
+		std::set<const STable*> private_tables;
+
+		for(const patch_op &op : ops)
+		{
+			switch(op.op)
+			{
+			case patch_op::SET:
+			case patch_op::REMOVE:
+			{
+				if(op.path.empty())
+					throw PatchError("Cannot set or remove the document root");
+
+				STable &parent = resolve(doc, op.path, op.path.size() - 1, private_tables);
+				set_key(doc, parent, op.path.back(), op.op == patch_op::SET ? op.value : patch_value());
+				break;
+			}
+			case patch_op::INSERT:
+			{
+				STable &array = resolve(doc, op.path, op.path.size(), private_tables);
+				insert(doc, array, op.position, op.value);
+				break;
+			}
+			default:
+				throw PatchError("Invalid patch operation " + std::to_string(op.op));
+			}
+		}
+	}
+
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ScriptData.h"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pd2hook::scriptdata
+{
+
+	// A value to be written into a document by a patch. This is independent of both the document
+	// and the scripting language the patch came from, so the same patch can be applied anywhere.
+	struct patch_value
+	{
+		enum type_t
+		{
+			NIL,
+			BOOL,
+			NUMBER,
+			STRING,
+			VECTOR,
+			QUATERNION,
+			IDSTRING,
+			TABLE,
+		};
+
+		type_t type = NIL;
+
+		bool boolean = false;
+		float numbers[4] = {}; // The number, or the vector/quaternion components
+		std::string string;
+		uint64_t idstring = 0;
+
+		// For tables
+		bool has_meta = false;
+		std::string meta;
+		std::vector<std::pair<patch_value, patch_value>> items;
+	};
+
+	struct patch_op
+	{
+		enum op_t
+		{
+			// Set the value of the last key in the path, replacing it if it already exists
+			SET,
+
+			// Remove the last key in the path, if it exists
+			REMOVE,
+
+			// Insert the value into the array named by the path, at the given (one-based) position, moving
+			// all the later items up. A position of zero appends it to the end.
+			INSERT,
+		};
+
+		op_t op = SET;
+
+		// The keys to follow from the root to reach the item, which may only be strings or numbers
+		std::vector<patch_value> path;
+
+		patch_value value;
+
+		size_t position = 0; // Only used by INSERT
+	};
+
+	class PatchError : public std::runtime_error
+	{
+	public:
+		explicit PatchError(const std::string &message) : std::runtime_error(message) {}
+	};
+
+	// Apply a series of operations to a document, in order. Each operation only touches the tables along it's
+	// path, so this is cheap compared to reading and writing the document.
+	// Throws PatchError if a path does not lead to a table, or an operation is malformed.
+	void apply_patch(ScriptData &doc, const std::vector<patch_op> &ops);
+
+};
@@ -2,20 +2,63 @@
 #define __QUEUE_HEADER__
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <deque>
-#include <list>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
 
 // Thread-safe, type-safe event manager
+//
+// Events are added from any thread, and run on the main thread once per frame. Each queue is a fixed-size lock-free
+// ring, which falls back to a list behind a mutex if it fills up, so adding an event doesn't normally take a lock and
+// checking an empty queue is a single atomic load.
+//
+// So a lot of events arriving at once (say, a mod reading a few hundred files) don't all run in the same frame, the
+// events only run until the frame budget is used up, and anything left over is carried over to the next frame.
 
 namespace pd2hook
 {
+	enum class EventPriority
+	{
+		// Always run every frame, regardless of the budget. Use this for events that must run before those of
+		// another queue that were added after them.
+		Immediate,
+
+		High,
+		Normal,
+		Low,
+	};
+
 	class IEventQueue
 	{
 	public:
+		typedef std::chrono::steady_clock::time_point TimePoint;
+
 		virtual ~IEventQueue() {}
-		virtual void ProcessEvents() = 0;
+
+		// Run events until the deadline passes, if limited is set. At least one event is always run, so no queue can
+		// be held up forever. Returns the number of events run, and sets deferred to the number left over.
+		virtual size_t ProcessEvents(TimePoint deadline, bool limited, size_t& deferred) = 0;
+
+		void SetPriority(EventPriority newPriority);
+		EventPriority GetPriority() const { return priority; }
+
+	private:
+		EventPriority priority = EventPriority::Normal;
+	};
+
+	struct EventQueueStats
+	{
+		uint64_t frames = 0; // Only those where any events were run
+		uint64_t events = 0;
+		uint64_t deferredEvents = 0; // Summed over every frame, so one event left over for two frames counts twice
+		uint64_t deferredFrames = 0; // Frames where some events had to be left over
+		uint64_t worstFrameUs = 0;
 	};
 
 	class EventQueueMaster
@@ -31,10 +74,22 @@ namespace pd2hook
 
 		void ProcessEvents();
 
+		// Zero means there's no limit
+		void SetFrameBudget(std::chrono::microseconds budget);
+		std::chrono::microseconds GetFrameBudget() const { return frameBudget; }
+
+		EventQueueStats GetStats(bool reset);
+
 	private:
+		friend class IEventQueue;
+
 		void registerQueue(IEventQueue *queue);
 
-		std::list<IEventQueue *> queues;
+		std::vector<IEventQueue *> queues;
+		bool queuesSorted = false;
+
+		std::chrono::microseconds frameBudget{4000};
+		EventQueueStats stats;
 	};
 
 	template<typename DataT>
@@ -59,25 +114,56 @@ namespace pd2hook
 
 		static EventQueue& GetSingleton();
 
+		// The number of events the ring can hold before new ones go to the overflow list. Must be a power of two.
+		static constexpr size_t RingSize = 1024;
+
 	protected:
 		EventQueue();
+		~EventQueue();
 
 	public:
-		virtual void ProcessEvents() override;
+		virtual size_t ProcessEvents(TimePoint deadline, bool limited, size_t& deferred) override;
 		void AddToQueue(EventItem item);
 		void AddToQueue(EventFunction runFunction, DataT data);
 
 	private:
-		std::deque<EventItem> eventQueue;
-		std::mutex lock;
+		struct Slot
+		{
+			// Equal to the position this slot will next be written at when it's free, and one past that once an
+			// event has been written into it
+			std::atomic<size_t> sequence;
+			alignas(EventItem) unsigned char storage[sizeof(EventItem)];
+		};
+
+		bool tryPushRing(EventItem& item);
+		bool tryPopRing(std::vector<EventItem>& out);
+
+		std::unique_ptr<Slot[]> ring;
+		alignas(64) std::atomic<size_t> pushPosition{0};
+		alignas(64) size_t popPosition = 0; // Only used by the main thread
+
+		// Events that have been added and not yet taken by ProcessEvents
+		std::atomic<size_t> pending{0};
+
+		// Once anything is in the overflow list, everything goes there until it's emptied, so events from the
+		// same thread stay in order
+		std::deque<EventItem> overflow;
+		std::atomic<size_t> overflowCount{0};
+		std::mutex overflowLock;
+
+		// Where events are moved to before they're run, kept between frames so it doesn't need reallocating. Anything
+		// after batchPosition was left over from the last frame.
+		std::vector<EventItem> batch;
+		size_t batchPosition = 0;
+		bool processing = false;
 	};
 
 	template<typename DataT>
 	struct EventQueueRuntimeRegisterer
 	{
-		EventQueueRuntimeRegisterer()
+		EventQueueRuntimeRegisterer(EventPriority priority)
 		{
-			EventQueue<DataT>::GetSingleton();
+			EventQueue<DataT>::GetSingleton().SetPriority(priority);
 		}
 	};
 
@@ -85,8 +171,9 @@ namespace pd2hook
 #define PD2HOOK_CONCAT(x, y) PD2HOOK_CONCAT_IMPL(x, y)
 
 	// Not strictly necessary, but is a nice chance to make sure the static instance is initialised before there's a chance for multithreaded calls
-#define PD2HOOK_REGISTER_EVENTQUEUE(DataT, Name) \
-	namespace { ::pd2hook::EventQueueRuntimeRegisterer<DataT> PD2HOOK_CONCAT(staticRegisterer, __COUNTER__); ::pd2hook::EventQueue<DataT>& Get##Name##Queue() { return ::pd2hook::EventQueue<DataT>::GetSingleton(); } }
+#define PD2HOOK_REGISTER_EVENTQUEUE_PRIORITY(DataT, Name, Priority) \
+	namespace { ::pd2hook::EventQueueRuntimeRegisterer<DataT> PD2HOOK_CONCAT(staticRegisterer, __COUNTER__)(Priority); ::pd2hook::EventQueue<DataT>& Get##Name##Queue() { return ::pd2hook::EventQueue<DataT>::GetSingleton(); } }
+#define PD2HOOK_REGISTER_EVENTQUEUE(DataT, Name) PD2HOOK_REGISTER_EVENTQUEUE_PRIORITY(DataT, Name, ::pd2hook::EventPriority::Normal)
 #define PD2HOOK_REGISTER_EVENTQUEUE_EASY(DataT) PD2HOOK_REGISTER_EVENTQUEUE(DataT, DataT)
 
 #ifdef _WIN32
@@ -94,11 +181,27 @@ namespace pd2hook
 #endif
 
 	template<typename DataT>
-	EventQueue<DataT>::EventQueue()
+	EventQueue<DataT>::EventQueue() :
+		ring(new Slot[RingSize])
 	{
+		static_assert((RingSize & (RingSize - 1)) == 0, "The ring size must be a power of two");
+
+		for (size_t i = 0; i < RingSize; i++)
+			ring[i].sequence.store(i, std::memory_order_relaxed);
+
 		EventQueueMaster::GetSingleton().registerQueue(this);
 	}
 
+	template<typename DataT>
+	EventQueue<DataT>::~EventQueue()
+	{
+		// Destroy anything that was never run
+		std::vector<EventItem> remaining;
+		while (tryPopRing(remaining))
+		{
+		}
+	}
+
 	template<typename DataT>
 	EventQueue<DataT>::EventItem::EventItem(EventFunction runFunction, DataT data) :
 		mFunc(runFunction), mData(std::move(data))
@@ -123,37 +226,129 @@ namespace pd2hook
 	}
 
 	template<typename DataT>
-	void EventQueue<DataT>::ProcessEvents()
+	bool EventQueue<DataT>::tryPushRing(EventItem& item)
 	{
-		decltype(eventQueue) localQueue;
+		size_t position = pushPosition.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true)
 		{
-			std::lock_guard<std::mutex> locker(lock);
-			// localQueue = std::move(eventQueue); standard is a little iffy on what happens to eventQueue after this, so do it manually
-			while (!eventQueue.empty())
+			slot = &ring[position & (RingSize - 1)];
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+
+			if (diff == 0)
 			{
-				localQueue.push_back(std::move(eventQueue.front()));
-				eventQueue.pop_front();
+				// The slot is free, try and claim it
+				if (pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				// The main thread hasn't taken the event that was here a lap ago, so the ring is full
+				return false;
+			}
+			else
+			{
+				// Another thread claimed this slot first
+				position = pushPosition.load(std::memory_order_relaxed);
 			}
 		}
 
-		std::for_each(localQueue.begin(), localQueue.end(), [](EventItem& e)
+		new (slot->storage) EventItem(std::move(item));
+		slot->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	template<typename DataT>
+	bool EventQueue<DataT>::tryPopRing(std::vector<EventItem>& out)
+	{
+		Slot& slot = ring[popPosition & (RingSize - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != popPosition + 1)
+			return false;
+
+		EventItem* item = reinterpret_cast<EventItem*>(slot.storage);
+		out.push_back(std::move(*item));
+		item->~EventItem();
+
+		slot.sequence.store(popPosition + RingSize, std::memory_order_release);
+		popPosition++;
+		return true;
+	}
+
+	template<typename DataT>
+	size_t EventQueue<DataT>::ProcessEvents(TimePoint deadline, bool limited, size_t& deferred)
+	{
+		deferred = 0;
+
+		// Don't run anything if an event ends up processing this queue again
+		if (processing)
+			return 0;
+
+		// Take everything that's been added so far in one go, after whatever was left over from last time. The ring
+		// goes first, since anything in it was added before the overflow list started filling up.
+		if (pending.load(std::memory_order_acquire) != 0)
 		{
-			e();
-		});
+			size_t oldSize = batch.size();
+
+			while (tryPopRing(batch))
+			{
+			}
+
+			if (overflowCount.load(std::memory_order_acquire) != 0)
+			{
+				std::lock_guard<std::mutex> locker(overflowLock);
+				while (!overflow.empty())
+				{
+					batch.push_back(std::move(overflow.front()));
+					overflow.pop_front();
+				}
+				overflowCount.store(0, std::memory_order_release);
+			}
+
+			pending.fetch_sub(batch.size() - oldSize, std::memory_order_acq_rel);
+		}
+
+		if (batchPosition == batch.size())
+			return 0;
+
+		// Events added while these run wait for the next frame
+		processing = true;
+		size_t end = batch.size();
+		size_t run = 0;
+		do
+		{
+			batch[batchPosition++]();
+			run++;
+		} while (batchPosition < end && (!limited || std::chrono::steady_clock::now() < deadline));
+		processing = false;
+
+		deferred = end - batchPosition;
+		if (deferred == 0)
+		{
+			batch.clear();
+			batchPosition = 0;
+		}
+
+		return run;
 	}
 
 	template<typename DataT>
 	void EventQueue<DataT>::AddToQueue(EventItem item)
 	{
-		std::lock_guard<std::mutex> locker(lock);
-		eventQueue.push_back(std::move(item));
+		if (overflowCount.load(std::memory_order_acquire) != 0 || !tryPushRing(item))
+		{
+			std::lock_guard<std::mutex> locker(overflowLock);
+			overflow.push_back(std::move(item));
+			overflowCount.fetch_add(1, std::memory_order_release);
+		}
+
+		pending.fetch_add(1, std::memory_order_release);
 	}
 
 	template<typename DataT>
 	void EventQueue<DataT>::AddToQueue(EventFunction runFunction, DataT data)
 	{
-		std::lock_guard<std::mutex> locker(lock);
-		eventQueue.emplace_back(runFunction, std::move(data));
+		AddToQueue(EventItem(runFunction, std::move(data)));
 	}
 
 #ifdef _WIN32
@@ -0,0 +1,366 @@
+#include "scheduler.h"
+
+#include "util/util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace pd2hook::threading;
+
+static const int min_workers = 4;
+static const int priority_count = 3;
+
+namespace
+{
+	struct worker
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks[priority_count];
+	};
+
+	class scheduler
+	{
+	public:
+		scheduler();
+
+		void submit(priority prio, std::function<void()> task);
+		void submit_after(priority prio, std::chrono::milliseconds delay, std::function<void()> task);
+
+		const int size;
+
+	private:
+		void run_worker(int index);
+		void run_timer();
+		void start_worker();
+		bool has_work() const;
+		bool take_task(int self, std::function<void()>& task, int& prio);
+		bool pop_task(int index, int prio, bool own, std::function<void()>& task);
+		void notify();
+
+		std::unique_ptr<worker[]> workers;
+
+		// The workers are started in order, so only the first started of them are running
+		std::atomic<int> started{0};
+		std::mutex start_mutex;
+
+		// Tasks that have been submitted but not taken yet
+		std::atomic<int> queued[priority_count] = {};
+
+		const int background_limit;
+		std::atomic<int> running_background{0};
+
+		std::atomic<int> idle{0};
+		std::mutex sleep_mutex;
+		std::condition_variable wake;
+
+		// Where tasks submitted from outside the pool go
+		std::atomic<unsigned int> next_worker{0};
+
+		// Tasks waiting for their delay to pass, which the timer thread submits
+		typedef std::pair<priority, std::function<void()>> delayed_task;
+		std::multimap<std::chrono::steady_clock::time_point, delayed_task> delayed;
+		std::mutex delayed_mutex;
+		std::condition_variable delayed_wake;
+		bool timer_started = false;
+	};
+} // namespace
+
+static thread_local int current_worker = -1;
+
+scheduler::scheduler()
+    : size(std::max(min_workers, (int)std::thread::hardware_concurrency())), workers(new worker[size]),
+      background_limit(std::max(1, size / 2))
+{
+}
+
+void scheduler::submit(priority prio, std::function<void()> task)
+{
+	// Start another worker if they're all busy. This is done under a mutex since it doesn't happen often, and we don't
+	// want several being started at once.
+	if (idle == 0 && started < size)
+	{
+		std::lock_guard<std::mutex> lock(start_mutex);
+		if (idle == 0 && started < size)
+			start_worker();
+	}
+
+	// Tasks from a worker are most likely related to what it's doing now, so keep them on it's own queue
+	int index = current_worker;
+	if (index == -1)
+		index = (int)(next_worker++ % (unsigned int)started);
+
+	{
+		std::lock_guard<std::mutex> lock(workers[index].mutex);
+		workers[index].tasks[(int)prio].push_back(std::move(task));
+	}
+	queued[(int)prio]++;
+
+	notify();
+}
+
+void scheduler::submit_after(priority prio, std::chrono::milliseconds delay, std::function<void()> task)
+{
+	auto when = std::chrono::steady_clock::now() + delay;
+
+	{
+		std::lock_guard<std::mutex> lock(delayed_mutex);
+		delayed.emplace(when, delayed_task(prio, std::move(task)));
+
+		if (!timer_started)
+		{
+			timer_started = true;
+			std::thread thread([this]() { run_timer(); });
+			thread.detach();
+		}
+	}
+
+	delayed_wake.notify_one();
+}
+
+void scheduler::run_timer()
+{
+	std::unique_lock<std::mutex> lock(delayed_mutex);
+	while (true)
+	{
+		if (delayed.empty())
+		{
+			delayed_wake.wait(lock);
+			continue;
+		}
+
+		auto first = delayed.begin();
+		if (first->first > std::chrono::steady_clock::now())
+		{
+			delayed_wake.wait_until(lock, first->first);
+			continue;
+		}
+
+		delayed_task task = std::move(first->second);
+		delayed.erase(first);
+
+		lock.unlock();
+		submit(task.first, std::move(task.second));
+		lock.lock();
+	}
+}
+
+// Must be called with start_mutex held
+void scheduler::start_worker()
+{
+	int index = started;
+
+	PD2HOOK_LOG_LOG("Starting worker thread " + std::to_string(index));
+
+	std::thread thread([this, index]() { run_worker(index); });
+	thread.detach();
+
+	started = index + 1;
+}
+
+void scheduler::notify()
+{
+	// Take the mutex so a worker can't miss this between checking for work and going to sleep
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+	}
+	wake.notify_one();
+}
+
+bool scheduler::has_work() const
+{
+	int bg = (int)priority::background;
+	for (int prio = 0; prio < bg; prio++)
+	{
+		if (queued[prio] > 0)
+			return true;
+	}
+
+	return queued[bg] > 0 && running_background < background_limit;
+}
+
+bool scheduler::pop_task(int index, int prio, bool own, std::function<void()>& task)
+{
+	worker& w = workers[index];
+	std::lock_guard<std::mutex> lock(w.mutex);
+
+	std::deque<std::function<void()>>& tasks = w.tasks[prio];
+	if (tasks.empty())
+		return false;
+
+	// A worker takes the newest of it's own tasks, and the oldest of everyone else's
+	if (own)
+	{
+		task = std::move(tasks.back());
+		tasks.pop_back();
+	}
+	else
+	{
+		task = std::move(tasks.front());
+		tasks.pop_front();
+	}
+
+	queued[prio]--;
+	return true;
+}
+
+bool scheduler::take_task(int self, std::function<void()>& task, int& prio)
+{
+	for (prio = 0; prio < priority_count; prio++)
+	{
+		if (queued[prio] <= 0)
+			continue;
+
+		// Reserve a place before looking for a background task, so two workers can't both go over the limit
+		bool background = prio == (int)priority::background;
+		if (background && running_background++ >= background_limit)
+		{
+			running_background--;
+			continue;
+		}
+
+		if (pop_task(self, prio, true, task))
+			return true;
+
+		int count = started;
+		for (int i = 1; i < count; i++)
+		{
+			if (pop_task((self + i) % count, prio, false, task))
+				return true;
+		}
+
+		if (background)
+			running_background--;
+	}
+
+	return false;
+}
+
+void scheduler::run_worker(int index)
+{
+	current_worker = index;
+
+	while (true)
+	{
+		std::function<void()> task;
+		int prio;
+		if (!take_task(index, task, prio))
+		{
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			idle++;
+			wake.wait(lock, [this]() { return has_work(); });
+			idle--;
+			continue;
+		}
+
+		task();
+
+		if (prio == (int)priority::background)
+		{
+			running_background--;
+
+			// Another background task might have been waiting for this one to finish
+			if (queued[prio] > 0)
+				notify();
+		}
+	}
+}
+
+static scheduler& get_scheduler()
+{
+	// This is never deleted, since the workers might still be running when the game exits
+	static scheduler* instance = new scheduler();
+	return *instance;
+}
+
+void pd2hook::threading::submit(priority prio, std::function<void()> task)
+{
+	get_scheduler().submit(prio, std::move(task));
+}
+
+void pd2hook::threading::submit_after(priority prio, std::chrono::milliseconds delay, std::function<void()> task)
+{
+	get_scheduler().submit_after(prio, delay, std::move(task));
+}
+
+namespace
+{
+	struct parallel_state
+	{
+		const std::function<void(size_t)>* func;
+		size_t count;
+		priority prio;
+		std::atomic<size_t> next{0};
+		std::atomic<size_t> finished{0};
+
+		std::mutex mutex;
+		std::condition_variable all_finished;
+
+		// Run the next item, returning false if there were none left to start
+		bool run_one()
+		{
+			size_t index = next++;
+			if (index >= count)
+				return false;
+
+			(*func)(index);
+
+			if (++finished == count)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				all_finished.notify_all();
+			}
+			return true;
+		}
+	};
+
+	// A helper only runs a single item before giving it's worker back, so anything more important that was
+	// submitted in the meantime (like IO a mod is waiting on) is run first rather than waiting for the whole loop
+	void run_parallel_helper(std::shared_ptr<parallel_state> state)
+	{
+		if (state->run_one() && state->next < state->count)
+			submit(state->prio, [state]() { run_parallel_helper(state); });
+	}
+} // namespace
+
+void pd2hook::threading::parallel_for(priority prio, size_t count, const std::function<void(size_t)>& func)
+{
+	if (count == 0)
+		return;
+
+	// Helpers that only start after everything's been taken don't touch func, so it's fine that it might be gone by
+	// then, but they do need the state
+	std::shared_ptr<parallel_state> state = std::make_shared<parallel_state>();
+	state->func = &func;
+	state->count = count;
+	state->prio = prio;
+
+	size_t helpers = std::min(count, (size_t)get_scheduler().size) - 1;
+	for (size_t i = 0; i < helpers; i++)
+		submit(prio, [state]() { run_parallel_helper(state); });
+
+	// The calling thread is already busy waiting for this, so it may as well keep going until there's nothing left
+	while (state->run_one())
+	{
+	}
+
+	// Wait for the items the helpers are still running
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->all_finished.wait(lock, [&state]() { return state->finished == state->count; });
+}
+
+int pd2hook::threading::worker_count()
+{
+	return get_scheduler().size;
+}
+
+bool pd2hook::threading::is_worker_thread()
+{
+	return current_worker != -1;
+}
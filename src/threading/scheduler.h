@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <stddef.h>
+
+// The thread pool used for most of what SuperBLT does in the background, such as async IO and hashing. There's
+// one worker per core (with a minimum of four), each of which has it's own queue of tasks. Tasks submitted from a
+// worker go on that worker's queue, and any worker that runs out of work takes tasks from the others, so a burst of
+// requests from a mod is spread over the pool rather than starting a thread for each one.
+//
+// The workers are started as they're needed, and never exit.
+namespace pd2hook::threading
+{
+	enum class priority
+	{
+		// Short file reads and writes, which a mod is likely waiting on
+		io,
+
+		// Work that keeps a core busy, like hashing
+		cpu,
+
+		// Anything that may block for a while or isn't urgent, like saving caches. At most half the workers will run
+		// these at once, so they can't hold up the other priorities. HTTP requests have their own threads instead,
+		// see http.cpp.
+		background,
+	};
+
+	// Run a task on the pool. Tasks of a higher priority are always taken first, but otherwise there's no guarantee
+	// about the order they run in.
+	void submit(priority prio, std::function<void()> task);
+
+	// Submit a task once the delay has passed. This is handled by a separate timer thread, so the workers aren't held
+	// up waiting for it.
+	void submit_after(priority prio, std::chrono::milliseconds delay, std::function<void()> task);
+
+	// Run func for every index from zero up to count, spread over the pool, and return once they've all finished. The
+	// calling thread runs them too rather than just waiting, so this can safely be used from a worker. Each worker
+	// helping out only takes one item at a time, so more important work isn't held up until the whole loop is done.
+	void parallel_for(priority prio, size_t count, const std::function<void(size_t)>& func);
+
+	// The number of workers the pool can have
+	int worker_count();
+
+	// Returns true if the current thread is one of the pool's workers
+	bool is_worker_thread();
+} // namespace pd2hook::threading
@@ -11,14 +11,63 @@ namespace pd2hook
 
 	void EventQueueMaster::ProcessEvents()
 	{
-		std::for_each(queues.begin(), queues.end(), [](IEventQueue *q)
+		auto start = std::chrono::steady_clock::now();
+		auto deadline = start + frameBudget;
+		bool limited = frameBudget.count() > 0;
+
+		if (!queuesSorted)
+		{
+			std::stable_sort(queues.begin(), queues.end(), [](IEventQueue *a, IEventQueue *b)
+			{
+				return a->GetPriority() < b->GetPriority();
+			});
+			queuesSorted = true;
+		}
+
+		size_t run = 0;
+		size_t deferred = 0;
+		std::for_each(queues.begin(), queues.end(), [&](IEventQueue *q)
 		{
-			q->ProcessEvents();
+			size_t queueDeferred;
+			run += q->ProcessEvents(deadline, limited && q->GetPriority() != EventPriority::Immediate, queueDeferred);
+			deferred += queueDeferred;
 		});
+
+		if (run == 0)
+			return;
+
+		uint64_t time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+		stats.frames++;
+		stats.events += run;
+		stats.deferredEvents += deferred;
+		if (deferred)
+			stats.deferredFrames++;
+		stats.worstFrameUs = std::max(stats.worstFrameUs, time);
+	}
+
+	void EventQueueMaster::SetFrameBudget(std::chrono::microseconds budget)
+	{
+		frameBudget = budget;
+	}
+
+	EventQueueStats EventQueueMaster::GetStats(bool reset)
+	{
+		EventQueueStats result = stats;
+		if (reset)
+			stats = EventQueueStats();
+		return result;
 	}
 
 	void EventQueueMaster::registerQueue(IEventQueue *q)
 	{
 		queues.push_back(q);
+		queuesSorted = false;
+	}
+
+	void IEventQueue::SetPriority(EventPriority newPriority)
+	{
+		priority = newPriority;
+		EventQueueMaster::GetSingleton().queuesSorted = false;
 	}
 }
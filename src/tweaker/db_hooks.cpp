@@ -21,6 +21,7 @@
 
 using blt::db::DieselDB;
 using blt::db::DslFile;
+using pd2hook::tweaker::dbhook::parse_hash;
 
 static const char* MODULE = "base/native/DB_001";
 
@@ -55,7 +56,9 @@ class DBTargetFile
 
 		if (wren_loader_obj)
 		{
-			wrenReleaseHandle(pd2hook::wren::get_wren_vm(), wren_loader_obj);
+			WrenVM* vm = pd2hook::wren::get_wren_vm();
+			if (vm)
+				wrenReleaseHandle(vm, wren_loader_obj);
 			wren_loader_obj = nullptr;
 		}
 	}
@@ -194,7 +197,7 @@ WrenForeignClassMethods pd2hook::tweaker::dbhook::bind_dbhook_class([[maybe_unus
 	return {nullptr, nullptr};
 }
 
-static blt::idstring parseHash(std::string value)
+blt::idstring pd2hook::tweaker::dbhook::parse_hash(const std::string& value)
 {
 	if (value.size() == 17 && value.at(0) == '@')
 	{
@@ -226,11 +229,22 @@ static blt::idstring parseHash(std::string value)
 
 static void wrenRegisterAssetHook(WrenVM* vm)
 {
-	blt::idstring name = parseHash(wrenGetSlotString(vm, 1));
-	blt::idstring ext = parseHash(wrenGetSlotString(vm, 2));
+	blt::idstring name = parse_hash(wrenGetSlotString(vm, 1));
+	blt::idstring ext = parse_hash(wrenGetSlotString(vm, 2));
 
 	blt::idfile file(name, ext);
 
+	// The pooled VMs only run tweaks, so they get a hook that works as normal from Wren but isn't used for loading
+	// anything, as the main VM has already registered the real one.
+	if (!pd2hook::wren::is_main_vm(vm))
+	{
+		wrenGetVariable(vm, MODULE, "DBAssetHook", 0);
+		auto* hook = (DBAssetHook*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(DBAssetHook));
+		hook->file = std::make_shared<DBTargetFile>(file);
+		hook->magic = DBAssetHook::MAGIC_COOKIE;
+		return;
+	}
+
 	if (overriddenFiles.count(file))
 	{
 		const char* name_str = wrenGetSlotString(vm, 1);
@@ -254,8 +268,8 @@ static void wrenRegisterAssetHook(WrenVM* vm)
 
 static void wrenLoadAssetContents(WrenVM* vm)
 {
-	blt::idstring name = parseHash(wrenGetSlotString(vm, 1));
-	blt::idstring ext = parseHash(wrenGetSlotString(vm, 2));
+	blt::idstring name = parse_hash(wrenGetSlotString(vm, 1));
+	blt::idstring ext = parse_hash(wrenGetSlotString(vm, 2));
 
 	DslFile* file = DieselDB::Instance()->Find(name, ext);
 
@@ -312,6 +326,19 @@ static void wrenLoadAssetContents(WrenVM* vm)
 	}
 }
 
+void pd2hook::tweaker::dbhook::release_wren_handles(WrenVM* vm)
+{
+	for (const auto& pair : overriddenFiles)
+	{
+		DBTargetFile& target = *pair.second;
+		if (target.wren_loader_obj)
+		{
+			wrenReleaseHandle(vm, target.wren_loader_obj);
+			target.wren_loader_obj = nullptr;
+		}
+	}
+}
+
 bool pd2hook::tweaker::dbhook::hook_asset_load(const blt::idfile& asset_file, BLTAbstractDataStore** out_datastore,
                                                int64_t* out_pos, int64_t* out_len, std::string& out_name,
                                                bool fallback_mode)
@@ -410,8 +437,7 @@ bool pd2hook::tweaker::dbhook::hook_asset_load(const blt::idfile& asset_file, BL
 		auto lock = pd2hook::wren::lock_wren_vm();
 		WrenVM* vm = pd2hook::wren::get_wren_vm();
 
-		// Probably not ideal to have it as a static, but hey it works fine and we only ever make one Wren context
-		static WrenHandle* callHandle = wrenMakeCallHandle(vm, "load_file(_,_)");
+		WrenHandle* callHandle = pd2hook::wren::get_call_handle("load_file(_,_)");
 
 		char hex[17]; // 16-chars long +1 for the null
 		memset(hex, 0, sizeof(hex));
@@ -511,14 +537,17 @@ void DBForeignFile::ofFile(WrenVM* vm)
 
 void DBForeignFile::ofAsset(WrenVM* vm)
 {
-	blt::idstring name = parseHash(wrenGetSlotString(vm, 1));
-	blt::idstring ext = parseHash(wrenGetSlotString(vm, 2));
+	blt::idstring name = parse_hash(wrenGetSlotString(vm, 1));
+	blt::idstring ext = parse_hash(wrenGetSlotString(vm, 2));
 	create(vm)->asset = blt::idfile(name, ext);
 }
 
 void DBForeignFile::fromString(WrenVM* vm)
 {
-	std::unique_ptr<std::string> contents = std::make_unique<std::string>(wrenGetSlotString(vm, 1));
+	// Read it as bytes, so binary files (such as from ScriptData.patch) aren't cut off at the first null
+	int len = 0;
+	const char* bytes = wrenGetSlotBytes(vm, 1, &len);
+	std::unique_ptr<std::string> contents = std::make_unique<std::string>(bytes, len);
 	create(vm)->stringLiteral = std::move(contents);
 }
 
@@ -626,8 +655,8 @@ void DBAssetHook::setDirectBundle(WrenVM* vm)
 	auto* it = get_this(vm);
 	it->clear_sources();
 
-	blt::idstring name = parseHash(wrenGetSlotString(vm, 1));
-	blt::idstring ext = parseHash(wrenGetSlotString(vm, 2));
+	blt::idstring name = parse_hash(wrenGetSlotString(vm, 1));
+	blt::idstring ext = parse_hash(wrenGetSlotString(vm, 2));
 
 	it->direct_bundle = blt::idfile(name, ext);
 }
@@ -649,6 +678,10 @@ void DBAssetHook::setWrenLoader(WrenVM* vm)
 	auto* it = get_this(vm);
 	it->clear_sources();
 
+	// Handles are always released on the main VM, and pooled VMs don't load assets anyway
+	if (!pd2hook::wren::is_main_vm(vm))
+		return;
+
 	it->wren_loader_obj = wrenGetSlotHandle(vm, 1);
 }
 
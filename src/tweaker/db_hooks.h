@@ -15,6 +15,13 @@ namespace pd2hook::tweaker::dbhook
 
 	WrenForeignClassMethods bind_dbhook_class(WrenVM* vm, const char* module, const char* class_name);
 
+	// Parse a name or extension in the format used by the Wren API: either an @ followed by the 16-character hex
+	// hash, or a plain string which is hashed. Aborts if an @-prefixed value isn't a valid hash.
+	blt::idstring parse_hash(const std::string& value);
+
+	// Release the Wren objects held by asset hooks, as the VM is about to be freed
+	void release_wren_handles(WrenVM* vm);
+
 	// Return true if the asset was found and the resulting datastore has been set, false otherwise.
 	bool hook_asset_load(const blt::idfile& asset_file, BLTAbstractDataStore** out_datastore, int64_t* out_pos,
 	                     int64_t* out_len, std::string& out_name, bool fallback_mode);
@@ -0,0 +1,835 @@
+#include "declarative_tweaks.h"
+
+#include "db_hooks.h"
+#include "wrenloader.h"
+#include "util/util.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <string_view>
+
+using namespace pd2hook::tweaker;
+using namespace pd2hook::tweaker::declarative;
+using std::string;
+using std::string_view;
+
+// Files with registered tweaks. The lists are never modified after being put in the map, so the loading thread
+// can take a reference to one and use it without holding the lock.
+static std::mutex tweaks_mutex;
+static std::map<blt::idfile, std::shared_ptr<const std::vector<tweak_op>>> registered_tweaks;
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool is_name_end(char c)
+{
+	return is_space(c) || c == '/' || c == '>' || c == '=' || c == '[' || c == ']';
+}
+
+xml_path declarative::parse_path(const string& path)
+{
+	xml_path result;
+	size_t pos = 0;
+
+	while (pos < path.size())
+	{
+		path_step step;
+
+		size_t name_end = pos;
+		while (name_end < path.size() && path[name_end] != '/' && path[name_end] != '[')
+			name_end++;
+		step.name = path.substr(pos, name_end - pos);
+		if (step.name.empty())
+			throw TweakError("Empty element name in path '" + path + "'");
+		pos = name_end;
+
+		while (pos < path.size() && path[pos] == '[')
+		{
+			size_t eq = path.find('=', pos);
+			if (eq == string::npos)
+				throw TweakError("Missing '=' in attribute filter in path '" + path + "'");
+			string name = path.substr(pos + 1, eq - pos - 1);
+			if (!name.empty() && name[0] == '@') // Allow XPath-style [@attr=value] too
+				name.erase(0, 1);
+
+			size_t value_start = eq + 1;
+			size_t value_end;
+			char quote = value_start < path.size() ? path[value_start] : 0;
+			if (quote == '\'' || quote == '"')
+			{
+				value_start++;
+				value_end = path.find(quote, value_start);
+				if (value_end == string::npos || value_end + 1 >= path.size() || path[value_end + 1] != ']')
+					throw TweakError("Unterminated attribute value in path '" + path + "'");
+				pos = value_end + 2;
+			}
+			else
+			{
+				value_end = path.find(']', value_start);
+				if (value_end == string::npos)
+					throw TweakError("Unterminated attribute filter in path '" + path + "'");
+				pos = value_end + 1;
+			}
+
+			step.attributes.emplace_back(name, path.substr(value_start, value_end - value_start));
+		}
+
+		result.push_back(std::move(step));
+
+		if (pos < path.size())
+		{
+			if (path[pos] != '/')
+				throw TweakError("Unexpected '" + string(1, path[pos]) + "' in path '" + path + "'");
+			pos++;
+		}
+	}
+
+	if (result.empty())
+		throw TweakError("Empty path");
+
+	return result;
+}
+
+namespace
+{
+	struct attribute
+	{
+		string_view name;
+		string_view value; // Still escaped
+		char quote;
+	};
+
+	// Everything we need to know about a start tag
+	struct start_tag
+	{
+		string_view name;
+		std::vector<attribute> attributes;
+		bool self_closing = false;
+	};
+
+	// An element we're currently inside of
+	struct open_element
+	{
+		string_view name;
+
+		// The indices of the ops whose path matches all the way down to this element, but which target
+		// something further down
+		std::vector<uint32_t> active;
+
+		// Set if this element has been removed or replaced, and it's contents are being skipped
+		bool skipping = false;
+
+		std::vector<const tweak_op*> insert_last;
+		std::vector<const tweak_op*> insert_after;
+
+		bool is_live() const
+		{
+			return skipping || !active.empty() || !insert_last.empty() || !insert_after.empty();
+		}
+	};
+
+	class stream_tweaker
+	{
+	public:
+		stream_tweaker(const std::vector<tweak_op>& ops, const char* text, size_t length, string& output)
+			: ops(ops), text(text), length(length), output(output)
+		{
+		}
+
+		// Check the whole document is well-formed, rather than stopping once nothing else can change
+		bool validate = false;
+
+		bool run();
+
+	private:
+		const std::vector<tweak_op>& ops;
+		const char* text;
+		size_t length;
+		string& output;
+
+		size_t pos = 0;
+		size_t copied = 0; // Everything before this has been copied to the output (or skipped)
+		bool changed = false;
+		int skip_depth = 0; // How many elements deep we are inside something being removed
+
+		std::vector<open_element> stack;
+
+		// How many elements in the stack still have something to do - once we're inside the root element and this
+		// is zero, nothing else in the document can be changed.
+		int live_elements = 0;
+
+		void push(open_element&& element);
+
+		[[noreturn]] void fail(const string& message) const;
+		size_t find(const char* terminator, size_t from) const;
+		void flush(size_t to);
+
+		void parse_start_tag(size_t start, size_t& end, start_tag& tag);
+		void handle_start_tag(size_t start);
+		void handle_end_tag(size_t start);
+
+		bool step_matches(const path_step& step, const start_tag& tag) const;
+		void write_tag(const start_tag& tag, const std::vector<const tweak_op*>& set_ops, bool self_closing);
+	};
+} // namespace
+
+void stream_tweaker::push(open_element&& element)
+{
+	if (element.is_live())
+		live_elements++;
+	stack.push_back(std::move(element));
+}
+
+void stream_tweaker::fail(const string& message) const
+{
+	// Give the line number so whoever wrote the file can find the problem
+	int line = 1;
+	for (size_t i = 0; i < pos && i < length; i++)
+	{
+		if (text[i] == '\n')
+			line++;
+	}
+	throw TweakError("Malformed XML at line " + std::to_string(line) + ": " + message);
+}
+
+size_t stream_tweaker::find(const char* terminator, size_t from) const
+{
+	const char* found = std::search(text + from, text + length, terminator, terminator + strlen(terminator));
+	if (found == text + length)
+		fail(string("missing '") + terminator + "'");
+	return found - text;
+}
+
+void stream_tweaker::flush(size_t to)
+{
+	if (to > copied)
+		output.append(text + copied, to - copied);
+	copied = to;
+}
+
+static string_view read_name(const char* text, size_t length, size_t& pos)
+{
+	size_t start = pos;
+	while (pos < length && !is_name_end(text[pos]))
+		pos++;
+	return string_view(text + start, pos - start);
+}
+
+void stream_tweaker::parse_start_tag(size_t start, size_t& end, start_tag& tag)
+{
+	size_t p = start + 1;
+	tag.name = read_name(text, length, p);
+	if (tag.name.empty())
+		fail("missing element name");
+
+	while (true)
+	{
+		while (p < length && is_space(text[p]))
+			p++;
+		if (p >= length)
+			fail("unterminated tag <" + string(tag.name) + ">");
+
+		if (text[p] == '>')
+		{
+			end = p + 1;
+			return;
+		}
+		if (text[p] == '/' && p + 1 < length && text[p + 1] == '>')
+		{
+			tag.self_closing = true;
+			end = p + 2;
+			return;
+		}
+
+		attribute attr;
+		attr.name = read_name(text, length, p);
+		if (attr.name.empty())
+			fail("unexpected '" + string(1, text[p]) + "' in tag <" + string(tag.name) + ">");
+
+		while (p < length && is_space(text[p]))
+			p++;
+		if (p >= length || text[p] != '=')
+			fail("attribute '" + string(attr.name) + "' has no value");
+		p++;
+		while (p < length && is_space(text[p]))
+			p++;
+
+		if (p >= length || (text[p] != '"' && text[p] != '\''))
+			fail("attribute '" + string(attr.name) + "' is not quoted");
+		attr.quote = text[p];
+
+		const char* value_end = (const char*)memchr(text + p + 1, attr.quote, length - p - 1);
+		if (!value_end)
+			fail("unterminated value for attribute '" + string(attr.name) + "'");
+		attr.value = string_view(text + p + 1, value_end - (text + p + 1));
+		p = value_end - text + 1;
+
+		tag.attributes.push_back(attr);
+	}
+}
+
+static string unescape(string_view value)
+{
+	if (value.find('&') == string_view::npos)
+		return string(value);
+
+	static const std::pair<const char*, char> entities[] = {
+		{"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''},
+	};
+
+	string result;
+	for (size_t i = 0; i < value.size(); i++)
+	{
+		bool found = false;
+		if (value[i] == '&')
+		{
+			for (const auto& entity : entities)
+			{
+				size_t len = strlen(entity.first);
+				if (value.substr(i, len) == entity.first)
+				{
+					result.push_back(entity.second);
+					i += len - 1;
+					found = true;
+					break;
+				}
+			}
+		}
+		if (!found)
+			result.push_back(value[i]);
+	}
+	return result;
+}
+
+static void append_escaped(string& out, const string& value)
+{
+	for (char c : value)
+	{
+		switch (c)
+		{
+		case '&':
+			out += "&amp;";
+			break;
+		case '<':
+			out += "&lt;";
+			break;
+		case '>':
+			out += "&gt;";
+			break;
+		case '"':
+			out += "&quot;";
+			break;
+		default:
+			out.push_back(c);
+		}
+	}
+}
+
+bool stream_tweaker::step_matches(const path_step& step, const start_tag& tag) const
+{
+	if (step.name != "*" && tag.name != step.name)
+		return false;
+
+	for (const auto& required : step.attributes)
+	{
+		bool found = false;
+		for (const attribute& attr : tag.attributes)
+		{
+			if (attr.name == required.first)
+			{
+				found = unescape(attr.value) == required.second;
+				break;
+			}
+		}
+		if (!found)
+			return false;
+	}
+
+	return true;
+}
+
+void stream_tweaker::write_tag(const start_tag& tag, const std::vector<const tweak_op*>& set_ops, bool self_closing)
+{
+	output.push_back('<');
+	output.append(tag.name);
+
+	for (const attribute& attr : tag.attributes)
+	{
+		// The last op to set an attribute wins, same as if they were run one after another
+		const tweak_op* setter = nullptr;
+		for (const tweak_op* op : set_ops)
+		{
+			if (attr.name == op->attribute)
+				setter = op;
+		}
+
+		output.push_back(' ');
+		output.append(attr.name);
+		output.push_back('=');
+		if (setter)
+		{
+			output.push_back('"');
+			append_escaped(output, setter->value);
+			output.push_back('"');
+		}
+		else
+		{
+			output.push_back(attr.quote);
+			output.append(attr.value);
+			output.push_back(attr.quote);
+		}
+	}
+
+	// Add any attributes that didn't exist already, once each
+	for (size_t i = 0; i < set_ops.size(); i++)
+	{
+		const tweak_op* op = set_ops[i];
+
+		bool exists = false;
+		for (const attribute& attr : tag.attributes)
+			exists |= attr.name == op->attribute;
+		for (size_t j = i + 1; j < set_ops.size(); j++)
+			exists |= set_ops[j]->attribute == op->attribute;
+		if (exists)
+			continue;
+
+		output.push_back(' ');
+		output.append(op->attribute);
+		output += "=\"";
+		append_escaped(output, op->value);
+		output.push_back('"');
+	}
+
+	output += self_closing ? "/>" : ">";
+}
+
+void stream_tweaker::handle_start_tag(size_t start)
+{
+	start_tag tag;
+	size_t end;
+	parse_start_tag(start, end, tag);
+	pos = end;
+
+	if (skip_depth)
+	{
+		if (!tag.self_closing)
+			skip_depth++;
+		return;
+	}
+
+	// Find which ops are still matching at this element, and which ones target it
+	size_t depth = stack.size();
+	open_element element;
+	element.name = tag.name;
+
+	const tweak_op* replacement = nullptr;
+	bool removed = false;
+	std::vector<const tweak_op*> set_ops, insert_before, insert_first;
+
+	auto check_op = [&](uint32_t index) {
+		const tweak_op& op = ops[index];
+		if (depth >= op.path.size() || !step_matches(op.path[depth], tag))
+			return;
+
+		if (depth + 1 < op.path.size())
+		{
+			element.active.push_back(index);
+			return;
+		}
+
+		switch (op.kind)
+		{
+		case tweak_op::SET_ATTRIBUTE:
+			set_ops.push_back(&op);
+			break;
+		case tweak_op::REMOVE:
+			removed = true;
+			break;
+		case tweak_op::REPLACE:
+			if (!removed)
+				replacement = &op;
+			removed = true;
+			break;
+		case tweak_op::INSERT_BEFORE:
+			insert_before.push_back(&op);
+			break;
+		case tweak_op::INSERT_AFTER:
+			element.insert_after.push_back(&op);
+			break;
+		case tweak_op::INSERT_FIRST:
+			insert_first.push_back(&op);
+			break;
+		case tweak_op::INSERT_LAST:
+			element.insert_last.push_back(&op);
+			break;
+		}
+	};
+
+	if (stack.empty())
+	{
+		for (uint32_t i = 0; i < ops.size(); i++)
+			check_op(i);
+	}
+	else
+	{
+		for (uint32_t index : stack.back().active)
+			check_op(index);
+	}
+
+	bool targeted = removed || !set_ops.empty() || !insert_before.empty() || !insert_first.empty() ||
+	                !element.insert_last.empty() || !element.insert_after.empty();
+
+	if (!targeted)
+	{
+		// Nothing to do here, just keep copying
+		if (!tag.self_closing)
+			push(std::move(element));
+		return;
+	}
+
+	changed = true;
+	flush(start);
+	copied = end;
+
+	for (const tweak_op* op : insert_before)
+		output += op->value;
+
+	if (removed)
+	{
+		if (replacement)
+			output += replacement->value;
+
+		if (tag.self_closing)
+		{
+			for (const tweak_op* op : element.insert_after)
+				output += op->value;
+			return;
+		}
+
+		element.skipping = true;
+		element.active.clear();
+		skip_depth = 1;
+		push(std::move(element));
+		return;
+	}
+
+	// If we're adding children to a self-closing tag, it has to be expanded out
+	bool expand = tag.self_closing && (!insert_first.empty() || !element.insert_last.empty());
+	write_tag(tag, set_ops, tag.self_closing && !expand);
+
+	for (const tweak_op* op : insert_first)
+		output += op->value;
+
+	if (!tag.self_closing)
+	{
+		push(std::move(element));
+		return;
+	}
+
+	for (const tweak_op* op : element.insert_last)
+		output += op->value;
+	if (expand)
+	{
+		output += "</";
+		output.append(tag.name);
+		output += ">";
+	}
+	for (const tweak_op* op : element.insert_after)
+		output += op->value;
+}
+
+void stream_tweaker::handle_end_tag(size_t start)
+{
+	size_t p = start + 2;
+	string_view name = read_name(text, length, p);
+	while (p < length && is_space(text[p]))
+		p++;
+	if (p >= length || text[p] != '>')
+		fail("unterminated end tag </" + string(name) + ">");
+	size_t end = p + 1;
+	pos = end;
+
+	if (skip_depth > 1)
+	{
+		skip_depth--;
+		return;
+	}
+
+	if (stack.empty())
+		fail("unexpected end tag </" + string(name) + ">");
+
+	open_element& element = stack.back();
+	if (element.name != name)
+		fail("end tag </" + string(name) + "> doesn't match <" + string(element.name) + ">");
+
+	if (element.skipping)
+	{
+		// The whole element was replaced when we saw it's start tag
+		skip_depth = 0;
+		copied = end;
+	}
+	else if (!element.insert_last.empty())
+	{
+		flush(start);
+		for (const tweak_op* op : element.insert_last)
+			output += op->value;
+	}
+
+	if (!element.insert_after.empty())
+	{
+		flush(end);
+		for (const tweak_op* op : element.insert_after)
+			output += op->value;
+	}
+
+	if (element.is_live())
+		live_elements--;
+	stack.pop_back();
+}
+
+bool stream_tweaker::run()
+{
+	// Tweaked files are usually about the same size as the original
+	output.reserve(length + length / 8);
+
+	while (pos < length)
+	{
+		const char* next = (const char*)memchr(text + pos, '<', length - pos);
+		if (!next)
+			break;
+
+		size_t start = next - text;
+		pos = start;
+		string_view rest(text + start, length - start);
+
+		if (rest.substr(0, 4) == "<!--")
+			pos = find("-->", start + 4) + 3;
+		else if (rest.substr(0, 9) == "<![CDATA[")
+			pos = find("]]>", start + 9) + 3;
+		else if (rest.substr(0, 2) == "<?")
+			pos = find("?>", start + 2) + 2;
+		else if (rest.substr(0, 2) == "<!")
+			pos = find(">", start + 2) + 1;
+		else if (rest.substr(0, 2) == "</")
+			handle_end_tag(start);
+		else
+			handle_start_tag(start);
+
+		// Most tweaks only touch a small part of the file, so stop as soon as there's nothing left to do
+		if (!validate && !stack.empty() && live_elements == 0)
+			break;
+	}
+
+	if (!stack.empty() && (validate || live_elements))
+		fail("missing end tag for <" + string(stack.back().name) + ">");
+
+	if (!changed)
+	{
+		output.clear();
+		return false;
+	}
+
+	flush(length);
+	return true;
+}
+
+void declarative::check_fragment(const string& xml)
+{
+	string output;
+	std::vector<tweak_op> no_ops;
+	stream_tweaker checker(no_ops, xml.c_str(), xml.size(), output);
+	checker.validate = true;
+	checker.run();
+}
+
+bool declarative::apply(const std::vector<tweak_op>& ops, const char* text, size_t length, string& output)
+{
+	string result;
+	if (!stream_tweaker(ops, text, length, result).run())
+		return false;
+
+	output = std::move(result);
+	return true;
+}
+
+void declarative::add_tweak(blt::idfile file, tweak_op op)
+{
+	std::lock_guard<std::mutex> lock(tweaks_mutex);
+
+	std::shared_ptr<const std::vector<tweak_op>>& existing = registered_tweaks[file];
+	auto updated = existing ? std::make_shared<std::vector<tweak_op>>(*existing)
+	                        : std::make_shared<std::vector<tweak_op>>();
+	updated->push_back(std::move(op));
+	existing = updated;
+}
+
+bool declarative::apply_registered(blt::idfile file, const char* text, size_t length, string& output)
+{
+	std::shared_ptr<const std::vector<tweak_op>> for_file, for_ext;
+	{
+		std::lock_guard<std::mutex> lock(tweaks_mutex);
+		if (registered_tweaks.empty())
+			return false;
+
+		auto iter = registered_tweaks.find(file);
+		if (iter != registered_tweaks.end())
+			for_file = iter->second;
+
+		iter = registered_tweaks.find(blt::idfile(0, file.ext));
+		if (iter != registered_tweaks.end())
+			for_ext = iter->second;
+	}
+
+	if (!for_file && !for_ext)
+		return false;
+
+	// Run the extension-wide tweaks first, so ones for this specific file can override them
+	std::vector<tweak_op> combined;
+	const std::vector<tweak_op>* ops = for_file ? for_file.get() : for_ext.get();
+	if (for_file && for_ext)
+	{
+		combined = *for_ext;
+		combined.insert(combined.end(), for_file->begin(), for_file->end());
+		ops = &combined;
+	}
+
+	try
+	{
+		return apply(*ops, text, length, output);
+	}
+	catch (const TweakError& ex)
+	{
+		char name[40];
+		snprintf(name, sizeof(name), IDPF "." IDPF, file.name, file.ext);
+		PD2HOOK_LOG_ERROR(string("Could not apply XML tweaks to ") + name + ": " + ex.what());
+		return false;
+	}
+}
+
+/////////// Wren side ///////////
+
+static bool get_string_arg(WrenVM* vm, int slot, const char* what, string& out)
+{
+	if (wrenGetSlotType(vm, slot) != WREN_TYPE_STRING)
+	{
+		string message = string("XMLTweaks: ") + what + " must be a string";
+		wrenSetSlotString(vm, 0, message.c_str());
+		wrenAbortFiber(vm, 0);
+		return false;
+	}
+
+	out = wrenGetSlotString(vm, slot);
+	return true;
+}
+
+// All the functions start with name, ext, path - this reads them and the given extra string arguments, and
+// registers the op if that all worked.
+static void register_op(WrenVM* vm, tweak_op op, bool has_attribute, bool has_value)
+{
+	string name, ext, path;
+	blt::idstring name_hash = 0;
+	if (wrenGetSlotType(vm, 1) != WREN_TYPE_NULL)
+	{
+		if (!get_string_arg(vm, 1, "name", name))
+			return;
+		name_hash = pd2hook::tweaker::dbhook::parse_hash(name);
+	}
+	if (!get_string_arg(vm, 2, "ext", ext) || !get_string_arg(vm, 3, "path", path))
+		return;
+
+	int slot = 4;
+	if (has_attribute && !get_string_arg(vm, slot++, "attribute", op.attribute))
+		return;
+	if (has_value && !get_string_arg(vm, slot++, "value", op.value))
+		return;
+
+	try
+	{
+		op.path = parse_path(path);
+		if (op.kind != tweak_op::SET_ATTRIBUTE && op.kind != tweak_op::REMOVE)
+			check_fragment(op.value);
+	}
+	catch (const TweakError& ex)
+	{
+		string message = string("XMLTweaks: ") + ex.what();
+		wrenSetSlotString(vm, 0, message.c_str());
+		wrenAbortFiber(vm, 0);
+		return;
+	}
+
+	// The pooled VMs run the same registration code when they start, but the main VM's tweaks are used for everything
+	if (!pd2hook::wren::is_main_vm(vm))
+		return;
+
+	add_tweak(blt::idfile(name_hash, pd2hook::tweaker::dbhook::parse_hash(ext)), std::move(op));
+}
+
+static void wren_set_attribute(WrenVM* vm)
+{
+	tweak_op op;
+	op.kind = tweak_op::SET_ATTRIBUTE;
+	register_op(vm, std::move(op), true, true);
+}
+
+static void wren_remove(WrenVM* vm)
+{
+	tweak_op op;
+	op.kind = tweak_op::REMOVE;
+	register_op(vm, std::move(op), false, false);
+}
+
+static void wren_replace(WrenVM* vm)
+{
+	tweak_op op;
+	op.kind = tweak_op::REPLACE;
+	register_op(vm, std::move(op), false, true);
+}
+
+static void wren_insert(WrenVM* vm)
+{
+	string position;
+	if (!get_string_arg(vm, 5, "position", position))
+		return;
+
+	tweak_op op;
+	if (position == "before")
+		op.kind = tweak_op::INSERT_BEFORE;
+	else if (position == "after")
+		op.kind = tweak_op::INSERT_AFTER;
+	else if (position == "first")
+		op.kind = tweak_op::INSERT_FIRST;
+	else if (position == "last")
+		op.kind = tweak_op::INSERT_LAST;
+	else
+	{
+		string message = "XMLTweaks: invalid insert position '" + position + "'";
+		wrenSetSlotString(vm, 0, message.c_str());
+		wrenAbortFiber(vm, 0);
+		return;
+	}
+
+	register_op(vm, std::move(op), false, true);
+}
+
+WrenForeignMethodFn declarative::bind_declarative_method(WrenVM* vm, const char* module, const char* className,
+                                                         bool isStatic, const char* signature)
+{
+	if (strcmp(module, "base/native/XMLTweaks_001") != 0 || strcmp(className, "XMLTweaks") != 0 || !isStatic)
+		return nullptr;
+
+	if (strcmp(signature, "set_attribute(_,_,_,_,_)") == 0)
+		return &wren_set_attribute;
+	if (strcmp(signature, "remove(_,_,_)") == 0)
+		return &wren_remove;
+	if (strcmp(signature, "replace(_,_,_,_)") == 0)
+		return &wren_replace;
+	if (strcmp(signature, "insert(_,_,_,_,_)") == 0)
+		return &wren_insert;
+
+	return nullptr;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "platform.h"
+
+#include <wren.hpp>
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Simple XML tweaks that mods describe up-front rather than running a script for. These are applied in a single
+// pass over the text as it's loaded, copying it through to the output and only stopping to make changes at the
+// elements that are targeted, so there's no DOM and no Wren involved.
+namespace pd2hook::tweaker::declarative
+{
+	// One element in a path. The name may be '*' to match any element, and every attribute listed must match.
+	struct path_step
+	{
+		std::string name;
+		std::vector<std::pair<std::string, std::string>> attributes;
+	};
+
+	// A path from the root element down, in the form: root/child[attr=value]/grandchild[a='b'][c="d"]
+	// The first step always has to match the root element.
+	typedef std::vector<path_step> xml_path;
+
+	struct tweak_op
+	{
+		enum kind_t
+		{
+			SET_ATTRIBUTE,
+			REMOVE,
+			REPLACE,
+			INSERT_BEFORE,
+			INSERT_AFTER,
+			INSERT_FIRST, // As the first child
+			INSERT_LAST, // As the last child
+		};
+
+		kind_t kind = SET_ATTRIBUTE;
+		xml_path path;
+
+		std::string attribute; // For SET_ATTRIBUTE
+		std::string value; // The new attribute value, or the XML to insert or replace with
+	};
+
+	class TweakError : public std::runtime_error
+	{
+	public:
+		explicit TweakError(const std::string& message) : std::runtime_error(message) {}
+	};
+
+	// Throws TweakError if the path is invalid
+	xml_path parse_path(const std::string& path);
+
+	// Check that a fragment of XML (such as the value for a REPLACE op) is well-formed enough to insert,
+	// throwing TweakError if it isn't.
+	void check_fragment(const std::string& xml);
+
+	// Apply the operations to a document, in the order they were added when more than one applies to the same
+	// element. Returns false (and leaves output alone) if nothing was changed.
+	// Throws TweakError if the document isn't well-formed.
+	bool apply(const std::vector<tweak_op>& ops, const char* text, size_t length, std::string& output);
+
+	// Register an op to be run on a file whenever it's loaded. A name of zero applies it to every file with the
+	// given extension.
+	void add_tweak(blt::idfile file, tweak_op op);
+
+	// Apply whatever has been registered for a file, logging rather than throwing on errors
+	bool apply_registered(blt::idfile file, const char* text, size_t length, std::string& output);
+
+	WrenForeignMethodFn bind_declarative_method(WrenVM* vm, const char* module, const char* className, bool isStatic,
+	                                            const char* signature);
+} // namespace pd2hook::tweaker::declarative
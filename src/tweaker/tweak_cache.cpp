@@ -0,0 +1,411 @@
+#include "tweak_cache.h"
+
+#include "threading/scheduler.h"
+#include "util/util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+using namespace pd2hook::tweaker;
+using namespace pd2hook::tweaker::tweak_cache;
+
+// Change this if the native side of the tweaker changes in a way that would give different results, so files
+// from an older version don't get used.
+static const char disk_magic[8] = {'S', 'B', 'L', 'T', 'T', 'W', 'K', '1'};
+static const char* disk_path = "mods/saves/tweak_cache";
+
+// If the cache gets any bigger than this, throw out the least recently used results
+static const size_t memory_limit = 64 * 1024 * 1024;
+
+// Results on disk that haven't been used for this long are removed, as are the least recently used ones once the
+// directory gets bigger than the limit. The environment grows as modules load during a session, so results from
+// earlier and later in the last session are both still useful, and can't be told apart from those left behind by
+// a different set of mods.
+static const time_t disk_max_age = 30 * 24 * 60 * 60;
+static const uint64_t disk_limit = 256 * 1024 * 1024;
+
+// A result's modification time is used as the last time it was used, but only updated if it's older than this, so
+// loading a heist doesn't rewrite the metadata of every file in the cache
+static const time_t disk_touch_interval = 24 * 60 * 60;
+
+namespace
+{
+	struct key_hash
+	{
+		size_t operator()(const cache_key& key) const
+		{
+			// All the parts are hashes already, so they just need combining
+			return (size_t)(key.file.name ^ (key.file.ext * 31) ^ (key.input * 17) ^ key.environment);
+		}
+	};
+
+	struct entry
+	{
+		cache_key key;
+		std::shared_ptr<const std::string> text; // Null if the tweakers didn't change the file
+	};
+} // namespace
+
+static std::mutex cache_mutex;
+static uint64_t environment = 0;
+
+// Hashes of everything that's been noted, so seeing the same thing again (the same module being loaded into a
+// pooled VM, or a tweaker checking the same file on every run) doesn't change the environment.
+static std::unordered_set<uint64_t> noted;
+
+// Most recently used at the front
+static std::list<entry> entries;
+static std::unordered_map<cache_key, std::list<entry>::iterator, key_hash> entry_index;
+static size_t memory_used = 0;
+
+static std::atomic<bool> enabled{false};
+static std::atomic<bool> persistent{false};
+static std::atomic<bool> pruned{false};
+
+static std::atomic<uint64_t> stat_hits{0};
+static std::atomic<uint64_t> stat_disk_hits{0};
+static std::atomic<uint64_t> stat_uncacheable{0};
+
+// Wren runs on the thread that called into it, so these track what happened during the tweak on this thread
+static thread_local bool tweak_uncacheable = false;
+static thread_local bool tweak_environment_changed = false;
+
+static size_t entry_size(const entry& e)
+{
+	return sizeof(entry) + (e.text ? e.text->size() : 0);
+}
+
+// Must be called with cache_mutex held
+static void insert_entry(const cache_key& key, std::shared_ptr<const std::string> text)
+{
+	if (entry_index.count(key))
+		return;
+
+	entries.push_front(entry{key, std::move(text)});
+	entry_index[key] = entries.begin();
+	memory_used += entry_size(entries.front());
+
+	while (memory_used > memory_limit && entries.size() > 1)
+	{
+		memory_used -= entry_size(entries.back());
+		entry_index.erase(entries.back().key);
+		entries.pop_back();
+	}
+}
+
+static std::string disk_filename(const cache_key& key)
+{
+	char name[80];
+	snprintf(name, sizeof(name), IDPF "." IDPF "." IDPF "." IDPF, key.file.name, key.file.ext, key.input,
+	         key.environment);
+	return std::string(disk_path) + "/" + name;
+}
+
+static bool get_file_info(const std::string& path, time_t& modified, uint64_t& size)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_stat64(path.c_str(), &info) != 0)
+		return false;
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+#endif
+
+	modified = (time_t)info.st_mtime;
+	size = (uint64_t)info.st_size;
+	return true;
+}
+
+static void mark_used(const std::string& path)
+{
+	time_t modified;
+	uint64_t size;
+	if (!get_file_info(path, modified, size) || time(nullptr) - modified < disk_touch_interval)
+		return;
+
+#ifdef _WIN32
+	_utime(path.c_str(), nullptr);
+#else
+	utime(path.c_str(), nullptr);
+#endif
+}
+
+// Remove results that haven't been used in a while, so the directory doesn't grow forever
+static void prune_disk()
+{
+	if (!pd2hook::Util::DirectoryExists(disk_path))
+		return;
+
+	struct disk_file
+	{
+		time_t modified;
+		uint64_t size;
+		std::string path;
+	};
+	std::vector<disk_file> files;
+	uint64_t total_size = 0;
+
+	time_t now = time(nullptr);
+	for (const std::string& name : pd2hook::Util::GetDirectoryContents(disk_path))
+	{
+		if (name == "." || name == "..")
+			continue;
+
+		disk_file file;
+		file.path = std::string(disk_path) + "/" + name;
+		if (!get_file_info(file.path, file.modified, file.size))
+			continue;
+
+		if (now - file.modified > disk_max_age)
+		{
+			remove(file.path.c_str());
+			continue;
+		}
+
+		total_size += file.size;
+		files.push_back(std::move(file));
+	}
+
+	if (total_size <= disk_limit)
+		return;
+
+	// Oldest first
+	std::sort(files.begin(), files.end(),
+	          [](const disk_file& a, const disk_file& b) { return a.modified < b.modified; });
+
+	for (const disk_file& file : files)
+	{
+		if (total_size <= disk_limit)
+			break;
+
+		remove(file.path.c_str());
+		total_size -= file.size;
+	}
+}
+
+static bool load_disk(const cache_key& key, std::shared_ptr<const std::string>& output)
+{
+	std::string filename = disk_filename(key);
+	std::ifstream in(filename, std::ios::binary);
+	if (!in.good())
+		return false;
+
+	char header[sizeof(disk_magic) + 1];
+	if (!in.read(header, sizeof(header)) || memcmp(header, disk_magic, sizeof(disk_magic)) != 0)
+		return false;
+
+	bool changed = header[sizeof(disk_magic)] != 0;
+	if (changed)
+	{
+		std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		output = std::make_shared<const std::string>(std::move(text));
+	}
+	else
+	{
+		output = nullptr;
+	}
+
+	in.close();
+	mark_used(filename);
+	return true;
+}
+
+static void save_disk(const cache_key& key, const std::string* text)
+{
+	pd2hook::Util::EnsurePathWritable(std::string(disk_path) + "/");
+
+	// Write to a temporary file first, so if the game closes part-way through we don't leave a truncated result
+	std::string filename = disk_filename(key);
+	std::string temp_filename = filename + ".tmp";
+	{
+		std::ofstream out(temp_filename, std::ios::binary | std::ios::trunc);
+		if (!out.good())
+			return;
+
+		char changed = text != nullptr;
+		out.write(disk_magic, sizeof(disk_magic));
+		out.write(&changed, 1);
+		if (text)
+			out.write(text->data(), (std::streamsize)text->size());
+
+		if (!out.good())
+		{
+			out.close();
+			remove(temp_filename.c_str());
+			return;
+		}
+	}
+
+	if (rename(temp_filename.c_str(), filename.c_str()) != 0)
+		remove(temp_filename.c_str());
+}
+
+void tweak_cache::set_enabled(bool value)
+{
+	enabled = value;
+}
+
+void tweak_cache::set_persistent(bool value)
+{
+	persistent = value;
+}
+
+bool tweak_cache::is_enabled()
+{
+	return enabled;
+}
+
+void tweak_cache::note_environment(const void* data, size_t length)
+{
+	uint64_t hash = blt::idstring_hash(data, length, 0);
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	if (!noted.insert(hash).second)
+		return;
+
+	environment = blt::idstring_hash(&hash, sizeof(hash), environment);
+	tweak_environment_changed = true;
+}
+
+void tweak_cache::note_environment(const std::string& data)
+{
+	note_environment(data.data(), data.size());
+}
+
+void tweak_cache::mark_uncacheable()
+{
+	tweak_uncacheable = true;
+}
+
+cache_key tweak_cache::make_key(blt::idfile file, const char* text, size_t length)
+{
+	cache_key key;
+	key.file = file;
+	key.input = blt::idstring_hash(text, length, 0);
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	key.environment = environment;
+	return key;
+}
+
+bool tweak_cache::lookup(const cache_key& key, std::shared_ptr<const std::string>& output)
+{
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		auto iter = entry_index.find(key);
+		if (iter != entry_index.end())
+		{
+			// Move it to the front, so it's the last to be evicted
+			entries.splice(entries.begin(), entries, iter->second);
+			output = iter->second->text;
+			stat_hits++;
+			return true;
+		}
+	}
+
+	if (!persistent)
+		return false;
+
+	// This only needs doing once per session, and there's no need to hold up loading the game for it
+	if (!pruned.exchange(true))
+		pd2hook::threading::submit(pd2hook::threading::priority::background, prune_disk);
+
+	if (!load_disk(key, output))
+		return false;
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	insert_entry(key, output);
+	stat_hits++;
+	stat_disk_hits++;
+	return true;
+}
+
+void tweak_cache::begin_tweak()
+{
+	tweak_uncacheable = false;
+	tweak_environment_changed = false;
+}
+
+void tweak_cache::store(const cache_key& key, std::shared_ptr<const std::string> text)
+{
+	if (tweak_uncacheable)
+	{
+		stat_uncacheable++;
+		return;
+	}
+
+	// If the tweakers loaded a module or read a file while running, the result depends on that too, so it's
+	// stored under the new environment. Another process that hasn't loaded it yet would look this up under the
+	// old one though and never find it, so there's no point writing it to disk.
+	cache_key stored_key = key;
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		stored_key.environment = environment;
+		insert_entry(stored_key, text);
+	}
+
+	if (persistent && !tweak_environment_changed)
+		save_disk(stored_key, text.get());
+}
+
+cache_stats tweak_cache::get_stats(bool reset)
+{
+	cache_stats stats;
+	if (reset)
+	{
+		stats.hits = stat_hits.exchange(0);
+		stats.disk_hits = stat_disk_hits.exchange(0);
+		stats.uncacheable = stat_uncacheable.exchange(0);
+	}
+	else
+	{
+		stats.hits = stat_hits;
+		stats.disk_hits = stat_disk_hits;
+		stats.uncacheable = stat_uncacheable;
+	}
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	stats.memory_used = memory_used;
+	return stats;
+}
+
+static void wren_mark_uncacheable([[maybe_unused]] WrenVM* vm)
+{
+	mark_uncacheable();
+}
+
+WrenForeignMethodFn tweak_cache::bind_tweak_cache_method(WrenVM* vm, const char* module, const char* className,
+                                                         bool isStatic, const char* signature)
+{
+	if (strcmp(module, "base/native/TweakCache_001") == 0)
+	{
+		if (strcmp(className, "TweakCache") == 0)
+		{
+			if (isStatic && strcmp(signature, "mark_uncacheable()") == 0)
+			{
+				return &wren_mark_uncacheable;
+			}
+		}
+	}
+
+	return nullptr;
+}
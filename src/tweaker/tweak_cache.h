@@ -0,0 +1,68 @@
+#pragma once
+
+#include "platform.h"
+
+#include <wren.hpp>
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Caches the results of the XML tweaker, so loading the same file again (which happens on every heist load) doesn't
+// have to go through Wren. Results are keyed by the file, a hash of it's contents and a hash of the 'environment':
+// everything the tweakers could have based their decision on, which is all the Wren source that's been loaded, the
+// files read through IO, and the mod and tweak registrations.
+namespace pd2hook::tweaker::tweak_cache
+{
+	struct cache_key
+	{
+		blt::idfile file;
+		uint64_t input = 0; // Hash of the untweaked text
+		uint64_t environment = 0;
+
+		inline bool operator==(const cache_key& other) const
+		{
+			return file == other.file && input == other.input && environment == other.environment;
+		}
+	};
+
+	// Both are controlled by the basemod. Persistent results are stored in mods/saves/tweak_cache, and removed once
+	// they haven't been used for a month.
+	void set_enabled(bool enabled);
+	void set_persistent(bool persistent);
+	bool is_enabled();
+
+	// Mix something the tweakers have seen into the environment hash
+	void note_environment(const void* data, size_t length);
+	void note_environment(const std::string& data);
+
+	// Stop the tweak currently running on this thread from being cached. This is for tweakers that depend on
+	// something other than the environment, such as the game state through the Lua interface.
+	void mark_uncacheable();
+
+	cache_key make_key(blt::idfile file, const char* text, size_t length);
+
+	// Returns true if the file is in the cache. If the tweakers changed it, output is set to the tweaked text,
+	// otherwise it's set to null and the original text should be used as-is.
+	bool lookup(const cache_key& key, std::shared_ptr<const std::string>& output);
+
+	// Call on the thread that's about to run the tweakers, before running them
+	void begin_tweak();
+
+	// Record the result of a tweak, where a null output means nothing changed. The string is shared with the
+	// cache rather than copied, so it mustn't be modified afterwards.
+	void store(const cache_key& key, std::shared_ptr<const std::string> output);
+
+	struct cache_stats
+	{
+		uint64_t hits = 0;
+		uint64_t disk_hits = 0; // Included in hits
+		uint64_t uncacheable = 0;
+		size_t memory_used = 0;
+	};
+	cache_stats get_stats(bool reset);
+
+	WrenForeignMethodFn bind_tweak_cache_method(WrenVM* vm, const char* module, const char* className, bool isStatic,
+	                                            const char* signature);
+} // namespace pd2hook::tweaker::tweak_cache
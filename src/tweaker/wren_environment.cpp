@@ -3,6 +3,7 @@
 //
 
 #include "wren_environment.h"
+#include "tweak_cache.h"
 
 #include <assert.h>
 #include <cstdio>
@@ -99,6 +100,9 @@ void is_vr(WrenVM* vm)
 	is_vr = processPathString.rfind("_vr.exe") == processPathString.length() - 7;
 #endif
 
+	// Tweakers might do something different in VR, so don't mix up their results in the tweak cache
+	pd2hook::tweaker::tweak_cache::note_environment(is_vr ? "vr" : "non-vr");
+
 	wrenSetSlotBool(vm, 0, is_vr);
 }
 
@@ -0,0 +1,186 @@
+#include "wren_heap.h"
+#include "wrenloader.h"
+
+#include "util/util.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+
+// Hack to see when the GC runs
+extern "C"
+{
+#include "../../lib/wren/src/vm/wren_vm.h"
+}
+
+using namespace pd2hook::tweaker;
+using namespace pd2hook::tweaker::wren_heap;
+using std::chrono::steady_clock;
+
+static const char* config_filename = "mods/saves/wren_heap.txt";
+
+// Every block starts with it's size, since Wren doesn't pass the old size in. This is 16 bytes rather than 8 so
+// the memory Wren gets is still aligned the same way malloc would align it.
+static const size_t header_size = 16;
+
+static std::atomic<size_t> live_bytes{0};
+static std::atomic<size_t> peak_bytes{0};
+static std::atomic<uint64_t> stat_allocations{0};
+static std::atomic<uint64_t> stat_frees{0};
+static std::atomic<uint64_t> stat_collections{0};
+static std::atomic<uint64_t> stat_gc_time_us{0};
+static std::atomic<uint64_t> stat_max_gc_pause_us{0};
+
+template <typename T>
+static void update_max(std::atomic<T>& value, T candidate)
+{
+	T current = value;
+	while (candidate > current && !value.compare_exchange_weak(current, candidate))
+	{
+	}
+}
+
+// Check if a collection has finished since the last time the allocator was called
+static void check_collection(vm_heap& heap)
+{
+	if (!heap.vm || heap.vm->nextGC == heap.last_next_gc)
+		return;
+
+	heap.last_next_gc = heap.vm->nextGC;
+	stat_collections++;
+
+	if (heap.freeing)
+	{
+		uint64_t pause =
+		    std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - heap.first_free).count();
+		stat_gc_time_us += pause;
+		update_max<uint64_t>(stat_max_gc_pause_us, pause);
+	}
+}
+
+static void* reallocate(void* memory, size_t new_size, void* user_data)
+{
+	vm_heap& heap = ((pd2hook::wren::vm_state*)user_data)->heap;
+	check_collection(heap);
+
+	char* block = memory ? (char*)memory - header_size : nullptr;
+	size_t old_size = block ? *(size_t*)block : 0;
+
+	if (new_size == 0)
+	{
+		if (!block)
+			return nullptr;
+
+		if (!heap.freeing)
+		{
+			heap.freeing = true;
+			heap.first_free = steady_clock::now();
+		}
+
+		live_bytes -= old_size;
+		stat_frees++;
+		free(block);
+		return nullptr;
+	}
+
+	heap.freeing = false;
+
+	block = (char*)realloc(block, new_size + header_size);
+	if (!block)
+		return nullptr;
+
+	*(size_t*)block = new_size;
+	size_t live = live_bytes += new_size - old_size;
+	update_max<size_t>(peak_bytes, live);
+	stat_allocations++;
+
+	return block + header_size;
+}
+
+// Read the heap settings, which are only loaded once since every VM uses the same ones
+static void load_config(WrenConfiguration& config)
+{
+	static std::once_flag loaded;
+	static size_t initial_heap_size = 0;
+	static size_t min_heap_size = 0;
+	static int heap_growth_percent = 0;
+
+	std::call_once(loaded, []() {
+		std::ifstream in(config_filename);
+		if (!in.good())
+			return;
+
+		std::string line;
+		while (std::getline(in, line))
+		{
+			size_t equals = line.find('=');
+			if (line.empty() || line[0] == '#' || equals == std::string::npos)
+				continue;
+
+			std::string key = line.substr(0, equals);
+			unsigned long long value = strtoull(line.c_str() + equals + 1, nullptr, 10);
+
+			if (key == "initial_heap_size")
+				initial_heap_size = (size_t)value;
+			else if (key == "min_heap_size")
+				min_heap_size = (size_t)value;
+			else if (key == "heap_growth_percent")
+				heap_growth_percent = (int)value;
+			else
+				PD2HOOK_LOG_WARN("Unknown Wren heap setting '" + key + "' in " + config_filename);
+		}
+
+		PD2HOOK_LOG_LOG("Wren heap settings: initial " + std::to_string(initial_heap_size) + ", minimum " +
+		                std::to_string(min_heap_size) + ", growth " + std::to_string(heap_growth_percent) +
+		                "% (0 means the default)");
+	});
+
+	if (initial_heap_size)
+		config.initialHeapSize = initial_heap_size;
+	if (min_heap_size)
+		config.minHeapSize = min_heap_size;
+	if (heap_growth_percent)
+		config.heapGrowthPercent = heap_growth_percent;
+}
+
+void wren_heap::configure(WrenConfiguration& config)
+{
+	config.reallocateFn = &reallocate;
+	load_config(config);
+}
+
+void wren_heap::attach(vm_heap& heap, WrenVM* vm)
+{
+	heap.vm = vm;
+	heap.last_next_gc = vm ? vm->nextGC : 0;
+	heap.freeing = false;
+}
+
+heap_stats wren_heap::get_stats(bool reset)
+{
+	heap_stats stats;
+	stats.live_bytes = live_bytes;
+
+	if (reset)
+	{
+		stats.peak_bytes = peak_bytes.exchange(stats.live_bytes);
+		stats.allocations = stat_allocations.exchange(0);
+		stats.frees = stat_frees.exchange(0);
+		stats.collections = stat_collections.exchange(0);
+		stats.gc_time_us = stat_gc_time_us.exchange(0);
+		stats.max_gc_pause_us = stat_max_gc_pause_us.exchange(0);
+	}
+	else
+	{
+		stats.peak_bytes = peak_bytes;
+		stats.allocations = stat_allocations;
+		stats.frees = stat_frees;
+		stats.collections = stat_collections;
+		stats.gc_time_us = stat_gc_time_us;
+		stats.max_gc_pause_us = stat_max_gc_pause_us;
+	}
+
+	return stats;
+}
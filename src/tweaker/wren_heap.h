@@ -0,0 +1,54 @@
+#pragma once
+
+#include <wren.hpp>
+
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory accounting for the Wren VMs. Every allocation Wren makes goes through reallocate, which keeps track of how
+// much is live and how often the garbage collector runs. The heap settings Wren is started with can be changed in
+// mods/saves/wren_heap.txt, with lines of the form:
+//
+//   initial_heap_size=10485760
+//   min_heap_size=1048576
+//   heap_growth_percent=50
+//
+// Any that are missing keep Wren's defaults.
+namespace pd2hook::tweaker::wren_heap
+{
+	// What's tracked for each VM, which is kept in it's vm_state
+	struct vm_heap
+	{
+		WrenVM* vm = nullptr; // Null while the VM is being created or freed
+
+		// Wren sets a new GC threshold at the end of every collection, so a change means one happened
+		size_t last_next_gc = 0;
+
+		// The first free since the last allocation, which is roughly when the sweep of a collection started
+		bool freeing = false;
+		std::chrono::steady_clock::time_point first_free;
+	};
+
+	// Set up the allocator and heap sizes for a new VM. The user data must be the VM's vm_state.
+	void configure(WrenConfiguration& config);
+
+	// Call once the VM has been created, and again with null before it's freed
+	void attach(vm_heap& heap, WrenVM* vm);
+
+	struct heap_stats
+	{
+		size_t live_bytes = 0; // Across all the VMs
+		size_t peak_bytes = 0;
+		uint64_t allocations = 0;
+		uint64_t frees = 0;
+		uint64_t collections = 0;
+
+		// These only cover the sweep, since there's no way to see when Wren starts marking
+		uint64_t gc_time_us = 0;
+		uint64_t max_gc_pause_us = 0;
+	};
+
+	// Resetting clears the counters, and sets the peak back to what's currently live
+	heap_stats get_stats(bool reset);
+} // namespace pd2hook::tweaker::wren_heap
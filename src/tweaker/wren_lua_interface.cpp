@@ -10,6 +10,7 @@
 #include <mutex>
 #include <string.h>
 
+#include "tweak_cache.h"
 #include "wrenloader.h"
 
 // Hacky, see find_wren_caller
@@ -46,6 +47,13 @@ static void wren_register_object(WrenVM* vm)
 	std::string mod = find_wren_caller(vm);
 	std::string full_name = mod + "/" + name;
 
+	// Lua only ever talks to the main VM
+	if (!pd2hook::wren::is_main_vm(vm))
+	{
+		wrenSetSlotNull(vm, 0);
+		return;
+	}
+
 	std::lock_guard lock(wren_exposed_objects_mutex);
 	if (wren_exposed_objects.count(full_name))
 	{
@@ -62,6 +70,14 @@ static void wren_register_object(WrenVM* vm)
 	}
 }
 
+void pd2hook::tweaker::lua_io::release_wren_handles(WrenVM* vm)
+{
+	std::lock_guard lock(wren_exposed_objects_mutex);
+	for (const auto& pair : wren_exposed_objects)
+		wrenReleaseHandle(vm, pair.second);
+	wren_exposed_objects.clear();
+}
+
 WrenForeignMethodFn pd2hook::tweaker::lua_io::bind_wren_lua_method(WrenVM* vm, const char* module,
                                                                    const char* class_name, bool is_static,
                                                                    const char* signature)
@@ -204,7 +220,10 @@ static int wren_lua_invoke(lua_State* L)
 		if (!vm)
 			luaL_error(L, "Wren runtime unavailable - check for Wren-related errors in the log");
 
-		WrenHandle* res = wrenMakeCallHandle(vm, func_name.c_str());
+		WrenHandle* res = pd2hook::wren::get_call_handle(func_name);
+
+		// Lua can change what the XML tweakers do through this, so the call is part of the tweak cache's environment
+		std::string call_record = full_name + "." + func_name;
 
 		wrenEnsureSlots(vm, 1 + arg_count);
 		wrenSetSlotHandle(vm, 0, handle);
@@ -215,9 +234,11 @@ static int wren_lua_invoke(lua_State* L)
 			{
 			case LUA_TNUMBER:
 				wrenSetSlotDouble(vm, i + 1, lua_tonumber(L, lua_idx));
+				call_record += "\x01" + std::to_string(lua_tonumber(L, lua_idx));
 				break;
 			case LUA_TSTRING:
 				wrenSetSlotString(vm, i + 1, lua_tostring(L, lua_idx));
+				call_record += std::string("\x02") + lua_tostring(L, lua_idx);
 				break;
 			default:
 				snprintf(run_err_str, sizeof(run_err_str) - 1, "Bad arg %d: invalid type %s", i + 1,
@@ -227,6 +248,8 @@ static int wren_lua_invoke(lua_State* L)
 			}
 		}
 
+		pd2hook::tweaker::tweak_cache::note_environment(call_record);
+
 		if (wrenCall(vm, res) != WREN_RESULT_SUCCESS)
 		{
 			snprintf(run_err_str, sizeof(run_err_str) - 1, "Wren error occurred during invocation");
@@ -238,8 +261,7 @@ static int wren_lua_invoke(lua_State* L)
 			push_wren_to_lua(vm, 0, L, true);
 		}
 
-	done:
-		wrenReleaseHandle(vm, res);
+	done:;
 	}
 
 	if (!run_success)
@@ -14,6 +14,9 @@ namespace pd2hook::tweaker::lua_io
 #ifdef wren_h
 	WrenForeignMethodFn bind_wren_lua_method(WrenVM* vm, const char* module, const char* class_name, bool is_static,
 	                                         const char* signature);
+
+	// Release the registered objects, as the VM is about to be freed
+	void release_wren_handles(WrenVM* vm);
 #endif
 
 } // namespace pd2hook::tweaker::lua_io
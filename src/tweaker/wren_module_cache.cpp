@@ -0,0 +1,352 @@
+#include "wren_module_cache.h"
+
+#include "platform.h"
+#include "util/util.h"
+
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace pd2hook::tweaker;
+using namespace pd2hook::tweaker::module_cache;
+
+// Change this if the layout of the file changes
+static const char disk_magic[8] = {'S', 'B', 'L', 'T', 'W', 'M', 'C', '1'};
+static const char* disk_filename = "mods/saves/wren_module_cache";
+
+namespace
+{
+	struct entry
+	{
+		const char* text = nullptr;
+		size_t length = 0;
+		uint64_t hash = 0;
+
+		// What the file looked like when the text was read from it
+		uint64_t file_size = 0;
+		int64_t file_time = 0;
+	};
+
+	// Each entry in the file has this header, followed by the path, the text and a null terminator
+	struct disk_entry
+	{
+		uint32_t path_length;
+		uint32_t text_length;
+		uint64_t file_size;
+		int64_t file_time;
+		uint64_t hash;
+	};
+
+	struct mapped_file
+	{
+		const char* data = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+	};
+} // namespace
+
+static std::mutex cache_mutex;
+static bool loaded = false;
+static bool dirty = false;
+
+// The file from the last session, and what's in it
+static mapped_file mapping;
+static std::unordered_map<std::string, entry> disk_entries;
+
+// Everything loaded this session, pointing into the mapping or into the storage below
+static std::unordered_map<std::string, entry> used_entries;
+
+// Text that had to be read from the files (a list, so it doesn't move), and the last cache file written
+static std::list<std::string> read_sources;
+static std::string written;
+
+static std::atomic<uint64_t> stat_hits{0};
+static std::atomic<uint64_t> stat_reads{0};
+
+// Get the size and modification time of a file, returning false if it doesn't exist
+static bool get_file_stamp(const std::string& path, uint64_t& size, int64_t& time)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+		return false;
+	if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		return false;
+
+	size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	time = (int64_t)(((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+	return true;
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+		return false;
+
+	size = (uint64_t)info.st_size;
+	time = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+	return true;
+#endif
+}
+
+static bool map_file(const char* path, mapped_file& file)
+{
+#ifdef _WIN32
+	file.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file.file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file.file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file.file);
+		file = mapped_file();
+		return false;
+	}
+
+	file.mapping = CreateFileMappingA(file.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (file.mapping)
+		file.data = (const char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (!file.data)
+	{
+		if (file.mapping)
+			CloseHandle(file.mapping);
+		CloseHandle(file.file);
+		file = mapped_file();
+		return false;
+	}
+
+	file.length = (size_t)size.QuadPart;
+	return true;
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	file.data = (const char*)data;
+	file.length = info.st_size;
+	return true;
+#endif
+}
+
+static void unmap_file(mapped_file& file)
+{
+	if (!file.data)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle(file.mapping);
+	CloseHandle(file.file);
+#else
+	munmap((void*)file.data, file.length);
+#endif
+
+	file = mapped_file();
+}
+
+// Read the index of a cache file, pointing the entries into it. Anything that doesn't look right means the whole
+// file is ignored, as it'll be rewritten anyway.
+static bool parse_cache(const char* data, size_t length, std::unordered_map<std::string, entry>& entries)
+{
+	if (length < sizeof(disk_magic) || memcmp(data, disk_magic, sizeof(disk_magic)) != 0)
+		return false;
+
+	size_t pos = sizeof(disk_magic);
+	while (pos < length)
+	{
+		disk_entry header;
+		if (length - pos < sizeof(header))
+			return false;
+		memcpy(&header, data + pos, sizeof(header));
+		pos += sizeof(header);
+
+		size_t needed = (size_t)header.path_length + header.text_length + 1;
+		if (length - pos < needed || data[pos + header.path_length + header.text_length] != '\0')
+			return false;
+
+		entry e;
+		e.text = data + pos + header.path_length;
+		e.length = header.text_length;
+		e.hash = header.hash;
+		e.file_size = header.file_size;
+		e.file_time = header.file_time;
+		entries[std::string(data + pos, header.path_length)] = e;
+
+		pos += needed;
+	}
+
+	return true;
+}
+
+// Must be called with cache_mutex held
+static void load_cache_file()
+{
+	loaded = true;
+
+	if (!map_file(disk_filename, mapping))
+		return;
+
+	if (!parse_cache(mapping.data, mapping.length, disk_entries))
+	{
+		PD2HOOK_LOG_WARN("Ignoring invalid Wren module cache");
+		disk_entries.clear();
+		unmap_file(mapping);
+	}
+}
+
+bool module_cache::load(const std::string& path, module_source& source)
+{
+	uint64_t size;
+	int64_t time;
+	if (!get_file_stamp(path, size, time))
+		return false;
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	if (!loaded)
+		load_cache_file();
+
+	// Every VM loads the same modules, so after the first one they're all here
+	auto iter = used_entries.find(path);
+	bool read = false;
+	if (iter == used_entries.end() || iter->second.file_size != size || iter->second.file_time != time)
+	{
+		auto disk = disk_entries.find(path);
+		if (disk != disk_entries.end() && disk->second.file_size == size && disk->second.file_time == time)
+		{
+			iter = used_entries.insert_or_assign(path, disk->second).first;
+		}
+		else
+		{
+			std::ifstream handle(path);
+			if (!handle.good())
+				return false;
+
+			read_sources.emplace_back((std::istreambuf_iterator<char>(handle)), std::istreambuf_iterator<char>());
+			const std::string& text = read_sources.back();
+
+			entry e;
+			e.text = text.c_str();
+			e.length = text.size();
+			e.hash = blt::idstring_hash(text.data(), text.size(), 0);
+			e.file_size = size;
+			e.file_time = time;
+			iter = used_entries.insert_or_assign(path, e).first;
+
+			read = true;
+			dirty = true;
+		}
+	}
+
+	(read ? stat_reads : stat_hits)++;
+
+	source.text = iter->second.text;
+	source.length = iter->second.length;
+	source.hash = iter->second.hash;
+	return true;
+}
+
+static bool replace_file(const std::string& from, const char* to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from.c_str(), to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to) == 0;
+#endif
+}
+
+void module_cache::save()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	if (!dirty)
+		return;
+	dirty = false;
+
+	// Build the new file in memory, which then becomes where the sources are kept so the old file can be replaced.
+	// Only what was used this session goes in, so mods that have been removed drop out of it.
+	std::string output(disk_magic, sizeof(disk_magic));
+	for (const auto& pair : used_entries)
+	{
+		const entry& e = pair.second;
+
+		disk_entry header;
+		header.path_length = (uint32_t)pair.first.size();
+		header.text_length = (uint32_t)e.length;
+		header.file_size = e.file_size;
+		header.file_time = e.file_time;
+		header.hash = e.hash;
+
+		output.append((const char*)&header, sizeof(header));
+		output.append(pair.first);
+		output.append(e.text, e.length);
+		output.push_back('\0');
+	}
+
+	written = std::move(output);
+	disk_entries.clear();
+	parse_cache(written.data(), written.size(), disk_entries);
+
+	used_entries = disk_entries;
+	read_sources.clear();
+	unmap_file(mapping);
+
+	pd2hook::Util::EnsurePathWritable(disk_filename);
+
+	// Write to a temporary file first, so if the game closes part-way through we don't leave a truncated cache
+	std::string temp_filename = std::string(disk_filename) + ".tmp";
+	{
+		std::ofstream out(temp_filename, std::ios::binary | std::ios::trunc);
+		if (!out.good())
+			return;
+
+		out.write(written.data(), (std::streamsize)written.size());
+
+		if (!out.good())
+		{
+			out.close();
+			remove(temp_filename.c_str());
+			return;
+		}
+	}
+
+	if (!replace_file(temp_filename, disk_filename))
+		remove(temp_filename.c_str());
+}
+
+cache_stats module_cache::get_stats()
+{
+	cache_stats stats;
+	stats.hits = stat_hits;
+	stats.reads = stat_reads;
+	return stats;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Keeps the source of every Wren module the mods load, so it's read from the disk once per session rather than once
+// per VM, and so the next launch doesn't have to open each file at all. Everything is stored in a single file,
+// mods/saves/wren_module_cache, which is mapped into memory and compiled from directly. Each entry is checked against
+// the size and modification time of the file it came from before it's used.
+//
+// Wren can only compile from source, so this caches the text rather than anything compiled.
+namespace pd2hook::tweaker::module_cache
+{
+	struct module_source
+	{
+		const char* text = nullptr; // Null-terminated, valid until the VMs are closed
+		size_t length = 0;
+		uint64_t hash = 0; // Of the text, so it can be identified without hashing it again
+	};
+
+	// Load a Wren file, returning false if it doesn't exist
+	bool load(const std::string& path, module_source& source);
+
+	// Write the cache back out if anything had to be read from the files. This must only be called when no VM is
+	// in the middle of loading a module, as it may move the sources.
+	void save();
+
+	struct cache_stats
+	{
+		uint64_t hits = 0; // Modules that were already in memory or in the cache file
+		uint64_t reads = 0; // Modules that had to be read from their file
+	};
+	cache_stats get_stats();
+} // namespace pd2hook::tweaker::module_cache
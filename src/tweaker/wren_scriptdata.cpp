@@ -0,0 +1,406 @@
+//
+// Wren bindings for patching scriptdata files, see ScriptData_001.wren
+//
+
+#include "wren_scriptdata.h"
+
+#include <scriptdata/ScriptData.h>
+#include <scriptdata/ScriptDataPatch.h>
+#include <util/util.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using pd2hook::scriptdata::patch_op;
+using pd2hook::scriptdata::patch_value;
+
+static const char* MODULE = "base/native/ScriptData_001";
+
+class ScriptDataValue
+{
+  public:
+	// Magic cookie to make sure this is the correct class
+	uint64_t magic;
+	static const uint64_t MAGIC_COOKIE = 0x7d1a4c0be54f2a93; // random value
+
+	// Note: use a unique_ptr since our destructor won't be called
+	std::unique_ptr<patch_value> value;
+
+	static void vector(WrenVM* vm);
+	static void quaternion(WrenVM* vm);
+	static void idstring(WrenVM* vm);
+	static void table(WrenVM* vm);
+
+	static void finalise(void* this_data);
+
+  private:
+	static patch_value& create(WrenVM* vm);
+};
+
+static void abort_with(WrenVM* vm, const std::string& message)
+{
+	wrenSetSlotString(vm, 0, message.c_str());
+	wrenAbortFiber(vm, 0);
+}
+
+// Read the value in the given slot. Lists use the slots after it, which the caller must make sure exist.
+static bool read_value(WrenVM* vm, int slot, patch_value& out, std::string& error, int depth = 0)
+{
+	if (depth > 64)
+	{
+		error = "value nested too deeply (does a list contain itself?)";
+		return false;
+	}
+
+	switch (wrenGetSlotType(vm, slot))
+	{
+	case WREN_TYPE_NULL:
+		out.type = patch_value::NIL;
+		return true;
+	case WREN_TYPE_BOOL:
+		out.type = patch_value::BOOL;
+		out.boolean = wrenGetSlotBool(vm, slot);
+		return true;
+	case WREN_TYPE_NUM:
+		out.type = patch_value::NUMBER;
+		out.numbers[0] = (float)wrenGetSlotDouble(vm, slot);
+		return true;
+	case WREN_TYPE_STRING:
+	{
+		int len = 0;
+		const char* str = wrenGetSlotBytes(vm, slot, &len);
+		out.type = patch_value::STRING;
+		out.string.assign(str, len);
+		return true;
+	}
+	case WREN_TYPE_LIST:
+	{
+		// Lists are written out as arrays
+		int count = wrenGetListCount(vm, slot);
+		wrenEnsureSlots(vm, slot + 2);
+
+		out.type = patch_value::TABLE;
+		out.items.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			out.items[i].first.type = patch_value::NUMBER;
+			out.items[i].first.numbers[0] = (float)(i + 1);
+
+			wrenGetListElement(vm, slot, i, slot + 1);
+			if (!read_value(vm, slot + 1, out.items[i].second, error, depth + 1))
+				return false;
+		}
+		return true;
+	}
+	case WREN_TYPE_FOREIGN:
+	{
+		auto* value = (ScriptDataValue*)wrenGetSlotForeign(vm, slot);
+		if (!value || value->magic != ScriptDataValue::MAGIC_COOKIE || !value->value)
+			break;
+
+		out = *value->value;
+		return true;
+	}
+	default:
+		break;
+	}
+
+	error = "unsupported value type - only null, booleans, numbers, strings, lists and ScriptDataValues can be used";
+	return false;
+}
+
+static bool read_path(WrenVM* vm, int slot, std::vector<patch_value>& path, std::string& error)
+{
+	if (wrenGetSlotType(vm, slot) != WREN_TYPE_LIST)
+	{
+		path.resize(1);
+		return read_value(vm, slot, path[0], error);
+	}
+
+	int count = wrenGetListCount(vm, slot);
+	wrenEnsureSlots(vm, slot + 2);
+	path.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		wrenGetListElement(vm, slot, i, slot + 1);
+		if (!read_value(vm, slot + 1, path[i], error))
+			return false;
+	}
+	return true;
+}
+
+static void patch(WrenVM* vm)
+{
+	if (wrenGetSlotType(vm, 1) != WREN_TYPE_STRING || wrenGetSlotType(vm, 2) != WREN_TYPE_LIST)
+	{
+		abort_with(vm, "ScriptData.patch: arguments must be a String and a List");
+		return;
+	}
+
+	int len = 0;
+	const char* data = wrenGetSlotBytes(vm, 1, &len);
+
+	// Slot 3 holds each operation, and slot 4 onwards is used to read the parts of it
+	wrenEnsureSlots(vm, 6);
+	int count = wrenGetListCount(vm, 2);
+	std::vector<patch_op> ops(count);
+	for (int i = 0; i < count; i++)
+	{
+		patch_op& op = ops[i];
+		std::string prefix = "ScriptData.patch: operation " + std::to_string(i + 1) + ": ";
+
+		wrenGetListElement(vm, 2, i, 3);
+		if (wrenGetSlotType(vm, 3) != WREN_TYPE_LIST || wrenGetListCount(vm, 3) < 2)
+		{
+			abort_with(vm, prefix + "must be a list of at least an operation and path");
+			return;
+		}
+		int parts = wrenGetListCount(vm, 3);
+
+		wrenGetListElement(vm, 3, 0, 4);
+		std::string name = wrenGetSlotType(vm, 4) == WREN_TYPE_STRING ? wrenGetSlotString(vm, 4) : "";
+		if (name == "set")
+			op.op = patch_op::SET;
+		else if (name == "remove")
+			op.op = patch_op::REMOVE;
+		else if (name == "insert")
+			op.op = patch_op::INSERT;
+		else
+		{
+			abort_with(vm, prefix + "unknown operation '" + name + "'");
+			return;
+		}
+
+		std::string error;
+		wrenGetListElement(vm, 3, 1, 4);
+		bool ok = read_path(vm, 4, op.path, error);
+
+		if (ok && parts >= 3)
+		{
+			wrenGetListElement(vm, 3, 2, 4);
+			ok = read_value(vm, 4, op.value, error);
+		}
+
+		if (ok && parts >= 4)
+		{
+			wrenGetListElement(vm, 3, 3, 4);
+			if (wrenGetSlotType(vm, 4) == WREN_TYPE_NUM)
+				op.position = (size_t)wrenGetSlotDouble(vm, 4);
+		}
+
+		if (!ok)
+		{
+			abort_with(vm, prefix + error);
+			return;
+		}
+	}
+
+	// The result is handed to the game, so write it in whatever format this version of the game uses
+#ifdef _WIN32
+	bool is32bit = true;
+#else
+	bool is32bit = false;
+#endif
+
+	std::string out;
+	std::string error;
+	try
+	{
+		pd2hook::scriptdata::ScriptData sd(len, (const uint8_t*)data);
+		pd2hook::scriptdata::apply_patch(sd, ops);
+		out = sd.GetRoot()->Serialise(is32bit);
+	}
+	catch (const std::runtime_error& ex)
+	{
+		error = ex.what();
+	}
+
+	if (!error.empty())
+	{
+		abort_with(vm, "ScriptData.patch: " + error);
+		return;
+	}
+
+	wrenSetSlotBytes(vm, 0, out.c_str(), out.size());
+}
+
+patch_value& ScriptDataValue::create(WrenVM* vm)
+{
+	wrenGetVariable(vm, MODULE, "ScriptDataValue", 0);
+	auto* obj = (ScriptDataValue*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(ScriptDataValue));
+	obj->magic = MAGIC_COOKIE;
+	obj->value = std::make_unique<patch_value>();
+	return *obj->value;
+}
+
+static bool read_numbers(WrenVM* vm, int count, float* out)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (wrenGetSlotType(vm, i + 1) != WREN_TYPE_NUM)
+		{
+			abort_with(vm, "ScriptDataValue: components must be numbers");
+			return false;
+		}
+		out[i] = (float)wrenGetSlotDouble(vm, i + 1);
+	}
+	return true;
+}
+
+void ScriptDataValue::vector(WrenVM* vm)
+{
+	float vals[3];
+	if (!read_numbers(vm, 3, vals))
+		return;
+
+	patch_value& value = create(vm);
+	value.type = patch_value::VECTOR;
+	memcpy(value.numbers, vals, sizeof(vals));
+}
+
+void ScriptDataValue::quaternion(WrenVM* vm)
+{
+	float vals[4];
+	if (!read_numbers(vm, 4, vals))
+		return;
+
+	patch_value& value = create(vm);
+	value.type = patch_value::QUATERNION;
+	memcpy(value.numbers, vals, sizeof(vals));
+}
+
+void ScriptDataValue::idstring(WrenVM* vm)
+{
+	if (wrenGetSlotType(vm, 1) != WREN_TYPE_STRING)
+	{
+		abort_with(vm, "ScriptDataValue.idstring: hash must be a String");
+		return;
+	}
+
+	std::string str = wrenGetSlotString(vm, 1);
+	blt::idstring hash;
+	if (str.size() == 17 && str[0] == '@')
+	{
+		char* end = nullptr;
+		hash = strtoull(str.c_str() + 1, &end, 16);
+		if (*end)
+		{
+			abort_with(vm, "ScriptDataValue.idstring: invalid hash " + str);
+			return;
+		}
+	}
+	else
+	{
+		hash = blt::idstring_hash(str);
+	}
+
+	patch_value& value = create(vm);
+	value.type = patch_value::IDSTRING;
+	value.idstring = hash;
+}
+
+void ScriptDataValue::table(WrenVM* vm)
+{
+	patch_value result;
+	result.type = patch_value::TABLE;
+
+	if (wrenGetSlotType(vm, 1) == WREN_TYPE_STRING)
+	{
+		result.has_meta = true;
+		result.meta = wrenGetSlotString(vm, 1);
+	}
+	else if (wrenGetSlotType(vm, 1) != WREN_TYPE_NULL)
+	{
+		abort_with(vm, "ScriptDataValue.table: meta must be a String or null");
+		return;
+	}
+
+	if (wrenGetSlotType(vm, 2) != WREN_TYPE_LIST)
+	{
+		abort_with(vm, "ScriptDataValue.table: contents must be a List");
+		return;
+	}
+
+	// Slot 3 holds each pair, slot 4 each key or value, and anything after that is for nested lists
+	wrenEnsureSlots(vm, 6);
+	int count = wrenGetListCount(vm, 2);
+	result.items.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		wrenGetListElement(vm, 2, i, 3);
+		if (wrenGetSlotType(vm, 3) != WREN_TYPE_LIST || wrenGetListCount(vm, 3) != 2)
+		{
+			abort_with(vm, "ScriptDataValue.table: contents must be [key, value] lists");
+			return;
+		}
+
+		std::string error;
+		wrenGetListElement(vm, 3, 0, 4);
+		bool ok = read_value(vm, 4, result.items[i].first, error);
+		if (ok)
+		{
+			wrenGetListElement(vm, 3, 1, 4);
+			ok = read_value(vm, 4, result.items[i].second, error);
+		}
+
+		if (!ok)
+		{
+			abort_with(vm, "ScriptDataValue.table: " + error);
+			return;
+		}
+	}
+
+	create(vm) = std::move(result);
+}
+
+void ScriptDataValue::finalise(void* this_data)
+{
+	auto* value = (ScriptDataValue*)this_data;
+	value->value.reset();
+}
+
+WrenForeignMethodFn pd2hook::tweaker::wren_scriptdata::bind_wren_scriptdata_method(WrenVM* vm, const char* module,
+                                                                                   const char* className, bool isStatic,
+                                                                                   const char* signature)
+{
+	if (strcmp(module, MODULE) != 0 || !isStatic)
+		return nullptr;
+
+	if (strcmp(className, "ScriptData") == 0)
+	{
+		if (strcmp(signature, "patch(_,_)") == 0)
+			return &patch;
+	}
+	else if (strcmp(className, "ScriptDataValue") == 0)
+	{
+		if (strcmp(signature, "vector(_,_,_)") == 0)
+			return &ScriptDataValue::vector;
+		else if (strcmp(signature, "quaternion(_,_,_,_)") == 0)
+			return &ScriptDataValue::quaternion;
+		else if (strcmp(signature, "idstring(_)") == 0)
+			return &ScriptDataValue::idstring;
+		else if (strcmp(signature, "table(_,_)") == 0)
+			return &ScriptDataValue::table;
+	}
+
+	return nullptr;
+}
+
+WrenForeignClassMethods pd2hook::tweaker::wren_scriptdata::bind_wren_scriptdata_class([[maybe_unused]] WrenVM* vm,
+                                                                                       const char* module,
+                                                                                       const char* class_name)
+{
+	if (!strcmp(module, MODULE) && !strcmp(class_name, "ScriptDataValue"))
+	{
+		// Values are only made through the static methods
+		WrenForeignClassMethods def;
+		def.allocate = [](WrenVM* vm) { abort(); };
+		def.finalize = &ScriptDataValue::finalise;
+		return def;
+	}
+	return {nullptr, nullptr};
+}
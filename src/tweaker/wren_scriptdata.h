@@ -0,0 +1,11 @@
+#pragma once
+
+#include <wren.hpp>
+
+namespace pd2hook::tweaker::wren_scriptdata
+{
+	WrenForeignMethodFn bind_wren_scriptdata_method(WrenVM* vm, const char* module, const char* className,
+	                                                bool isStatic, const char* signature);
+
+	WrenForeignClassMethods bind_wren_scriptdata_class(WrenVM* vm, const char* module, const char* class_name);
+} // namespace pd2hook::tweaker::wren_scriptdata
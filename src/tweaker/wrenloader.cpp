@@ -1,16 +1,25 @@
 #include "wrenloader.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <string_view>
 #include <vector>
 
 #include "db_hooks.h"
+#include "declarative_tweaks.h"
 #include "global.h"
 #include "plugins/plugins.h"
+#include "tweak_cache.h"
 #include "util/util.h"
 #include "wren_environment.h"
 #include "wren_lua_interface.h"
+#include "wren_module_cache.h"
 #include "wren_sblt_utils.h"
+#include "wren_scriptdata.h"
 #include "wrenxml.h"
 #include "xmltweaker_internal.h"
 
@@ -35,6 +44,9 @@ struct ModData
 };
 std::map<std::string, ModData> mod_metadata;
 
+// The pooled VMs load modules while the main VM might be registering mods
+static std::mutex mod_metadata_mutex;
+
 static void err([[maybe_unused]] WrenVM* vm, [[maybe_unused]] WrenErrorType type, const char* module, int line,
                 const char* message)
 {
@@ -60,6 +72,9 @@ void io_listDirectory(WrenVM* vm)
 	bool dir = wrenGetSlotBool(vm, 2);
 	vector<string> files = Util::GetDirectoryContents(filename, dir);
 
+	// Anything read through IO could affect what the XML tweakers do, since the basemod uses it to find mods
+	string listing = "listDirectory:" + filename;
+
 	wrenSetSlotNewList(vm, 0);
 
 	for (string const& file : files)
@@ -67,9 +82,12 @@ void io_listDirectory(WrenVM* vm)
 		if (file == "." || file == "..")
 			continue;
 
+		listing += '\0' + file;
 		wrenSetSlotString(vm, 1, file.c_str());
 		wrenInsertInList(vm, 0, -1, 1);
 	}
+
+	tweak_cache::note_environment(listing);
 }
 
 void io_info(WrenVM* vm)
@@ -77,6 +95,7 @@ void io_info(WrenVM* vm)
 	const char* path = wrenGetSlotString(vm, 1);
 
 	Util::FileType type = Util::GetFileType(path);
+	tweak_cache::note_environment("info:" + string(path) + '\0' + to_string(type));
 
 	if (type == Util::FileType_None)
 	{
@@ -104,6 +123,7 @@ void io_read(WrenVM* vm)
 	}
 
 	string contents = file_to_string(handle);
+	tweak_cache::note_environment("read:" + file + '\0' + contents);
 	wrenSetSlotString(vm, 0, contents.c_str());
 }
 
@@ -118,6 +138,10 @@ void io_idstring_hash(WrenVM* vm)
 
 static void io_load_plugin(WrenVM* vm)
 {
+	// The main VM has already loaded the same plugins
+	if (!wren::is_main_vm(vm))
+		return;
+
 	const char* plugin_filename = wrenGetSlotString(vm, 1);
 	try
 	{
@@ -141,9 +165,82 @@ static void io_has_native_module(WrenVM* vm)
 
 static void internal_set_tweaker_enabled(WrenVM* vm)
 {
+	if (!wren::is_main_vm(vm))
+		return;
+
 	pd2hook::tweaker::tweaker_enabled = wrenGetSlotBool(vm, 1);
 }
 
+static void internal_set_tweak_index_enabled(WrenVM* vm)
+{
+	if (!wren::is_main_vm(vm))
+		return;
+
+	pd2hook::tweaker::set_tweak_index_enabled(wrenGetSlotBool(vm, 1));
+}
+
+static void internal_register_tweak_file(WrenVM* vm)
+{
+	if (!wren::is_main_vm(vm))
+		return;
+
+	// A null name means every file with that extension
+	blt::idstring name = 0;
+	if (wrenGetSlotType(vm, 1) != WREN_TYPE_NULL)
+		name = dbhook::parse_hash(wrenGetSlotString(vm, 1));
+	blt::idstring ext = dbhook::parse_hash(wrenGetSlotString(vm, 2));
+
+	// The three-argument version says whether the tweak can run on a pooled VM
+	bool pool_safe = wrenGetSlotCount(vm) > 3 && wrenGetSlotBool(vm, 3);
+
+	pd2hook::tweaker::register_tweaked_file(blt::idfile(name, ext), pool_safe);
+}
+
+static void internal_set_tweak_cache_enabled(WrenVM* vm)
+{
+	if (!wren::is_main_vm(vm))
+		return;
+
+	tweak_cache::set_enabled(wrenGetSlotBool(vm, 1));
+}
+
+static void internal_set_tweak_cache_persistent(WrenVM* vm)
+{
+	if (!wren::is_main_vm(vm))
+		return;
+
+	tweak_cache::set_persistent(wrenGetSlotBool(vm, 1));
+}
+
+// Whether the tweakers are passed an XMLBuffer rather than a String
+static std::atomic<bool> use_buffer_view{false};
+
+// How many extra VMs may be started to run tweaks on, see lease_tweak_vm
+static const int max_pooled_vms = 8;
+static std::atomic<int> pool_size{0};
+
+static void internal_set_tweak_vm_pool_size(WrenVM* vm)
+{
+	if (!wren::is_main_vm(vm))
+		return;
+
+	int size = (int)wrenGetSlotDouble(vm, 1);
+	pool_size = std::max(0, std::min(size, max_pooled_vms));
+}
+
+static void internal_is_main_vm(WrenVM* vm)
+{
+	wrenSetSlotBool(vm, 0, wren::is_main_vm(vm));
+}
+
+static void internal_set_use_buffer_view(WrenVM* vm)
+{
+	if (!wren::is_main_vm(vm))
+		return;
+
+	use_buffer_view = wrenGetSlotBool(vm, 1);
+}
+
 static void internal_register_mod_v1(WrenVM* vm)
 {
 	int slotType;
@@ -168,10 +265,17 @@ static void internal_register_mod_v1(WrenVM* vm)
 		return;
 	}
 
+	// The pooled VMs register the same mods as the main one when they start
+	if (!wren::is_main_vm(vm))
+		return;
+
 	std::string name = wrenGetSlotString(vm, 1);
 	ModData data = {};
 	data.name = name;
 	data.scripts_root = wrenGetSlotString(vm, 2);
+	tweak_cache::note_environment("mod:" + name + '\0' + data.scripts_root);
+
+	std::lock_guard<std::mutex> lock(mod_metadata_mutex);
 	mod_metadata[name] = std::move(data); // Can't use data.name as the index value, the order is undefined
 }
 
@@ -181,6 +285,10 @@ static void internal_warn_bad_mod(WrenVM* vm)
 	std::string err = wrenGetSlotString(vm, 2);
 	std::string message = "Failed to load Wren mod file '" + file + "': '" + err + "'";
 
+	// If this happened on a pooled VM, it already happened on the main VM and the user has been told about it
+	if (!wren::is_main_vm(vm))
+		return;
+
 	// Always log, even on Windows, so a mod author can track it down if the user doesn't mention
 	// it in a bug report for whatever reason.
 	PD2HOOK_LOG_ERROR(message.c_str());
@@ -197,6 +305,10 @@ static WrenForeignClassMethods bindForeignClass(WrenVM* vm, const char* module,
 		return methods;
 
 	methods = dbhook::bind_dbhook_class(vm, module, class_name);
+	if (methods.allocate || methods.finalize)
+		return methods;
+
+	methods = wren_scriptdata::bind_wren_scriptdata_class(vm, module, class_name);
 
 	return methods;
 }
@@ -224,6 +336,19 @@ static WrenForeignMethodFn bindForeignMethod(WrenVM* vm, const char* module, con
 	if (util_method)
 		return util_method;
 
+	WrenForeignMethodFn sd_method =
+		wren_scriptdata::bind_wren_scriptdata_method(vm, module, className, isStatic, signature);
+	if (sd_method)
+		return sd_method;
+
+	WrenForeignMethodFn cache_method = tweak_cache::bind_tweak_cache_method(vm, module, className, isStatic, signature);
+	if (cache_method)
+		return cache_method;
+
+	WrenForeignMethodFn decl_method = declarative::bind_declarative_method(vm, module, className, isStatic, signature);
+	if (decl_method)
+		return decl_method;
+
 	if (strcmp(module, "base/native") == 0)
 	{
 		if (strcmp(className, "Logger") == 0)
@@ -279,6 +404,38 @@ static WrenForeignMethodFn bindForeignMethod(WrenVM* vm, const char* module, con
 			{
 				return &internal_register_mod_v1;
 			}
+			else if (isStatic && strcmp(signature, "tweak_index_enabled=(_)") == 0)
+			{
+				return &internal_set_tweak_index_enabled;
+			}
+			else if (isStatic && strcmp(signature, "register_tweak_file(_,_)") == 0)
+			{
+				return &internal_register_tweak_file;
+			}
+			else if (isStatic && strcmp(signature, "register_tweak_file(_,_,_)") == 0)
+			{
+				return &internal_register_tweak_file;
+			}
+			else if (isStatic && strcmp(signature, "tweak_cache_enabled=(_)") == 0)
+			{
+				return &internal_set_tweak_cache_enabled;
+			}
+			else if (isStatic && strcmp(signature, "tweak_cache_persistent=(_)") == 0)
+			{
+				return &internal_set_tweak_cache_persistent;
+			}
+			else if (isStatic && strcmp(signature, "use_buffer_view=(_)") == 0)
+			{
+				return &internal_set_use_buffer_view;
+			}
+			else if (isStatic && strcmp(signature, "tweak_vm_pool_size=(_)") == 0)
+			{
+				return &internal_set_tweak_vm_pool_size;
+			}
+			else if (isStatic && strcmp(signature, "is_main_vm") == 0)
+			{
+				return &internal_is_main_vm;
+			}
 		}
 	}
 	// Other modules...
@@ -411,6 +568,10 @@ static WrenLoadModuleResult getModulePath([[maybe_unused]] WrenVM* vm, const cha
 	lookup_builtin_wren_src(name_c, &builtin_string);
 	if (builtin_string)
 	{
+		// Every module that's loaded is part of the environment, so changing a tweaker's code (or updating
+		// SuperBLT, for the built-in ones) means it's results aren't reused
+		tweak_cache::note_environment("module:" + string(name_c) + '\0' + builtin_string);
+
 		WrenLoadModuleResult result{};
 		result.source = builtin_string;
 		return result;
@@ -422,27 +583,40 @@ static WrenLoadModuleResult getModulePath([[maybe_unused]] WrenVM* vm, const cha
 	string file = name.substr(name.find_first_of('/') + 1);
 
 	// Use the metadata to find where the Wren files are
-	const auto& meta_pair = mod_metadata.find(mod);
 	std::string scripts_root = "wren";
-	if (meta_pair != mod_metadata.end())
 	{
-		scripts_root = meta_pair->second.scripts_root;
+		std::lock_guard<std::mutex> lock(mod_metadata_mutex);
+		const auto& meta_pair = mod_metadata.find(mod);
+		if (meta_pair != mod_metadata.end())
+		{
+			scripts_root = meta_pair->second.scripts_root;
+		}
 	}
 
-	ifstream handle("mods/" + mod + "/" + scripts_root + "/" + file + ".wren");
-	if (!handle.good())
+	// The text is kept by the cache until the VMs are closed, so Wren can compile it in place
+	module_cache::module_source source;
+	if (!module_cache::load("mods/" + mod + "/" + scripts_root + "/" + file + ".wren", source))
 	{
 		WrenLoadModuleResult result{};
 		return result;
 	}
 
-	string str = file_to_string(handle);
+	// The source is already hashed, so there's no need to go over it again for the tweak cache
+	string environment = "module:" + name + '\0';
+	environment.append((const char*)&source.hash, sizeof(source.hash));
+	tweak_cache::note_environment(environment);
+
+	WrenLoadModuleResult result{};
+	result.source = source.text;
 
 	// Perhaps unwisely I used 'continue' as a variable name in xml_loader.wren in the basemod, which
 	// is now a keyword. To avoid crashes if someone updates their DLL before updating their basemod, check
 	// for that and hack around it as necessary.
-	if (name == "base/private/xml_loader" && str.find("var continue = dive_tweak_elem") != std::string::npos)
+	string_view text(source.text, source.length);
+	if (name == "base/private/xml_loader" && text.find("var continue = dive_tweak_elem") != std::string::npos)
 	{
+		string str(text);
+
 		// Oh by the way, thanks C++ for not having a string find-replace function (unless I can't find it)
 		size_t pos = 0;
 		while ((pos = str.find("continue", pos)) != std::string::npos)
@@ -450,58 +624,127 @@ static WrenLoadModuleResult getModulePath([[maybe_unused]] WrenVM* vm, const cha
 			str.replace(pos, 8, "cont");
 		}
 		PD2HOOK_LOG_WARN("Patching around an old use of the variable name 'continue'. Please update your basemod.");
-	}
 
-	size_t length = str.length() + 1;
-	char* output = (char*)malloc(length); // +1 for the null
-	portable_strncpy(output, str.c_str(), length);
+		size_t length = str.length() + 1;
+		char* output = (char*)malloc(length); // +1 for the null
+		portable_strncpy(output, str.c_str(), length);
+
+		result.source = output;
+		result.onComplete = [](WrenVM*, const char* module, WrenLoadModuleResult result) { free((void*)result.source); };
+	}
 
-	WrenLoadModuleResult result{};
-	result.source = output;
-	result.onComplete = [](WrenVM*, const char* module, WrenLoadModuleResult result) { free((void*)result.source); };
 	return result;
 }
 
+namespace
+{
+	struct vm_context
+	{
+		pd2hook::wren::vm_state state; // What the VM's user data points to
+		WrenVM* vm = nullptr;
+		std::recursive_mutex mutex;
+
+		// Handles which are used over and over, kept for as long as the VM exists. These are only accessed with
+		// the VM's lock held.
+		std::map<std::pair<std::string, std::string>, WrenHandle*> class_handles;
+		std::map<std::string, WrenHandle*> call_handles;
+	};
+
+	// A VM that's locked for running a tweak
+	struct tweak_vm_lease
+	{
+		vm_context* ctx = nullptr;
+		std::unique_lock<std::recursive_mutex> lock;
+	};
+} // namespace
+
+static vm_context main_vm;
+static bool vm_available = true; // Only touched with the main VM's lock held
+
+// Set once the main VM has loaded the basemod, so the tweaker can check it's running without waiting on it's lock
+static std::atomic<bool> main_vm_started{false};
+
+// The pooled VMs are started when they're first needed and kept until shutdown, so once one has been counted in
+// pooled_vm_count it can be used without holding pool_mutex.
+static std::mutex pool_mutex;
+static std::unique_ptr<vm_context> pooled_vms[max_pooled_vms];
+static std::atomic<int> pooled_vm_count{0};
+static std::atomic<unsigned int> next_busy_vm{0};
+
 std::lock_guard<std::recursive_mutex> pd2hook::wren::lock_wren_vm()
 {
-	static std::recursive_mutex vm_mutex;
-	return std::lock_guard<std::recursive_mutex>(vm_mutex);
+	return std::lock_guard<std::recursive_mutex>(main_vm.mutex);
+}
+
+pd2hook::wren::vm_state* pd2hook::wren::get_vm_state(WrenVM* vm)
+{
+	return (vm_state*)wrenGetUserData(vm);
+}
+
+bool pd2hook::wren::is_main_vm(WrenVM* vm)
+{
+	return get_vm_state(vm)->main;
+}
+
+// Start a VM and load the basemod into it, which must be done with it's lock held
+static bool start_vm(vm_context& ctx)
+{
+	WrenConfiguration config;
+	wrenInitConfiguration(&config);
+	wren_heap::configure(config);
+	config.errorFn = &err;
+	config.bindForeignMethodFn = &bindForeignMethod;
+	config.bindForeignClassFn = &bindForeignClass;
+	config.resolveModuleFn = &resolveModule;
+	config.loadModuleFn = &getModulePath;
+	config.userData = &ctx.state;
+	ctx.vm = wrenNewVM(&config);
+	wren_heap::attach(ctx.state.heap, ctx.vm);
+
+	WrenInterpretResult result = wrenInterpret(ctx.vm, "__root", R"!( import "base/base" )!");
+	return result != WREN_RESULT_COMPILE_ERROR && result != WREN_RESULT_RUNTIME_ERROR;
+}
+
+// Release everything held on a VM and free it, which must be done with it's lock held
+static void free_vm(vm_context& ctx)
+{
+	wrenxml::release_wren_handles(ctx.vm);
+
+	for (const auto& pair : ctx.class_handles)
+		wrenReleaseHandle(ctx.vm, pair.second);
+	ctx.class_handles.clear();
+
+	for (const auto& pair : ctx.call_handles)
+		wrenReleaseHandle(ctx.vm, pair.second);
+	ctx.call_handles.clear();
+
+	wren_heap::attach(ctx.state.heap, nullptr);
+	wrenFreeVM(ctx.vm);
+	ctx.vm = nullptr;
 }
 
 WrenVM* pd2hook::wren::get_wren_vm()
 {
 	auto lock = lock_wren_vm();
 
-	static bool available = true;
-	static WrenVM* vm = nullptr;
-
-	if (vm == nullptr)
+	if (main_vm.vm == nullptr)
 	{
-		if (available)
+		if (vm_available)
 		{
 			// If the main file doesn't exist, do nothing
 			Util::FileType ftyp = Util::GetFileType("mods/base/wren/base.wren");
 			if (ftyp == Util::FileType_None)
 			{
 				PD2HOOK_LOG_WARN("Wren base file not found, Wren VM disabled - the basemod may be corrupted");
-				available = false;
+				vm_available = false;
 			}
 		}
 
-		if (!available)
+		if (!vm_available)
 			return nullptr;
 
-		WrenConfiguration config;
-		wrenInitConfiguration(&config);
-		config.errorFn = &err;
-		config.bindForeignMethodFn = &bindForeignMethod;
-		config.bindForeignClassFn = &bindForeignClass;
-		config.resolveModuleFn = &resolveModule;
-		config.loadModuleFn = &getModulePath;
-		vm = wrenNewVM(&config);
-
-		WrenInterpretResult result = wrenInterpret(vm, "__root", R"!( import "base/base" )!");
-		if (result == WREN_RESULT_COMPILE_ERROR || result == WREN_RESULT_RUNTIME_ERROR)
+		main_vm.state.main = true;
+		if (!start_vm(main_vm))
 		{
 			PD2HOOK_LOG_ERROR("Wren init failed: compile or runtime error!");
 
@@ -512,25 +755,211 @@ WrenVM* pd2hook::wren::get_wren_vm()
 			abort();
 #endif
 		}
+
+		// Nothing else can be loading modules until we let go of the lock, so the new sources can be saved
+		module_cache::save();
+
+		module_cache::cache_stats stats = module_cache::get_stats();
+		PD2HOOK_LOG_LOG("Loaded " + to_string(stats.hits + stats.reads) + " Wren modules, " + to_string(stats.reads) +
+		                " of which weren't in the module cache");
+
+		main_vm_started = true;
+	}
+
+	return main_vm.vm;
+}
+
+static WrenHandle* class_handle(vm_context& ctx, const char* module, const char* class_name)
+{
+	WrenHandle*& handle = ctx.class_handles[std::make_pair(std::string(module), std::string(class_name))];
+	if (!handle)
+	{
+		wrenEnsureSlots(ctx.vm, 1);
+		wrenGetVariable(ctx.vm, module, class_name, 0);
+		handle = wrenGetSlotHandle(ctx.vm, 0);
+	}
+	return handle;
+}
+
+static WrenHandle* call_handle(vm_context& ctx, const std::string& signature)
+{
+	WrenHandle*& handle = ctx.call_handles[signature];
+	if (!handle)
+		handle = wrenMakeCallHandle(ctx.vm, signature.c_str());
+	return handle;
+}
+
+WrenHandle* pd2hook::wren::get_class_handle(const char* module, const char* class_name)
+{
+	auto lock = lock_wren_vm();
+	if (!get_wren_vm())
+		return nullptr;
+
+	return class_handle(main_vm, module, class_name);
+}
+
+WrenHandle* pd2hook::wren::get_call_handle(const std::string& signature)
+{
+	auto lock = lock_wren_vm();
+	if (!get_wren_vm())
+		return nullptr;
+
+	return call_handle(main_vm, signature);
+}
+
+// Start another VM for the pool, returning it locked, or null if the pool is already full
+static vm_context* start_pooled_vm(std::unique_lock<std::recursive_mutex>& lock)
+{
+	std::lock_guard<std::mutex> pool_lock(pool_mutex);
+
+	int count = pooled_vm_count;
+	if (count >= pool_size)
+		return nullptr;
+
+	std::unique_ptr<vm_context> ctx = std::make_unique<vm_context>();
+	lock = std::unique_lock<std::recursive_mutex>(ctx->mutex);
+
+	if (!start_vm(*ctx))
+	{
+		// The main VM loaded fine, so something odd is going on - stop trying and use that from now on
+		PD2HOOK_LOG_ERROR("Failed to start a pooled Wren VM, disabling the pool");
+		free_vm(*ctx);
+		pool_size = count;
+		lock = std::unique_lock<std::recursive_mutex>();
+		return nullptr;
 	}
 
-	return vm;
+	PD2HOOK_LOG_LOG("Started pooled Wren VM " + to_string(count + 1) + " of " + to_string(pool_size.load()));
+
+	pooled_vms[count] = std::move(ctx);
+	pooled_vm_count = count + 1;
+	return pooled_vms[count].get();
 }
 
-const char* tweaker::transform_file(const char* text)
+// Find a VM to run a tweak on. Without a pool, or if the file isn't pool-safe, this is always the main VM. Otherwise
+// it's whichever VM is free, starting another one if they're all busy and there's room.
+static tweak_vm_lease lease_tweak_vm(bool pool_safe)
 {
-	auto lock = pd2hook::wren::lock_wren_vm();
-	WrenVM* vm = pd2hook::wren::get_wren_vm();
+	tweak_vm_lease lease;
+	lease.ctx = &main_vm;
+
+	// This also succeeds if this thread is already using the main VM
+	lease.lock = std::unique_lock<std::recursive_mutex>(main_vm.mutex, std::try_to_lock);
+	if (lease.lock.owns_lock() || pool_size == 0 || !pool_safe)
+	{
+		if (!lease.lock.owns_lock())
+			lease.lock.lock();
+		return lease;
+	}
+
+	int count = pooled_vm_count;
+	for (int i = 0; i < count; i++)
+	{
+		vm_context* ctx = pooled_vms[i].get();
+		std::unique_lock<std::recursive_mutex> lock(ctx->mutex, std::try_to_lock);
+		if (lock.owns_lock() && ctx->vm)
+		{
+			lease.ctx = ctx;
+			lease.lock = std::move(lock);
+			return lease;
+		}
+	}
 
-	// If the Wren runtime is unavailable, obviously we can't apply any tweaks
+	if (vm_context* ctx = start_pooled_vm(lease.lock))
+	{
+		lease.ctx = ctx;
+		return lease;
+	}
+
+	// Everything is busy, so queue up on one of them
+	count = pooled_vm_count;
+	unsigned int pick = next_busy_vm++ % (count + 1);
+	if (pick > 0)
+	{
+		vm_context* ctx = pooled_vms[pick - 1].get();
+		lease.lock = std::unique_lock<std::recursive_mutex>(ctx->mutex);
+		if (ctx->vm)
+		{
+			lease.ctx = ctx;
+			return lease;
+		}
+	}
+
+	lease.ctx = &main_vm;
+	lease.lock = std::unique_lock<std::recursive_mutex>(main_vm.mutex);
+	return lease;
+}
+
+void pd2hook::wren::close_wren_vm()
+{
+	// This runs while the game is shutting down, when another thread could have been killed while holding the
+	// lock. Leaking the VM is much better than hanging the game on exit in that case.
+	std::unique_lock<std::recursive_mutex> lock(main_vm.mutex, std::try_to_lock);
+	if (!lock.owns_lock())
+	{
+		PD2HOOK_LOG_WARN("Wren VM is in use during shutdown, not freeing it");
+		return;
+	}
+
+	// Don't start the VM up again if anything tries to use it from here on
+	vm_available = false;
+
+	// Stop the pooled VMs from being used, then free whichever of them aren't busy
+	bool leaked = false;
+	{
+		std::lock_guard<std::mutex> pool_lock(pool_mutex);
+		pool_size = 0;
+		int count = pooled_vm_count.exchange(0);
+		for (int i = 0; i < count; i++)
+		{
+			vm_context& ctx = *pooled_vms[i];
+			std::unique_lock<std::recursive_mutex> pooled_lock(ctx.mutex, std::try_to_lock);
+			if (!pooled_lock.owns_lock())
+			{
+				PD2HOOK_LOG_WARN("Pooled Wren VM is in use during shutdown, not freeing it");
+				pooled_vms[i].release();
+				leaked = true;
+				continue;
+			}
+
+			if (ctx.vm)
+				free_vm(ctx);
+		}
+	}
+
+	if (!main_vm.vm)
+		return;
+
+	// Everything else that holds handles has to let go of them before the VM can be freed
+	dbhook::release_wren_handles(main_vm.vm);
+	lua_io::release_wren_handles(main_vm.vm);
+
+	free_vm(main_vm);
+
+	// Pick up anything that was loaded after startup, as long as no VM could still be using the sources
+	if (!leaked)
+		module_cache::save();
+}
+
+shared_ptr<const string> tweaker::transform_file(const char* text, size_t length, bool pool_safe)
+{
+	// If the Wren runtime is unavailable, obviously we can't apply any tweaks. Once the main VM is running, don't go
+	// through get_wren_vm, as that waits for the main VM's lock and would hold up every other thread behind whatever
+	// tweak is running on it. If the VM has been closed since, the lease picks that up.
+	if (!main_vm_started && !pd2hook::wren::get_wren_vm())
+		return nullptr;
+
+	// Only the main VM has the state pushed from Lua and registered at runtime, so tweaks run there unless every mod
+	// tweaking the file has said they don't need it
+	tweak_vm_lease lease = lease_tweak_vm(pool_safe);
+	WrenVM* vm = lease.ctx->vm;
 	if (!vm)
-		return text;
+		return nullptr;
 
-	wrenEnsureSlots(vm, 4);
+	WrenHandle* tweakerClass = class_handle(*lease.ctx, "base/base", "BaseTweaker");
+	WrenHandle* sig = call_handle(*lease.ctx, "tweak(_,_,_)");
 
-	wrenGetVariable(vm, "base/base", "BaseTweaker", 0);
-	WrenHandle* tweakerClass = wrenGetSlotHandle(vm, 0);
-	WrenHandle* sig = wrenMakeCallHandle(vm, "tweak(_,_,_)");
+	wrenEnsureSlots(vm, 4);
 
 	char hex[17]; // 16-chars long +1 for the null
 
@@ -542,25 +971,61 @@ const char* tweaker::transform_file(const char* text)
 	snprintf(hex, sizeof(hex), IDPF, *blt::platform::last_loaded_ext);
 	wrenSetSlotString(vm, 2, hex);
 
-	wrenSetSlotString(vm, 3, text);
+	if (use_buffer_view)
+		wrenxml::set_input_buffer(vm, 3, text, length);
+	else
+		wrenSetSlotBytes(vm, 3, text, length);
 
 	// TODO give a reasonable amount of information on what happened.
 	WrenInterpretResult result2 = wrenCall(vm, sig);
+
+	// The text may be freed as soon as we return
+	wrenxml::clear_input_buffer(vm);
+
 	if (result2 == WREN_RESULT_COMPILE_ERROR)
 	{
 		PD2HOOK_LOG_ERROR("Wren tweak file failed: compile error!");
-		return text;
+		tweak_cache::mark_uncacheable();
+		return nullptr;
 	}
 	else if (result2 == WREN_RESULT_RUNTIME_ERROR)
 	{
 		PD2HOOK_LOG_ERROR("Wren tweak file failed: runtime error!");
-		return text;
+		tweak_cache::mark_uncacheable();
+		return nullptr;
 	}
 
-	wrenReleaseHandle(vm, tweakerClass);
-	wrenReleaseHandle(vm, sig);
+	switch (wrenGetSlotType(vm, 0))
+	{
+	case WREN_TYPE_NULL:
+		return nullptr;
+	case WREN_TYPE_STRING:
+	{
+		int new_length;
+		const char* new_text = wrenGetSlotBytes(vm, 0, &new_length);
 
-	const char* new_text = wrenGetSlotString(vm, 0);
+		// Tweakers often hand back exactly what they were given, in which case the engine can keep using the original
+		if ((size_t)new_length == length && memcmp(new_text, text, length) == 0)
+			return nullptr;
 
-	return new_text;
+		return make_shared<const string>(new_text, new_length);
+	}
+	case WREN_TYPE_FOREIGN:
+	{
+		if (wrenxml::is_input_buffer(vm, 0))
+			return nullptr;
+
+		// Returning the document itself saves converting it to a Wren string and then copying that
+		auto output = make_shared<string>();
+		if (wrenxml::get_element_text(vm, 0, *output))
+			return output;
+		break;
+	}
+	default:
+		break;
+	}
+
+	PD2HOOK_LOG_ERROR("Wren tweak file failed: the tweaker must return a String, an XML element, it's input or null");
+	tweak_cache::mark_uncacheable();
+	return nullptr;
 }
@@ -1,11 +1,42 @@
 #pragma once
 
+#include "wren_heap.h"
+#include "wrenxml.h"
+
 #include <wren.hpp>
 
 #include <mutex>
+#include <string>
 
 namespace pd2hook::wren
 {
+	// The main VM runs the mods, and owns everything they register: asset hooks, Lua objects, tweak registrations,
+	// mod metadata and so on. When the basemod enables the tweak VM pool, extra VMs are started to run XML tweaks
+	// on other threads at the same time. These import the same modules, but anything they try to register is
+	// ignored (see is_main_vm), and nothing pushed from Lua reaches them. Because of that, only files that every
+	// tweaking mod has registered as pool-safe are tweaked on them, and everything else stays on the main VM.
 	WrenVM* get_wren_vm();
 	std::lock_guard<std::recursive_mutex> lock_wren_vm();
+
+	// Native state that each VM has it's own copy of
+	struct vm_state
+	{
+		bool main = false;
+		tweaker::wrenxml::WXMLState xml;
+		tweaker::wren_heap::vm_heap heap;
+	};
+	vm_state* get_vm_state(WrenVM* vm);
+
+	// Foreign methods that register anything globally should do nothing when this is false
+	bool is_main_vm(WrenVM* vm);
+
+	// Get a handle to a class or a call signature on the main VM, which is looked up the first time it's used and
+	// kept until the VM is closed, so it must not be released by the caller. These return null if the VM isn't
+	// available.
+	WrenHandle* get_class_handle(const char* module, const char* class_name);
+	WrenHandle* get_call_handle(const std::string& signature);
+
+	// Release all the handles held by SuperBLT and free the VMs, during shutdown. After this get_wren_vm will
+	// always return null.
+	void close_wren_vm();
 } // namespace pd2hook::wren
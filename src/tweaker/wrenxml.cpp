@@ -1,8 +1,13 @@
 #include "wrenxml.h"
+#include "wrenloader.h"
 
 #include "global.h"
 
+#include <algorithm>
+#include <mutex>
 #include <string>
+#include <unordered_set>
+#include <vector>
 #include <util/util.h>
 
 using namespace std;
@@ -20,17 +25,112 @@ const char *MODULE = "base/native";
 	exit(1);*/ \
 }
 
+// Note the slot is copied out rather than referenced, since the arena may be resized by creating another node
 #define GET_WXML_NODE(vm, slot, name) \
-WXMLNode *name = *(WXMLNode**)wrenGetSlotForeign(vm, slot); \
-if(name->root == NULL) { \
+WXMLSlot name = get_slot(vm, slot); \
+if(name.node == NULL) { \
 	WXML_ERR("Cannot use closed Wren XML Instance"); \
+	return; \
 }
 
 #define THIS_WXML_NODE(vm) \
 GET_WXML_NODE(vm, 0, wxml) \
-mxml_node_t *handle = wxml->handle; \
+mxml_node_t *handle = wxml.node; \
 (void)(handle) /* cast our handle to void to eliminate GCC's unused variable errors */
 
+// Used for objects that don't have a node, such as if parsing failed
+static const uint32_t NO_SLOT = UINT32_MAX;
+
+static WXMLState *get_state(WrenVM *vm)
+{
+	return &pd2hook::wren::get_vm_state(vm)->xml;
+}
+
+static WXMLSlot get_slot(WrenVM *vm, int slot)
+{
+	WXMLHandle *handle = (WXMLHandle*)wrenGetSlotForeign(vm, slot);
+	if (handle->slot == NO_SLOT)
+		return WXMLSlot();
+	return handle->state->node_slots[handle->slot];
+}
+
+static uint32_t slot_of(mxml_node_t *node)
+{
+	return (uint32_t)(uintptr_t)mxmlGetUserData(node) - 1;
+}
+
+// Find or create the slot for a node, and add a reference to it
+static uint32_t acquire_slot(WXMLDocument *doc, mxml_node_t *node)
+{
+	vector<WXMLSlot> &node_slots = doc->state->node_slots;
+	vector<uint32_t> &free_slots = doc->state->free_slots;
+
+	if (mxmlGetUserData(node))
+	{
+		uint32_t index = slot_of(node);
+		node_slots[index].refs++;
+		return index;
+	}
+
+	uint32_t index;
+	if (!free_slots.empty())
+	{
+		index = free_slots.back();
+		free_slots.pop_back();
+	}
+	else
+	{
+		index = (uint32_t)node_slots.size();
+		node_slots.emplace_back();
+	}
+
+	WXMLSlot &slot = node_slots[index];
+	slot.node = node;
+	slot.doc = doc;
+	slot.refs = 1;
+
+	doc->handles++;
+	mxmlSetUserData(node, (void*)(uintptr_t)(index + 1));
+
+	return index;
+}
+
+static void release_slot(WXMLState *state, uint32_t index)
+{
+	if (index == NO_SLOT)
+		return;
+
+	WXMLSlot &slot = state->node_slots[index];
+	if (--slot.refs > 0)
+		return;
+
+	WXMLDocument *doc = slot.doc;
+	if (slot.node)
+		mxmlSetUserData(slot.node, NULL);
+
+	slot = WXMLSlot();
+	state->free_slots.push_back(index);
+
+	// Nothing can reach the document any more
+	if (doc && --doc->handles == 0)
+		delete doc;
+}
+
+// Move the slots of every node under (and including) top from one document to another
+static void move_slots(mxml_node_t *top, WXMLDocument *from, WXMLDocument *to)
+{
+	for (mxml_node_t *node = top; node != NULL; node = mxmlWalkNext(node, top, MXML_DESCEND))
+	{
+		if (!mxmlGetUserData(node))
+			continue;
+
+		WXMLSlot &slot = from->state->node_slots[slot_of(node)];
+		slot.doc = to;
+		from->handles--;
+		to->handles++;
+	}
+}
+
 static char *					/* O - Allocated string */
 mxmlToAllocStringSafe(
     mxml_node_t    *node,		/* I - Node to write */
@@ -84,8 +184,9 @@ mxmlToAllocStringSafe(
 	return (s);
 }
 
-static const char *last_loaded_xml = NULL;
-static char *mxml_last_error = NULL;
+// Each VM can be parsing on a different thread
+static thread_local const char *last_loaded_xml = NULL;
+static thread_local char *mxml_last_error = NULL;
 
 static void handle_mxml_error_crash(const char* error)
 {
@@ -102,7 +203,25 @@ static void handle_mxml_error_crash(const char* error)
 
 static void handle_mxml_error_note(const char* error)
 {
-	mxml_last_error = strdup(error);
+	// Only keep the first error, as that's the one that stopped the parse
+	if (!mxml_last_error)
+		mxml_last_error = strdup(error);
+}
+
+static thread_local wrenxml::mxml_error_handler mxml_thread_error_handler = handle_mxml_error_crash;
+
+static void dispatch_mxml_error(const char* error)
+{
+	mxml_thread_error_handler(error);
+}
+
+void wrenxml::set_mxml_error_handler(mxml_error_handler handler)
+{
+	// Installed the first time anything parses, after which only the per-thread handler changes
+	static std::once_flag installed;
+	std::call_once(installed, []() { mxmlSetErrorCallback(dispatch_mxml_error); });
+
+	mxml_thread_error_handler = handler;
 }
 
 static mxml_node_t* recursive_clone(mxml_node_t *dest_parent, mxml_node_t *src)
@@ -131,135 +250,121 @@ mxml_type_t remove_whitespace_callback(mxml_node_t *)
 	return MXML_IGNORE;
 }
 
-WXMLDocument::WXMLDocument(const char *text)
+WXMLDocument::WXMLDocument(WXMLState *state, const char *text) : state(state)
 {
 	root_node = mxmlLoadString(NULL, text, remove_whitespace_callback);
 }
 
-WXMLDocument::WXMLDocument(WXMLNode *clone_from)
-{
-	root_node = recursive_clone(MXML_NO_PARENT, clone_from->handle);
-}
-
-WXMLDocument::WXMLDocument(mxml_node_t *root_node) : root_node(root_node) {}
+WXMLDocument::WXMLDocument(WXMLState *state, mxml_node_t *root_node) : root_node(root_node), state(state) {}
 
 WXMLDocument::~WXMLDocument()
 {
-	for (auto const &node : nodes)
-	{
-		node.second->root = NULL;
-		node.second->handle = NULL;
-	}
-
 	mxmlDelete(root_node);
 }
 
-WXMLNode* WXMLDocument::GetNode(mxml_node_t *node)
+static void index_element(WXMLDocument *doc, mxml_node_t *node, uint32_t &counter)
 {
-	if (nodes.count(node)) return nodes[node];
-
-	return new WXMLNode(this, node);
-}
+	uint32_t order = counter++;
+	doc->name_index[mxmlGetElement(node)].push_back({order, node});
 
-void WXMLDocument::MergeInto(WXMLDocument *other)
-{
-	for (auto const &pair : nodes)
+	for (mxml_node_t *child = mxmlGetFirstChild(node); child != NULL; child = mxmlGetNextSibling(child))
 	{
-		other->nodes[pair.first] = pair.second;
-		pair.second->root = other;
+		if (mxmlGetType(child) == MXML_ELEMENT)
+			index_element(doc, child, counter);
 	}
-	nodes.clear();
-	root_node = NULL;
-	// TODO mark ourselves for deletion
+
+	doc->element_ranges[node] = make_pair(order, counter - 1);
 }
 
-WXMLNode::WXMLNode(WXMLDocument *root, mxml_node_t *handle) : root(root), handle(handle), usages(0)
+void WXMLDocument::UpdateIndex()
 {
-	root->nodes[handle] = this;
+	if (index_generation == generation)
+		return;
+
+	name_index.clear();
+	element_ranges.clear();
+
+	// The root might be an <?xml?> declaration with the real root inside it, which mxml also treats as an element
+	uint32_t counter = 0;
+	if (root_node && mxmlGetType(root_node) == MXML_ELEMENT)
+		index_element(this, root_node, counter);
+
+	index_generation = generation;
 }
 
-void WXMLNode::Release()
+// Free a document immediately, even though Wren still has references to it
+static void close_document(WXMLDocument *doc)
 {
-	usages--;
-	if (usages <= 0)
+	for (mxml_node_t *node = doc->root_node; node != NULL; node = mxmlWalkNext(node, doc->root_node, MXML_DESCEND))
 	{
-		if (root != NULL)
-		{
-			root->nodes.erase(handle);
-
-			if (root->nodes.empty())
-			{
-				delete root;
-			}
-		}
+		if (!mxmlGetUserData(node))
+			continue;
 
-		handle = NULL;
-		root = NULL;
-		delete this; // DANGER!
+		// Leave the slot allocated until the Wren object is finalised, but mark it as closed
+		WXMLSlot &slot = doc->state->node_slots[slot_of(node)];
+		slot.node = NULL;
+		slot.doc = NULL;
 	}
+
+	delete doc;
 }
 
-WXMLDocument* WXMLNode::MoveToNewDocument()
+// Take a node out of it's parent, and give it a document of it's own
+static void detach_node(WXMLDocument *old, mxml_node_t *node)
 {
-	WXMLDocument *old = root;
-	WXMLDocument *doc = new WXMLDocument(handle);
+	WXMLDocument *doc = new WXMLDocument(old->state, node);
+	mxmlRemove(node);
+	move_slots(node, old, doc);
+	old->generation++;
+
+	// If the only references were into the part we just removed, nothing can refer to the old document
+	if (old->handles == 0)
+		delete old;
+}
 
-	vector<mxml_node_t*> to_remove;
-	for (auto const &node : old->nodes)
+// Returns false if the fiber was aborted, in which case slot 0 doesn't hold an XML object
+static bool attemptParseString(WrenVM* vm)
+{
+	// Parsing straight from the input buffer saves copying the whole file into a Wren string first
+	const char* text;
+	if (is_input_buffer(vm, 1))
 	{
-		mxml_node_t *nod = node.first;
-		bool is_child = false;
-		while (nod != NULL)
+		text = get_state(vm)->input_buffer_data->data;
+		if (text == NULL)
 		{
-			if (nod == handle)
-			{
-				is_child = true;
-				break;
-			}
-			nod = mxmlGetParent(nod);
+			WXML_ERR("Cannot parse an XMLBuffer after the tweak it was passed to has finished");
+			return false;
 		}
-
-		if (!is_child) continue;
-
-		to_remove.push_back(node.first);
-		node.second->root = doc;
-		doc->nodes[node.first] = node.second;
 	}
-
-	for (mxml_node_t* const &node : to_remove)
+	else
 	{
-		old->nodes.erase(node);
+		text = wrenGetSlotString(vm, 1);
 	}
-
-	mxmlRemove(handle);
-
-	return doc;
-}
-
-static WXMLNode* attemptParseString(WrenVM* vm)
-{
-	WXMLNode **node = (WXMLNode**)wrenSetSlotNewForeign(vm, 0, 0, sizeof(WXMLNode*));
-
-	const char* text = wrenGetSlotString(vm, 1);
 	last_loaded_xml = text;
 
-	WXMLDocument *doc = new WXMLDocument(text);
+	WXMLHandle *node = (WXMLHandle*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(WXMLHandle));
+	node->slot = NO_SLOT;
+	node->state = get_state(vm);
 
-	*node = doc->GetRootNode();
-	(*node)->Use();
+	WXMLDocument *doc = new WXMLDocument(node->state, text);
 
-	// Use the crash callback for anything else
-	mxmlSetErrorCallback(handle_mxml_error_crash);
+	if (doc->root_node)
+		node->slot = acquire_slot(doc, doc->root_node);
+	else
+		delete doc;
 
-	return *node;
+	// Use the crash callback for anything else
+	wrenxml::set_mxml_error_handler(handle_mxml_error_crash);
+	return true;
 }
 
 static void allocateXML(WrenVM* vm)
 {
-	mxmlSetErrorCallback(handle_mxml_error_crash);
-	WXMLNode *wxml = attemptParseString(vm);
+	wrenxml::set_mxml_error_handler(handle_mxml_error_crash);
+	if (!attemptParseString(vm))
+		return;
 
-	if (!wxml->handle)
+	if (((WXMLHandle*)wrenGetSlotForeign(vm, 0))->slot == NO_SLOT)
 	{
 		WXML_ERR("Uncaught parse error!");
 	}
@@ -267,18 +372,27 @@ static void allocateXML(WrenVM* vm)
 
 static void finalizeXML(void* data)
 {
-	WXMLNode *wxml = *(WXMLNode**)data;
-	wxml->Release();
+	WXMLHandle *wxml = (WXMLHandle*)data;
+	release_slot(wxml->state, wxml->slot);
+	wxml->slot = NO_SLOT;
 }
 
 static void XMLtry_parse(WrenVM* vm)
 {
-	mxmlSetErrorCallback(handle_mxml_error_note);
-	WXMLNode *wxml = attemptParseString(vm);
+	// Clear anything left over, so only errors from this parse make it fail
+	free(mxml_last_error);
+	mxml_last_error = NULL;
+
+	wrenxml::set_mxml_error_handler(handle_mxml_error_note);
+	if (!attemptParseString(vm))
+	{
+		wrenxml::set_mxml_error_handler(handle_mxml_error_crash);
+		return;
+	}
 
 	if (mxml_last_error)
 	{
-		finalizeXML(wxml);
+		finalizeXML(wrenGetSlotForeign(vm, 0));
 		wrenSetSlotNull(vm, 0);
 
 		free(mxml_last_error);
@@ -289,21 +403,127 @@ static void XMLtry_parse(WrenVM* vm)
 static void XMLNode_delete(WrenVM* vm)
 {
 	// Make sure we don't crash if already freed, so don't use THIS_WXML
-	WXMLNode *wxml = *(WXMLNode**)wrenGetSlotForeign(vm, 0);
-	if (wxml->root != NULL) delete wxml->root;
+	WXMLSlot wxml = get_slot(vm, 0);
+	if (wxml.doc != NULL) close_document(wxml.doc);
 }
 
-static WXMLNode* XMLNode_create(WrenVM *vm, WXMLDocument *root, mxml_node_t *xnode, int slot)
+static void XMLNode_create(WrenVM *vm, WXMLDocument *root, mxml_node_t *xnode, int slot)
 {
-	if (xnode == NULL) WXML_ERR("Cannot create null XML Node");
+	if (xnode == NULL)
+	{
+		WXML_ERR("Cannot create null XML Node");
+		return;
+	}
 
 	wrenGetVariable(vm, MODULE, "XML", slot);
 
-	WXMLNode **node = (WXMLNode**)wrenSetSlotNewForeign(vm, slot, slot, sizeof(WXMLNode*));
-	*node = root->GetNode(xnode);
-	(*node)->Use();
+	WXMLHandle *node = (WXMLHandle*)wrenSetSlotNewForeign(vm, slot, slot, sizeof(WXMLHandle));
+	node->slot = acquire_slot(root, xnode);
+	node->state = root->state;
+}
+
+static void allocateXMLBuffer(WrenVM* vm)
+{
+	// There's no constructor in Wren, so this only exists because foreign classes need one
+	wrenSetSlotNewForeign(vm, 0, 0, sizeof(WXMLBuffer));
+}
+
+#define THIS_WXML_BUFFER(vm) \
+WXMLBuffer *buffer = (WXMLBuffer*)wrenGetSlotForeign(vm, 0); \
+if (buffer->data == NULL) { \
+	WXML_ERR("Cannot use an XMLBuffer after the tweak it was passed to has finished"); \
+	return; \
+}
+
+static void XMLBuffer_valid(WrenVM* vm)
+{
+	wrenSetSlotBool(vm, 0, ((WXMLBuffer*)wrenGetSlotForeign(vm, 0))->data != NULL);
+}
+
+static void XMLBuffer_length(WrenVM* vm)
+{
+	THIS_WXML_BUFFER(vm);
+
+	wrenSetSlotDouble(vm, 0, (double)buffer->length);
+}
+
+static void XMLBuffer_string(WrenVM* vm)
+{
+	THIS_WXML_BUFFER(vm);
+
+	wrenSetSlotBytes(vm, 0, buffer->data, buffer->length);
+}
+
+void wrenxml::set_input_buffer(WrenVM* vm, int slot, const char *text, size_t length)
+{
+	WXMLState *state = get_state(vm);
+	if (state->input_buffer)
+	{
+		wrenSetSlotHandle(vm, slot, state->input_buffer);
+	}
+	else
+	{
+		wrenGetVariable(vm, MODULE, "XMLBuffer", slot);
+		state->input_buffer_data = (WXMLBuffer*)wrenSetSlotNewForeign(vm, slot, slot, sizeof(WXMLBuffer));
+		state->input_buffer = wrenGetSlotHandle(vm, slot);
+	}
 
-	return *node;
+	state->input_buffer_data->data = text;
+	state->input_buffer_data->length = length;
+}
+
+void wrenxml::clear_input_buffer(WrenVM* vm)
+{
+	WXMLState *state = get_state(vm);
+	if (!state->input_buffer_data)
+		return;
+
+	state->input_buffer_data->data = NULL;
+	state->input_buffer_data->length = 0;
+}
+
+bool wrenxml::is_input_buffer(WrenVM* vm, int slot)
+{
+	WXMLState *state = get_state(vm);
+	return state->input_buffer_data && wrenGetSlotType(vm, slot) == WREN_TYPE_FOREIGN &&
+	       wrenGetSlotForeign(vm, slot) == state->input_buffer_data;
+}
+
+bool wrenxml::get_element_text(WrenVM* vm, int slot, std::string& output)
+{
+	if (wrenGetSlotType(vm, slot) != WREN_TYPE_FOREIGN || is_input_buffer(vm, slot))
+		return false;
+
+	// Make sure this really is an XML object, in case some other kind of foreign object was passed in
+	WXMLState *state = get_state(vm);
+	WXMLHandle *handle = (WXMLHandle*)wrenGetSlotForeign(vm, slot);
+	if (handle->state != state || handle->slot >= state->node_slots.size())
+		return false;
+
+	mxml_node_t *node = state->node_slots[handle->slot].node;
+	if (node == NULL || mxmlGetType(node) != MXML_ELEMENT)
+		return false;
+
+	// Find out how long it is first, so it can be written directly into the output without a temporary copy
+	mxmlSetWrapMargin(0);
+	char probe[1];
+	int bytes = mxmlSaveString(node, probe, sizeof(probe), MXML_NO_CALLBACK);
+	if (bytes < 0)
+		return false;
+
+	// This writes the null terminator into output[bytes], which std::string always has room for
+	output.resize(bytes);
+	mxmlSaveString(node, &output[0], bytes + 1, MXML_NO_CALLBACK);
+	return true;
+}
+
+void wrenxml::release_wren_handles(WrenVM* vm)
+{
+	WXMLState *state = get_state(vm);
+	if (state->input_buffer)
+		wrenReleaseHandle(vm, state->input_buffer);
+	state->input_buffer = NULL;
+	state->input_buffer_data = NULL;
 }
 
 static void XMLNode_type(WrenVM* vm)
@@ -363,6 +583,7 @@ static void XMLNode_name_set(WrenVM* vm)
 	XMLNODE_REQUIRE_TYPE(MXML_ELEMENT, name);
 
 	mxmlSetElement(handle, wrenGetSlotString(vm, 1));
+	wxml.doc->generation++;
 }
 
 static void XMLNode_attribute(WrenVM* vm)
@@ -423,7 +644,8 @@ static void XMLNode_create_element(WrenVM* vm)
 
 	const char *name = wrenGetSlotString(vm, 1);
 	mxml_node_t *node = mxmlNewElement(handle, name);
-	XMLNode_create(vm, wxml->root, node, 0);
+	wxml.doc->generation++;
+	XMLNode_create(vm, wxml.doc, node, 0);
 }
 
 static void XMLNode_detach(WrenVM* vm)
@@ -433,15 +655,15 @@ static void XMLNode_detach(WrenVM* vm)
 	// Don't do anything if we're already at the top of a tree
 	if (mxmlGetParent(handle) == NULL) return;
 
-	wxml->MoveToNewDocument();
+	detach_node(wxml.doc, handle);
 }
 
 static void XMLNode_clone(WrenVM* vm)
 {
 	THIS_WXML_NODE(vm);
 
-	WXMLDocument *doc = new WXMLDocument(wxml);
-	XMLNode_create(vm, doc, doc->GetRootNode()->handle, 0);
+	WXMLDocument *doc = new WXMLDocument(wxml.doc->state, recursive_clone(MXML_NO_PARENT, handle));
+	XMLNode_create(vm, doc, doc->root_node, 0);
 }
 
 static void XMLNode_attach(WrenVM* vm, int where, mxml_node_t *child)
@@ -449,15 +671,26 @@ static void XMLNode_attach(WrenVM* vm, int where, mxml_node_t *child)
 	THIS_WXML_NODE(vm);
 	GET_WXML_NODE(vm, 1, new_child);
 
-	if (mxmlGetParent(new_child->handle) != NULL)
+	if (mxmlGetParent(new_child.node) != NULL)
 	{
 		WXML_ERR("Cannot attach a node that already has a parent");
+		return;
+	}
+
+	// Since it doesn't have a parent, the new child must be the root of it's document
+	if (new_child.doc == wxml.doc)
+	{
+		WXML_ERR("Cannot attach a node to itself or one of it's children");
+		return;
 	}
 
-	WXMLDocument *old_root = new_child->root;
+	WXMLDocument *old_root = new_child.doc;
 
-	mxmlAdd(handle, where, child, new_child->handle);
-	new_child->root->MergeInto(wxml->root);
+	mxmlAdd(handle, where, child, new_child.node);
+	move_slots(new_child.node, old_root, wxml.doc);
+	wxml.doc->generation++;
+
+	old_root->root_node = NULL;
 	delete old_root;
 }
 
@@ -479,7 +712,245 @@ static void XMLNode_attach_pos(WrenVM* vm)
 	{
 		GET_WXML_NODE(vm, 2, prev_child);
 
-		XMLNode_attach(vm, MXML_ADD_AFTER, prev_child->handle);
+		XMLNode_attach(vm, MXML_ADD_AFTER, prev_child.node);
+	}
+}
+
+// Queries, using a small subset of XPath:
+//   a/b          b elements that are children of a, which is a child of the node being searched from
+//   //b          b elements at any depth below the node being searched from (a//b works too)
+//   *            any element
+//   b[@x='y']    b elements with the attribute x set to y (the quotes and @ are optional)
+//   b[@x]        b elements with the attribute x set to anything
+struct query_step
+{
+	bool descendant = false;
+	string name;
+
+	struct predicate
+	{
+		string attribute;
+		bool any_value;
+		string value;
+	};
+	vector<predicate> predicates;
+};
+
+// Returns an empty string on success, or the error message
+static string parse_query(const string &query, vector<query_step> &steps)
+{
+	size_t pos = 0;
+	while (pos < query.size())
+	{
+		query_step step;
+
+		// The separator - a leading / is allowed, and means the same as no slash
+		if (query.compare(pos, 2, "//") == 0)
+		{
+			step.descendant = true;
+			pos += 2;
+		}
+		else if (query[pos] == '/')
+		{
+			pos++;
+		}
+		else if (!steps.empty())
+		{
+			return "expected / at character " + to_string(pos + 1);
+		}
+
+		size_t name_end = query.find_first_of("/[", pos);
+		if (name_end == string::npos)
+			name_end = query.size();
+		step.name = query.substr(pos, name_end - pos);
+		if (step.name.empty())
+			return "missing element name at character " + to_string(pos + 1);
+		pos = name_end;
+
+		while (pos < query.size() && query[pos] == '[')
+		{
+			size_t end = query.find(']', pos);
+			if (end == string::npos)
+				return "unterminated [";
+
+			string pred = query.substr(pos + 1, end - pos - 1);
+			pos = end + 1;
+
+			if (!pred.empty() && pred[0] == '@')
+				pred.erase(0, 1);
+
+			query_step::predicate predicate;
+			size_t eq = pred.find('=');
+			predicate.any_value = eq == string::npos;
+			predicate.attribute = pred.substr(0, eq);
+			if (!predicate.any_value)
+			{
+				predicate.value = pred.substr(eq + 1);
+				size_t len = predicate.value.size();
+				if (len >= 2 && (predicate.value[0] == '\'' || predicate.value[0] == '"') &&
+				    predicate.value[len - 1] == predicate.value[0])
+				{
+					predicate.value = predicate.value.substr(1, len - 2);
+				}
+			}
+			if (predicate.attribute.empty())
+				return "missing attribute name in [" + pred + "]";
+
+			step.predicates.push_back(predicate);
+		}
+
+		steps.push_back(step);
+	}
+
+	if (steps.empty())
+		return "empty query";
+
+	return "";
+}
+
+static bool step_matches(const query_step &step, mxml_node_t *node)
+{
+	if (mxmlGetType(node) != MXML_ELEMENT)
+		return false;
+
+	if (step.name != "*" && step.name != mxmlGetElement(node))
+		return false;
+
+	for (const query_step::predicate &predicate : step.predicates)
+	{
+		const char *value = mxmlElementGetAttr(node, predicate.attribute.c_str());
+		if (!value)
+			return false;
+		if (!predicate.any_value && predicate.value != value)
+			return false;
+	}
+
+	return true;
+}
+
+// Returns true if the search should stop (because only the first result is wanted)
+static bool run_query(WXMLDocument *doc, const vector<query_step> &steps, size_t index, mxml_node_t *context,
+                      bool first_only, vector<mxml_node_t*> &results, unordered_set<mxml_node_t*> &seen)
+{
+	const query_step &step = steps[index];
+	bool last = index + 1 == steps.size();
+
+	auto visit = [&](mxml_node_t *node) {
+		if (!step_matches(step, node))
+			return false;
+
+		if (!last)
+			return run_query(doc, steps, index + 1, node, first_only, results, seen);
+
+		// With more than one descendant step the same node can be reached more than once
+		if (!seen.insert(node).second)
+			return false;
+
+		results.push_back(node);
+		return first_only;
+	};
+
+	if (!step.descendant)
+	{
+		for (mxml_node_t *child = mxmlGetFirstChild(context); child != NULL; child = mxmlGetNextSibling(child))
+		{
+			if (visit(child))
+				return true;
+		}
+		return false;
+	}
+
+	// Use the document's index to avoid walking the whole tree, when we know what we're looking for
+	if (step.name != "*")
+	{
+		doc->UpdateIndex();
+		auto range = doc->element_ranges.find(context);
+		auto elements = doc->name_index.find(step.name);
+		if (range != doc->element_ranges.end())
+		{
+			if (elements == doc->name_index.end())
+				return false;
+
+			// Everything strictly below the context node, which is numbered immediately after it
+			const vector<WXMLDocument::indexed_element> &list = elements->second;
+			auto iter = upper_bound(list.begin(), list.end(), range->second.first,
+			                        [](uint32_t order, const WXMLDocument::indexed_element &elem) {
+				                        return order < elem.order;
+			                        });
+			for (; iter != list.end() && iter->order <= range->second.second; ++iter)
+			{
+				if (visit(iter->node))
+					return true;
+			}
+			return false;
+		}
+	}
+
+	for (mxml_node_t *node = mxmlWalkNext(context, context, MXML_DESCEND); node != NULL;
+	     node = mxmlWalkNext(node, context, MXML_DESCEND))
+	{
+		if (visit(node))
+			return true;
+	}
+	return false;
+}
+
+static bool query(WrenVM *vm, bool first_only, vector<mxml_node_t*> &results, WXMLDocument **doc)
+{
+	WXMLSlot wxml = get_slot(vm, 0);
+	if (wxml.node == NULL)
+	{
+		WXML_ERR("Cannot use closed Wren XML Instance");
+		return false;
+	}
+
+	if (wrenGetSlotType(vm, 1) != WREN_TYPE_STRING)
+	{
+		WXML_ERR("XML query must be a string");
+		return false;
+	}
+
+	string text = wrenGetSlotString(vm, 1);
+	vector<query_step> steps;
+	string error = parse_query(text, steps);
+	if (!error.empty())
+	{
+		WXML_ERR("Invalid XML query '" + text + "': " + error);
+		return false;
+	}
+
+	unordered_set<mxml_node_t*> seen;
+	run_query(wxml.doc, steps, 0, wxml.node, first_only, results, seen);
+	*doc = wxml.doc;
+	return true;
+}
+
+static void XMLNode_find(WrenVM* vm)
+{
+	vector<mxml_node_t*> results;
+	WXMLDocument *doc;
+	if (!query(vm, true, results, &doc))
+		return;
+
+	if (results.empty())
+		wrenSetSlotNull(vm, 0);
+	else
+		XMLNode_create(vm, doc, results.front(), 0);
+}
+
+static void XMLNode_find_all(WrenVM* vm)
+{
+	vector<mxml_node_t*> results;
+	WXMLDocument *doc;
+	if (!query(vm, false, results, &doc))
+		return;
+
+	wrenEnsureSlots(vm, 2);
+	wrenSetSlotNewList(vm, 0);
+	for (mxml_node_t *node : results)
+	{
+		XMLNode_create(vm, doc, node, 1);
+		wrenInsertInList(vm, 0, -1, 1);
 	}
 }
 
@@ -488,7 +959,7 @@ static void XMLNode_ ## name(WrenVM* vm) { \
 	THIS_WXML_NODE(vm); \
 	mxml_node_t *node = mxmlGet ## getter(handle); \
 	if(node) { \
-		XMLNode_create(vm, wxml->root, node, 0); \
+		XMLNode_create(vm, wxml.doc, node, 0); \
 	} \
 	else { \
 		wrenSetSlotNull(vm, 0); \
@@ -516,6 +987,14 @@ WrenForeignMethodFn wrenxml::bind_wxml_method(
 	string class_name = class_name_s;
 	string signature = signature_c;
 
+	if (class_name == "XMLBuffer" && !is_static)
+	{
+		if (signature == "valid") return XMLBuffer_valid;
+		if (signature == "length") return XMLBuffer_length;
+		if (signature == "string") return XMLBuffer_string;
+		return NULL;
+	}
+
 	if (class_name == "XML")
 	{
 		if (is_static && signature == "try_parse(_)")
@@ -555,6 +1034,9 @@ WrenForeignMethodFn wrenxml::bind_wxml_method(
 
 		XMLNODE_FUNC(delete, "()");
 
+		XMLNODE_FUNC(find, "(_)");
+		XMLNODE_FUNC(find_all, "(_)");
+
 		XMLNODE_DIFF_FUNC(attribute, "[_]");
 		XMLNODE_DIFF_FUNC(attribute_set, "[_]=(_)");
 
@@ -575,6 +1057,13 @@ WrenForeignClassMethods wrenxml::get_XML_class_def(WrenVM* vm, const char* modul
 			def.finalize = finalizeXML;
 			return def;
 		}
+		else if (string(class_name) == "XMLBuffer")
+		{
+			WrenForeignClassMethods def;
+			def.allocate = allocateXMLBuffer;
+			def.finalize = NULL;
+			return def;
+		}
 	}
 	return { NULL, NULL };
 }
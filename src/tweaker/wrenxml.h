@@ -1,7 +1,10 @@
 #pragma once
 
-#include <unordered_set>
-#include <map>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "mxml.h"
 
@@ -13,49 +16,104 @@ namespace pd2hook
 	{
 		namespace wrenxml
 		{
-			class WXMLNode;
+			struct WXMLState;
 
+			// A single tree of nodes, which is freed along with the tree once no Wren objects refer
+			// to any of it's nodes.
 			class WXMLDocument
 			{
 			public:
-				WXMLDocument(const char *text);
-				WXMLDocument(WXMLNode *clone_from);
+				WXMLDocument(WXMLState *state, const char *text);
+				WXMLDocument(WXMLState *state, mxml_node_t *root_node);
 				~WXMLDocument();
-				WXMLNode *GetRootNode()
-				{
-					return GetNode(root_node);
-				}
-				WXMLNode *GetNode(mxml_node_t *node);
-				void MergeInto(WXMLDocument *other);
-			private:
+
 				mxml_node_t *root_node;
-				std::map<mxml_node_t*, WXMLNode*> nodes;
 
-				WXMLDocument(mxml_node_t *root_node);
+				// The state of the VM the document belongs to
+				WXMLState *state;
+
+				// The number of arena slots pointing at nodes in this document
+				uint32_t handles = 0;
+
+				// Incremented whenever the structure of the document changes (elements added, removed
+				// or renamed), so the name index knows when it's out of date.
+				uint64_t generation = 0;
+
+				// Every element in the document by name, in document order. Each element is numbered in
+				// document order, and the range of numbers covered by it and it's descendants is recorded,
+				// so the elements with a given name below any other element can be found with a binary search.
+				// This is built the first time a query needs it, and rebuilt if the document has changed since.
+				struct indexed_element
+				{
+					uint32_t order;
+					mxml_node_t *node;
+				};
+				std::unordered_map<std::string, std::vector<indexed_element>> name_index;
+				std::unordered_map<mxml_node_t*, std::pair<uint32_t, uint32_t>> element_ranges;
+				uint64_t index_generation = UINT64_MAX;
 
-				friend class WXMLNode;
+				void UpdateIndex();
 			};
 
-			// Note that having nodes open does not prevent the main object from being GC'd
-			class WXMLNode
+			// Every node Wren has a reference to gets a slot in a single arena, and the Wren objects only hold
+			// the slot's index. The index is also stored in the node's mxml user data, so going from a node to
+			// it's slot doesn't need a lookup. Moving nodes between documents only means updating the slots
+			// of the nodes that were moved, and walking a document doesn't allocate anything after the first
+			// few nodes as the slots are reused.
+			struct WXMLSlot
 			{
-			public:
-				WXMLDocument *root;
-				mxml_node_t *handle;
-				void Use()
-				{
-					usages++;
-				}
-				void Release();
-				WXMLDocument* MoveToNewDocument();
-			private:
-				WXMLNode(WXMLDocument *root, mxml_node_t *handle);
+				mxml_node_t *node = nullptr; // Null if the document was deleted while Wren still referred to it
+				WXMLDocument *doc = nullptr;
+				uint32_t refs = 0; // The number of Wren objects using this slot
+			};
+
+			// What's stored in the Wren XML object
+			struct WXMLHandle
+			{
+				uint32_t slot;
+				WXMLState *state;
+			};
+
+			// What's stored in the Wren XMLBuffer object: a view of text that's owned by C++. There's only
+			// one of these, which the tweaker points at each file in turn (see Internal.use_buffer_view), and
+			// it's cleared once the tweak finishes so Wren can't read it after the text has been freed.
+			struct WXMLBuffer
+			{
+				const char *data;
+				size_t length;
+			};
 
-				int usages;
+			// Everything that belongs to a single VM, so more than one VM can be working with XML at once.
+			// This is only touched by that VM's foreign methods and finalisers, so it's protected by it's lock.
+			struct WXMLState
+			{
+				std::vector<WXMLSlot> node_slots;
+				std::vector<uint32_t> free_slots;
 
-				friend class WXMLDocument;
+				// The single XMLBuffer object. The handle keeps it alive, so the data pointer stays valid
+				// until it's released.
+				WrenHandle *input_buffer = nullptr;
+				WXMLBuffer *input_buffer_data = nullptr;
 			};
 
+			// Put the input buffer in a slot, pointing at the given text. The text has to stay valid until
+			// clear_input_buffer is called. Only call these with the VM lock held.
+			void set_input_buffer(WrenVM* vm, int slot, const char *text, size_t length);
+			void clear_input_buffer(WrenVM* vm);
+			bool is_input_buffer(WrenVM* vm, int slot);
+
+			// Write an XML element in a slot out as text, straight into output. Returns false if the slot
+			// doesn't hold an open XML element.
+			bool get_element_text(WrenVM* vm, int slot, std::string& output);
+
+			void release_wren_handles(WrenVM* vm);
+
+			// mxml is built without thread support, so it only has a single error callback for the whole
+			// process. Rather than calling mxmlSetErrorCallback, set the handler for the current thread with
+			// this, which is used for any mxml errors on that thread. By default, errors are fatal.
+			typedef void (*mxml_error_handler)(const char *error);
+			void set_mxml_error_handler(mxml_error_handler handler);
+
 			WrenForeignMethodFn bind_wxml_method(
 			    WrenVM* vm,
 			    const char* module,
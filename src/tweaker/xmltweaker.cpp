@@ -1,9 +1,15 @@
 #include "global.h"
 #include "xmltweaker_internal.h"
+#include "declarative_tweaks.h"
+#include "tweak_cache.h"
 #include <stdio.h>
+#include <atomic>
 #include <fstream>
-#include <unordered_set>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <vector>
 #include <string.h>
 #include "util/util.h"
 
@@ -17,14 +23,27 @@ using blt::idfile;
 
 bool pd2hook::tweaker::tweaker_enabled = true;
 
-static unordered_set<char*> buffers;
+// Tweaked text that's been given to the engine and not yet freed. The engine parses files on more than one
+// thread, but always frees them on the thread that tweaked them.
+static thread_local vector<shared_ptr<const string>> handed_out;
 static set<idfile> ignored_files;
 
+// Files that mods have said they tweak, and whether they can be tweaked on a pooled VM. This is written from Wren
+// and read from whichever thread the game is parsing XML on.
+static mutex tweaked_files_mutex;
+static map<idfile, bool> tweaked_files;
+static atomic<bool> tweak_index_enabled{false};
+
+static atomic<uint64_t> stat_parsed{0};
+static atomic<uint64_t> stat_unregistered{0};
+static atomic<uint64_t> stat_transformed{0};
+static atomic<uint64_t> stat_streamed{0};
+
 // The file we last parsed. If we try to parse the same file more than
 // once, nothing should happen as a file from the filesystem is being loaded.
 idfile last_parsed;
 
-char* tweaker::tweak_pd2_xml(char* text, int text_length)
+char* tweaker::tweak_pd2_xml(char* text, int text_length, int* tweaked_length)
 {
 	if (!tweaker_enabled)
 	{
@@ -56,46 +75,98 @@ char* tweaker::tweak_pd2_xml(char* text, int text_length)
 		return text;
 	}
 
-	const char* new_text = transform_file(text);
+	stat_parsed++;
 
-	// If the text is not to be altered, we can return it as is.
-	if (new_text == text) return text;
+	size_t length = strlen(text);
+
+	// Run the declarative tweaks first, since they don't need Wren. Anything scripted then sees their result.
+	// Whichever stage last changed the file owns the text, so it can be handed to the engine without copying it.
+	shared_ptr<const string> result;
+	const char* source = text;
+	{
+		string streamed;
+		if (declarative::apply_registered(file, text, length, streamed))
+		{
+			stat_streamed++;
+			result = make_shared<const string>(move(streamed));
+			source = result->c_str();
+			length = result->size();
+		}
+	}
+
+	// If the basemod has told us which files are tweaked, don't bother entering Wren for anything else.
+	// Note this is only enabled once the Wren VM has started, so the first file still goes through and starts it.
+	// Without the index, any tweaker could be looking at the file, so it has to be tweaked on the main VM.
+	bool scripted = true;
+	bool pool_safe = false;
+	if (tweak_index_enabled)
+	{
+		lock_guard<mutex> lock(tweaked_files_mutex);
+		auto exact = tweaked_files.find(file);
+		auto wildcard = tweaked_files.find(idfile(0, file.ext));
+		scripted = exact != tweaked_files.end() || wildcard != tweaked_files.end();
+		pool_safe = scripted && (exact == tweaked_files.end() || exact->second) &&
+		            (wildcard == tweaked_files.end() || wildcard->second);
+	}
+
+	// If we've seen this exact file before with the same mods loaded, reuse whatever the tweakers did last time
+	bool use_cache = scripted && tweak_cache::is_enabled();
+	tweak_cache::cache_key cache_key;
+	shared_ptr<const string> scripted_result;
+	bool cache_hit = false;
+	if (use_cache)
+	{
+		cache_key = tweak_cache::make_key(file, source, length);
+		cache_hit = tweak_cache::lookup(cache_key, scripted_result);
+	}
 
-	// Otherwise, copy it so it's not invalidated by another Wren call
+	if (!scripted)
+	{
+		stat_unregistered++;
+	}
+	else if (!cache_hit)
+	{
+		stat_transformed++;
+		if (use_cache)
+			tweak_cache::begin_tweak();
 
-	size_t length = strlen(new_text) + 1; // +1 for the null
+		scripted_result = transform_file(source, length, pool_safe);
 
-	char* buffer = (char*)malloc(length);
-	buffers.insert(buffer);
+		if (use_cache)
+			tweak_cache::store(cache_key, scripted_result);
+	}
 
-	portable_strncpy(buffer, new_text, length);
+	if (scripted_result)
+		result = scripted_result;
 
-	//if (!strncmp(new_text, "<network>", 9)) {
-	//	std::ofstream out("output.txt");
-	//	out << new_text;
-	//	out.close();
-	//}
+	// If the text is not to be altered, we can return it as is.
+	if (!result)
+		return text;
 
-	/*static int counter = 0;
-	if (counter++ == 1) {
-		printf("%s\n", buffer);
+	// Otherwise hand over the text, keeping it alive until the engine is done with it. On Linux the engine's parser
+	// takes it as const, so the text shared with the cache can be handed over as is. Nothing says the Windows parser
+	// won't write into it though, and other threads may be reading the same cached text, so give it it's own copy.
+#ifdef _WIN32
+	result = make_shared<const string>(*result);
+#endif
+	handed_out.push_back(result);
 
-		const int kMaxCallers = 62;
-		void* callers[kMaxCallers];
-		int count = CaptureStackBackTrace(0, kMaxCallers, callers, NULL);
-		for (int i = 0; i < count; i++)
-			printf("*** %d called from .text:%08X\n", i, callers[i]);
-		Sleep(20000);
-	}*/
+	if (tweaked_length)
+		*tweaked_length = (int)result->size();
 
-	return (char*)buffer;
+	return const_cast<char*>(result->c_str());
 }
 
 void tweaker::free_tweaked_pd2_xml(char* text)
 {
-	if (buffers.erase(text))
+	// The engine frees the text straight after parsing it on the same thread, so this is nearly always the last one
+	for (auto iter = handed_out.rbegin(); iter != handed_out.rend(); ++iter)
 	{
-		free(text);
+		if ((*iter)->c_str() == text)
+		{
+			handed_out.erase(next(iter).base());
+			return;
+		}
 	}
 }
 
@@ -103,3 +174,39 @@ void pd2hook::tweaker::ignore_file(idfile file)
 {
 	ignored_files.insert(file);
 }
+
+void pd2hook::tweaker::register_tweaked_file(idfile file, bool pool_safe)
+{
+	tweak_cache::note_environment(&file, sizeof(file));
+
+	// If anything tweaking the file needs the main VM, the whole file does
+	lock_guard<mutex> lock(tweaked_files_mutex);
+	auto result = tweaked_files.emplace(file, pool_safe);
+	if (!result.second)
+		result.first->second = result.first->second && pool_safe;
+}
+
+void pd2hook::tweaker::set_tweak_index_enabled(bool enabled)
+{
+	tweak_index_enabled = enabled;
+}
+
+tweaker::tweak_stats pd2hook::tweaker::get_tweak_stats(bool reset)
+{
+	tweak_stats stats;
+	if (reset)
+	{
+		stats.parsed = stat_parsed.exchange(0);
+		stats.unregistered = stat_unregistered.exchange(0);
+		stats.transformed = stat_transformed.exchange(0);
+		stats.streamed = stat_streamed.exchange(0);
+	}
+	else
+	{
+		stats.parsed = stat_parsed;
+		stats.unregistered = stat_unregistered;
+		stats.transformed = stat_transformed;
+		stats.streamed = stat_streamed;
+	}
+	return stats;
+}
@@ -2,15 +2,36 @@
 
 #include "platform.h"
 
+#include <stdint.h>
+
 namespace pd2hook
 {
 	namespace tweaker
 	{
-		char* tweak_pd2_xml(char* text, int text_length);
+		// Returns either the original text, or tweaked text that stays valid until it's passed to
+		// free_tweaked_pd2_xml on the same thread. If it's changed, tweaked_length is set to the new length.
+		char* tweak_pd2_xml(char* text, int text_length, int* tweaked_length = nullptr);
 		void free_tweaked_pd2_xml(char* text);
 
 		void ignore_file(blt::idfile file);
 
+		// Mods declare which files they tweak, and once the index is enabled only those files are sent to Wren.
+		// A name of zero matches every file with the given extension. A file is only tweaked on one of the pooled
+		// VMs if every registration that matches it says it's pool-safe, otherwise it goes to the main VM.
+		void register_tweaked_file(blt::idfile file, bool pool_safe = false);
+		void set_tweak_index_enabled(bool enabled);
+
+		struct tweak_stats
+		{
+			uint64_t parsed = 0; // XML files passed to tweak_pd2_xml
+			uint64_t unregistered = 0; // Skipped without entering Wren, since no mod tweaks them
+			uint64_t transformed = 0; // Sent to Wren
+			uint64_t streamed = 0; // Changed by declarative tweaks, without needing Wren
+		};
+
+		// Get the counters since the last reset, and optionally reset them
+		tweak_stats get_tweak_stats(bool reset);
+
 		extern bool tweaker_enabled;
 	}; // namespace tweaker
 }; // namespace pd2hook
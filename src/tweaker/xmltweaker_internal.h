@@ -2,6 +2,7 @@
 
 #include "platform.h"
 #include "xmltweaker.h"
+#include <memory>
 #include <string>
 
 namespace pd2hook
@@ -9,10 +10,12 @@ namespace pd2hook
 	namespace tweaker
 	{
 		/**
-		 * Transforms the contents of the file
-		 * the return result MUST be valid immediately after the call returns,
-		 * but not necessaraly after that.
+		 * Runs the Wren tweakers over the contents of the file. Returns null if they didn't change
+		 * it, otherwise the new contents, which are owned by the caller and so can be handed to
+		 * the engine (and kept in the cache) without copying them again.
+		 *
+		 * Unless pool_safe is set, this always runs on the main VM.
 		 */
-		const char* transform_file(const char* contents);
+		std::shared_ptr<const std::string> transform_file(const char* contents, size_t length, bool pool_safe);
 	}; // namespace tweaker
 }; // namespace pd2hook
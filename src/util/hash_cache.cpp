@@ -0,0 +1,184 @@
+#include "util.h"
+#include "threading/scheduler.h"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+// Remembers the hash of every file GetFileHash and GetDirectoryHash have read, so a file that hasn't changed since the
+// last launch doesn't have to be read again. Each entry is checked against the file's size, modification time and inode
+// (the file index on Windows), so anything replacing or editing the file means it's hashed again.
+//
+// The cache is a text file with a line for each file: the hash, size, time, inode and then the path.
+
+namespace
+{
+	struct FileStamp
+	{
+		uint64_t size = 0;
+		int64_t time = 0;
+		uint64_t inode = 0;
+
+		bool operator==(const FileStamp& other) const
+		{
+			return size == other.size && time == other.time && inode == other.inode;
+		}
+	};
+
+	struct CacheEntry
+	{
+		FileStamp stamp;
+		std::string hash;
+	};
+}
+
+static const char* cacheFilename = "mods/saves/.sblt_hashcache";
+static const char* cacheHeader = "SBLT hash cache 1";
+
+static std::mutex cacheMutex;
+static bool cacheLoaded = false;
+static bool saveScheduled = false;
+static std::unordered_map<std::string, CacheEntry> cacheEntries;
+
+static bool GetFileStamp(const std::string& filename, FileStamp& stamp)
+{
+#ifdef _WIN32
+	// Opening the file without asking for any access is enough to get it's index, and is much cheaper than reading it
+	HANDLE file = CreateFileA(filename.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	bool ok = GetFileInformationByHandle(file, &info) && !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+	CloseHandle(file);
+	if (!ok)
+		return false;
+
+	stamp.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	stamp.time = (int64_t)(((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime);
+	stamp.inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	return true;
+#else
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+		return false;
+
+	stamp.size = (uint64_t)info.st_size;
+	stamp.time = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+	stamp.inode = (uint64_t)info.st_ino;
+	return true;
+#endif
+}
+
+// Must be called with cacheMutex held
+static void LoadCache()
+{
+	cacheLoaded = true;
+
+	std::ifstream in(cacheFilename);
+	std::string line;
+	if (!std::getline(in, line) || line != cacheHeader)
+		return;
+
+	while (std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		CacheEntry entry;
+		fields >> entry.hash >> entry.stamp.size >> entry.stamp.time >> entry.stamp.inode;
+
+		// The path is everything after the single space following the inode, since it may contain spaces
+		std::string path;
+		if (fields.get() != ' ' || !std::getline(fields, path) || path.empty() || entry.hash.size() != 64)
+			continue;
+
+		cacheEntries[path] = std::move(entry);
+	}
+}
+
+static void SaveCache()
+{
+	std::string output = std::string(cacheHeader) + "\n";
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		saveScheduled = false;
+
+		for (const auto& pair : cacheEntries)
+		{
+			const CacheEntry& entry = pair.second;
+			output += entry.hash + " " + std::to_string(entry.stamp.size) + " " + std::to_string(entry.stamp.time) +
+				" " + std::to_string(entry.stamp.inode) + " " + pair.first + "\n";
+		}
+	}
+
+	pd2hook::Util::EnsurePathWritable(cacheFilename);
+
+	// Write to a temporary file first, so if the game closes part-way through we don't leave a truncated cache
+	std::string tempFilename = std::string(cacheFilename) + ".tmp";
+	{
+		std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+		out.write(output.data(), (std::streamsize)output.size());
+		if (!out.good())
+		{
+			out.close();
+			remove(tempFilename.c_str());
+			return;
+		}
+	}
+
+#ifdef _WIN32
+	if (!MoveFileExA(tempFilename.c_str(), cacheFilename, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (rename(tempFilename.c_str(), cacheFilename) != 0)
+#endif
+	{
+		remove(tempFilename.c_str());
+	}
+}
+
+namespace pd2hook
+{
+	namespace Util
+	{
+		std::string GetCachedFileHash(const std::string& filename, FileHashFunction hasher)
+		{
+			// Get the stamp before hashing, so if the file changes while we're reading it the entry won't match next time
+			FileStamp stamp;
+			if (!GetFileStamp(filename, stamp))
+				return hasher(filename);
+
+			{
+				std::lock_guard<std::mutex> lock(cacheMutex);
+
+				if (!cacheLoaded)
+					LoadCache();
+
+				auto iter = cacheEntries.find(filename);
+				if (iter != cacheEntries.end() && iter->second.stamp == stamp)
+					return iter->second.hash;
+			}
+
+			std::string hash = hasher(filename);
+
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			cacheEntries[filename] = CacheEntry{stamp, hash};
+
+			// A directory hash updates a lot of entries at once, so wait a little before saving rather than writing the
+			// whole cache after each of them
+			if (!saveScheduled)
+			{
+				saveScheduled = true;
+				threading::submit_after(threading::priority::background, std::chrono::seconds(2), SaveCache);
+			}
+
+			return hash;
+		}
+	}
+}
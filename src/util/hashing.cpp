@@ -1,7 +1,6 @@
-#include <thread>
-
 #include "util.h"
 #include "threading/queue.h"
+#include "threading/scheduler.h"
 #include "lua.h"
 
 using namespace std;
@@ -19,37 +18,6 @@ struct HashInfo
 
 PD2HOOK_REGISTER_EVENTQUEUE(HashInfo, HashResult)
 
-class AsyncHashManager
-{
-private:
-	AsyncHashManager();
-
-public:
-	~AsyncHashManager();
-
-	static AsyncHashManager* GetSingleton();
-
-	std::list<std::unique_ptr<std::thread>> threadList;
-};
-
-AsyncHashManager::AsyncHashManager()
-{
-}
-
-AsyncHashManager::~AsyncHashManager()
-{
-	for_each(threadList.begin(), threadList.end(), [](const unique_ptr<thread>& t)
-	{
-		t->join();
-	});
-}
-
-AsyncHashManager* AsyncHashManager::GetSingleton()
-{
-	static AsyncHashManager instance;
-	return &instance;
-}
-
 static void done(HashInfo info)
 {
 	info.callback(info.L, info.ref, info.filename, info.result);
@@ -74,6 +42,5 @@ void pd2hook::Util::RunAsyncHash(lua_State *L, int ref, string filename, Directo
 
 	info.result = "<ERR:NOTSET>";
 
-	unique_ptr<thread> ptr = unique_ptr<thread>(new thread(run_async, info));
-	AsyncHashManager::GetSingleton()->threadList.push_back(move(ptr));
+	pd2hook::threading::submit(pd2hook::threading::priority::cpu, [info]() { run_async(info); });
 }
@@ -124,3 +124,8 @@ blt::idstring blt::idstring_hash(const std::string& text)
 {
 	return Hash64((const unsigned char*)text.c_str(), text.length(), 0);
 }
+
+blt::idstring blt::idstring_hash(const void* data, size_t length, idstring seed)
+{
+	return Hash64((const unsigned char*)data, length, seed);
+}
@@ -1,4 +1,6 @@
 #include "util.h"
+#include "threading/scheduler.h"
+#include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -54,15 +56,11 @@ namespace pd2hook
 			return stream.str();
 		}
 
-		//perform the SHA3-512 hash
-		std::string sha256(const std::string& input)
+		// Finish a hash and free it's context, returning the digest as a hex string
+		static std::string finish_sha256(EVP_MD_CTX* context)
 		{
 			uint32_t digest_length = 32;
-			const EVP_MD* algorithm = EVP_sha256();
 			uint8_t* digest = static_cast<uint8_t*>(OPENSSL_malloc(digest_length));
-			EVP_MD_CTX* context = EVP_MD_CTX_new();
-			EVP_DigestInit_ex(context, algorithm, nullptr);
-			EVP_DigestUpdate(context, input.c_str(), input.size());
 			EVP_DigestFinal_ex(context, digest, &digest_length);
 			EVP_MD_CTX_destroy(context);
 			std::string output = bytes_to_hex_string(std::vector<uint8_t>(digest, digest + digest_length));
@@ -70,6 +68,33 @@ namespace pd2hook
 			return output;
 		}
 
+		//perform the SHA3-512 hash
+		std::string sha256(const std::string& input)
+		{
+			EVP_MD_CTX* context = EVP_MD_CTX_new();
+			EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+			EVP_DigestUpdate(context, input.c_str(), input.size());
+			return finish_sha256(context);
+		}
+
+		// Hash a file a chunk at a time, rather than loading the whole thing. This gives the same result as
+		// sha256(GetFileContents(filename)), including hashing nothing if it can't be opened.
+		static std::string sha256_file(const std::string& filename)
+		{
+			EVP_MD_CTX* context = EVP_MD_CTX_new();
+			EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+
+			std::ifstream file(filename, std::ifstream::binary);
+			std::vector<char> buffer(65536);
+			while (file.good())
+			{
+				file.read(buffer.data(), buffer.size());
+				EVP_DigestUpdate(context, buffer.data(), (size_t)file.gcount());
+			}
+
+			return finish_sha256(context);
+		}
+
 		void RecurseDirectoryPaths(std::vector<std::string>& paths, std::string directory, bool ignore_versioning)
 		{
 			std::vector<std::string> dirs = pd2hook::Util::GetDirectoryContents(directory, true);
@@ -109,11 +134,18 @@ namespace pd2hook
 			//  way to change this without breaking hashing on previous versions.
 			std::sort(paths.begin(), paths.end(), CompareStringsCaseInsensitive);
 
+			// Hash the files in parallel, then put them together in the sorted order
+			std::vector<std::string> hashes(paths.size());
+			pd2hook::threading::parallel_for(pd2hook::threading::priority::cpu, paths.size(), [&](size_t i)
+			{
+				hashes[i] = GetCachedFileHash(paths[i], sha256_file);
+			});
+
 			std::string hashconcat;
+			hashconcat.reserve(hashes.size() * 64);
 
-			for (auto it = paths.begin(); it < paths.end(); it++)
+			for (const std::string& hashstr : hashes)
 			{
-				std::string hashstr = sha256(pd2hook::Util::GetFileContents(*it));
 				hashconcat += hashstr;
 			}
 
@@ -123,7 +155,7 @@ namespace pd2hook
 		std::string GetFileHash(std::string file)
 		{
 			// This has to be hashed twice otherwise it won't be the same hash if we're checking against a file uploaded to the server
-			std::string hash = sha256(pd2hook::Util::GetFileContents(file));
+			std::string hash = GetCachedFileHash(file, sha256_file);
 			return sha256(hash);
 		}
 
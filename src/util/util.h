@@ -50,6 +50,10 @@ namespace pd2hook
 		typedef void(*HashResultReceiver)(lua_State* L, int ref, std::string filename, std::string result);
 		void RunAsyncHash(lua_State *L, int ref, std::string filename, DirectoryHashFunction hasher, HashResultReceiver callback);
 
+		// See hash_cache.cpp
+		typedef std::string(*FileHashFunction)(const std::string&);
+		std::string GetCachedFileHash(const std::string& filename, FileHashFunction hasher);
+
 		class Exception : public std::exception
 		{
 		public:
@@ -243,6 +247,10 @@ namespace pd2hook
 namespace blt
 {
 	idstring idstring_hash(const std::string& text);
+
+	// Hash arbitrary data with the same function, without copying it into a string first. Passing a previous
+	// result as the seed chains hashes together.
+	idstring idstring_hash(const void* data, size_t length, idstring seed);
 }
 
 #endif // __UTIL_HEADER__
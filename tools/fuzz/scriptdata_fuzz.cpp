@@ -0,0 +1,32 @@
+// libFuzzer harness for the scriptdata reader. Anything that passes validate_scriptdata must decode and re-encode
+// without crashing, throwing or reading outside the buffer (which the sanitizers will catch).
+//
+// Build it with -DSBLT_BUILD_FUZZERS=ON and clang, then run it over a directory of real scriptdata files:
+//   ./scriptdata-fuzz corpus/
+
+#include <scriptdata/ScriptData.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+using namespace pd2hook::scriptdata;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (!validate_scriptdata(size, data))
+		return 0;
+
+	ScriptData sd(size, data);
+
+	// Write it back out in both layouts, and make sure what we write is valid too
+	for (bool use32bit : {false, true})
+	{
+		std::string output = sd.GetRoot()->Serialise(use32bit, size % 2 == 0);
+		if (!validate_scriptdata(output.size(), (const uint8_t*)output.data()))
+			abort();
+	}
+
+	return 0;
+}
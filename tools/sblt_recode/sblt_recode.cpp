@@ -0,0 +1,450 @@
+// sblt-recode: convert scriptdata and font assets between the 32-bit (Windows) and 64-bit (Linux) layouts
+// ahead of time, so SuperBLT doesn't have to recode them every time the game loads them.
+
+#include <scriptdata/FontData.h>
+#include <scriptdata/ScriptData.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace fs = std::filesystem;
+using namespace pd2hook::scriptdata;
+
+enum class asset_kind
+{
+	AUTO,
+	SCRIPTDATA,
+	FONT,
+};
+
+struct options_t
+{
+	bool to32bit = false;
+	bool intern = false;
+	bool dry_run = false;
+	bool verbose = false;
+	asset_kind kind = asset_kind::AUTO;
+	unsigned int jobs = 0;
+	fs::path output;
+	std::vector<fs::path> inputs;
+};
+
+// The file types the game loads as scriptdata. In auto mode, only files with one of these extensions are treated as
+// scriptdata. Passing validate_scriptdata isn't enough on it's own, since plenty of other binary files (shared libraries,
+// for example) happen to pass it, and recoding one of those would overwrite it with a few bytes of junk.
+static const char* const scriptdata_extensions[] = {
+	".achievement",
+	".action_message",
+	".comment",
+	".continent",
+	".continents",
+	".cover_data",
+	".credits",
+	".dialog",
+	".dialog_index",
+	".environment",
+	".hint",
+	".menu",
+	".mission",
+	".nav_data",
+	".objective",
+	".prefhud",
+	".sequence_manager",
+	".timeline",
+	".world",
+	".world_cameras",
+	".world_sounds",
+};
+
+struct job_t
+{
+	fs::path input;
+	fs::path output;
+};
+
+enum class result_t
+{
+	RECODED,
+	UNCHANGED, // Already the target width
+	SKIPPED, // Not a scriptdata or font file
+	FAILED,
+};
+
+static std::mutex log_mutex;
+
+static void print(std::ostream& stream, const std::string& msg)
+{
+	std::lock_guard<std::mutex> lock(log_mutex);
+	stream << msg << std::endl;
+}
+
+static void usage(const char* name)
+{
+	std::cerr << "Usage: " << name << " [options] <file or directory>...\n"
+	          << "Recodes scriptdata and font files to the given pointer width. Directories are searched recursively.\n"
+	          << "\n"
+	          << "Options:\n"
+	          << "  --to 32|64          Target width (default 64, as used by the Linux version of PAYDAY 2)\n"
+	          << "  --type TYPE         scriptdata, font or auto (default). In auto mode, .font files are treated as\n"
+	          << "                      fonts, files with a scriptdata extension (.world, .continent, .mission and\n"
+	          << "                      so on) as scriptdata, and everything else is skipped.\n"
+	          << "  -o, --output DIR    Write results into DIR, mirroring the input layout, rather than in-place\n"
+	          << "  -j, --jobs N        Number of worker threads (default: one per core)\n"
+	          << "  --intern            Write each distinct scriptdata value only once (smaller output)\n"
+	          << "  -n, --dry-run       Report what would be done without writing anything\n"
+	          << "  -v, --verbose       Print every file, not just the ones that fail\n";
+}
+
+static bool parse_args(int argc, char** argv, options_t& opts)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		auto next = [&]() -> const char* {
+			if (i + 1 >= argc)
+			{
+				std::cerr << "Missing value for " << arg << std::endl;
+				return nullptr;
+			}
+			return argv[++i];
+		};
+
+		if (arg == "-h" || arg == "--help")
+		{
+			return false;
+		}
+		else if (arg == "--to")
+		{
+			const char* val = next();
+			if (!val)
+				return false;
+
+			if (!strcmp(val, "32"))
+				opts.to32bit = true;
+			else if (!strcmp(val, "64"))
+				opts.to32bit = false;
+			else
+			{
+				std::cerr << "Invalid width '" << val << "', must be 32 or 64" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--type")
+		{
+			const char* val = next();
+			if (!val)
+				return false;
+
+			if (!strcmp(val, "scriptdata"))
+				opts.kind = asset_kind::SCRIPTDATA;
+			else if (!strcmp(val, "font"))
+				opts.kind = asset_kind::FONT;
+			else if (!strcmp(val, "auto"))
+				opts.kind = asset_kind::AUTO;
+			else
+			{
+				std::cerr << "Unknown type '" << val << "'" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "-o" || arg == "--output")
+		{
+			const char* val = next();
+			if (!val)
+				return false;
+			opts.output = val;
+		}
+		else if (arg == "-j" || arg == "--jobs")
+		{
+			const char* val = next();
+			if (!val)
+				return false;
+			opts.jobs = strtoul(val, nullptr, 10);
+		}
+		else if (arg == "--intern")
+		{
+			opts.intern = true;
+		}
+		else if (arg == "-n" || arg == "--dry-run")
+		{
+			opts.dry_run = true;
+		}
+		else if (arg == "-v" || arg == "--verbose")
+		{
+			opts.verbose = true;
+		}
+		else if (!arg.empty() && arg[0] == '-')
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+		else
+		{
+			opts.inputs.emplace_back(arg);
+		}
+	}
+
+	return !opts.inputs.empty();
+}
+
+static bool read_file(const fs::path& path, std::string& out)
+{
+	std::ifstream in(path, std::ios::in | std::ios::binary);
+	if (!in)
+		return false;
+
+	in.seekg(0, std::ios::end);
+	out.resize(in.tellg());
+	in.seekg(0, std::ios::beg);
+	in.read(&out[0], out.size());
+	return (bool)in;
+}
+
+static bool write_file(const fs::path& path, const std::string& data)
+{
+	std::error_code ec;
+	if (path.has_parent_path())
+		fs::create_directories(path.parent_path(), ec);
+
+	// Write to a temporary file first, so an interrupted run never leaves a half-written asset behind
+	fs::path temp = path;
+	temp += ".sblt-recode-tmp";
+
+	{
+		std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+		out.write(data.data(), data.size());
+		if (!out)
+			return false;
+	}
+
+	fs::rename(temp, path, ec);
+	if (ec)
+	{
+		fs::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+// Extensions are matched case-insensitively, so .FONT and .World are recognised too
+static std::string lowercase_extension(const fs::path& path)
+{
+	std::string ext = path.extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)tolower(c); });
+	return ext;
+}
+
+static bool has_scriptdata_extension(const std::string& ext)
+{
+	for (const char* known : scriptdata_extensions)
+	{
+		if (ext == known)
+			return true;
+	}
+	return false;
+}
+
+static result_t recode(const options_t& opts, const job_t& job)
+{
+	asset_kind kind = opts.kind;
+	if (kind == asset_kind::AUTO)
+	{
+		std::string ext = lowercase_extension(job.input);
+		if (ext == ".font")
+		{
+			kind = asset_kind::FONT;
+		}
+		else if (has_scriptdata_extension(ext))
+		{
+			kind = asset_kind::SCRIPTDATA;
+		}
+		else
+		{
+			if (opts.verbose)
+				print(std::cout, "Skipping " + job.input.string() + " (not a scriptdata or font file)");
+			return result_t::SKIPPED;
+		}
+	}
+
+	std::string contents;
+	if (!read_file(job.input, contents))
+	{
+		print(std::cerr, "Cannot read " + job.input.string());
+		return result_t::FAILED;
+	}
+
+	const uint8_t* data = (const uint8_t*)contents.data();
+	size_t length = contents.size();
+
+	std::string result;
+	bool unchanged = false;
+	try
+	{
+		if (kind == asset_kind::FONT)
+		{
+			if (font::FontData::is32bit(length, data) == opts.to32bit)
+			{
+				unchanged = true;
+			}
+			else
+			{
+				font::FontData fd(length, data);
+				result = fd.Export(opts.to32bit);
+			}
+		}
+		else
+		{
+			validation_result valid = validate_scriptdata(length, data);
+			if (!valid)
+			{
+				// Mods often ship scriptdata files in their XML form, which the game also accepts, so in auto mode
+				// these aren't an error
+				if (opts.kind == asset_kind::AUTO)
+				{
+					if (opts.verbose)
+						print(std::cout, "Skipping " + job.input.string() + " (not binary scriptdata)");
+					return result_t::SKIPPED;
+				}
+				throw ScriptDataError(valid);
+			}
+
+			if (determine_is_32bit(length, data) == opts.to32bit && !opts.intern)
+			{
+				unchanged = true;
+			}
+			else
+			{
+				ScriptData sd(length, data);
+				result = sd.GetRoot()->Serialise(opts.to32bit, opts.intern);
+			}
+		}
+	}
+	catch (const std::runtime_error& ex)
+	{
+		print(std::cerr, "Cannot recode " + job.input.string() + ": " + ex.what());
+		return result_t::FAILED;
+	}
+
+	// Nothing to do for files that are already in the right format, unless they're going somewhere else
+	if (unchanged)
+	{
+		if (opts.verbose)
+			print(std::cout, "Unchanged " + job.input.string());
+
+		if (job.output == job.input || opts.dry_run)
+			return result_t::UNCHANGED;
+
+		result = std::move(contents);
+	}
+	else if (opts.verbose)
+	{
+		print(std::cout, "Recoded " + job.input.string() + " (" + std::to_string(length) + " -> " +
+		                     std::to_string(result.size()) + " bytes)");
+	}
+
+	if (!opts.dry_run && !write_file(job.output, result))
+	{
+		print(std::cerr, "Cannot write " + job.output.string());
+		return result_t::FAILED;
+	}
+
+	return unchanged ? result_t::UNCHANGED : result_t::RECODED;
+}
+
+static void collect_jobs(const options_t& opts, std::vector<job_t>& jobs)
+{
+	for (const fs::path& input : opts.inputs)
+	{
+		std::error_code ec;
+		if (fs::is_directory(input, ec))
+		{
+			for (auto it = fs::recursive_directory_iterator(input, ec); !ec && it != fs::recursive_directory_iterator();
+			     it.increment(ec))
+			{
+				if (!it->is_regular_file(ec))
+					continue;
+
+				fs::path rel = fs::relative(it->path(), input, ec);
+				fs::path out = opts.output.empty() ? it->path() : opts.output / rel;
+				jobs.push_back(job_t{it->path(), out});
+			}
+
+			if (ec)
+				print(std::cerr, "Error while listing " + input.string() + ": " + ec.message());
+		}
+		else
+		{
+			fs::path out = opts.output.empty() ? input : opts.output / input.filename();
+			jobs.push_back(job_t{input, out});
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	options_t opts;
+	if (!parse_args(argc, argv, opts))
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	std::vector<job_t> jobs;
+	collect_jobs(opts, jobs);
+
+	// Do the biggest files first, so one big world file doesn't end up holding up the whole run at the end
+	std::vector<std::pair<uintmax_t, size_t>> order;
+	order.reserve(jobs.size());
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		std::error_code ec;
+		uintmax_t size = fs::file_size(jobs[i].input, ec);
+		order.emplace_back(ec ? 0 : size, i);
+	}
+	std::sort(order.begin(), order.end(), std::greater<>());
+
+	unsigned int thread_count = opts.jobs ? opts.jobs : std::max(1u, std::thread::hardware_concurrency());
+	thread_count = std::min<size_t>(thread_count, std::max<size_t>(1, jobs.size()));
+
+	std::atomic<size_t> next_job{0};
+	std::atomic<size_t> counts[4] = {};
+
+	auto worker = [&]() {
+		while (true)
+		{
+			size_t i = next_job++;
+			if (i >= order.size())
+				return;
+
+			result_t res = recode(opts, jobs[order[i].second]);
+			counts[(int)res]++;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < thread_count; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (std::thread& t : threads)
+		t.join();
+
+	std::cout << counts[(int)result_t::RECODED] << " recoded, " << counts[(int)result_t::UNCHANGED]
+	          << " already " << (opts.to32bit ? "32" : "64") << "-bit, " << counts[(int)result_t::SKIPPED]
+	          << " skipped, " << counts[(int)result_t::FAILED] << " failed" << std::endl;
+
+	return counts[(int)result_t::FAILED] ? 1 : 0;
+}